@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <expat.h>
 #include <regex.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -23,12 +23,17 @@
 #include <string>
 #include <stdexcept>
 
+#include <sys/eventfd.h>
+
+#include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <regex.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -37,8 +42,16 @@
 #include <clearsync/csutil.h>
 #include <clearsync/csevent.h>
 
+static time_t cs_monotonic_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
 csEvent::csEvent(csevent_id_t id, csevent_flag_t flags)
-    : id(id), flags(flags), src(NULL), dst(NULL), user_data(NULL) { }
+    : id(id), flags(flags), src(NULL), dst(NULL), user_data(NULL),
+    timestamp(0) { }
 
 csEvent *csEvent::Clone(void)
 {
@@ -69,7 +82,8 @@ vector<csEventClient *> csEventClient::event_client;
 pthread_mutex_t *csEventClient::event_client_mutex = NULL;
 
 csEventClient::csEventClient()
-    : event_enable(true)
+    : event_enable(true), event_count(0), event_wakeups(0),
+    event_pop_time(cs_monotonic_time()), event_fd(-1)
 {
     pthread_condattr_t cond_attr;
 
@@ -110,6 +124,8 @@ csEventClient::~csEventClient()
         i != event_queue.end(); i++) EventDestroy((*i));
     event_queue.clear();
 
+    if (event_fd != -1) close(event_fd);
+
     for (vector<csEventClient *>::iterator i = event_client.begin();
         i != event_client.end(); i++) {
         if ((*i) != this) continue;
@@ -158,6 +174,7 @@ void csEventClient::EventPush(csEvent *event, csEventClient *src)
     }
 
     event->SetSource(src);
+    event->SetTimestamp(cs_monotonic_time());
 
     if (event->IsHighPriority())
         event_queue.insert(event_queue.begin(), event);
@@ -167,6 +184,13 @@ void csEventClient::EventPush(csEvent *event, csEventClient *src)
     csLog::Log(csLog::Debug, "EventPush: src: %p, dst: %p, id: %04x",
         src, this, event->GetId());
 #endif
+    if (event_fd != -1 && event_queue.size() == 1) {
+        uint64_t count = 1;
+        if (write(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            csLog::Log(csLog::Error, "Error signalling event: %s",
+                strerror(errno));
+        }
+    }
     pthread_cond_broadcast(&event_condition);
     pthread_mutex_unlock(&event_queue_mutex);
 }
@@ -210,6 +234,8 @@ csEvent *csEventClient::EventPop(void)
     pthread_mutex_lock(&event_queue_mutex);
 
     if (event_queue.size()) {
+        event_count++;
+        event_pop_time = cs_monotonic_time();
         event = event_queue.front();
         if (event->IsSticky())
             event = event->Clone();
@@ -226,6 +252,63 @@ csEvent *csEventClient::EventPop(void)
     return event;
 }
 
+int csEventClient::EventGetDescriptor(void)
+{
+    pthread_mutex_lock(&event_queue_mutex);
+
+    if (event_fd == -1) {
+        event_fd = eventfd((event_queue.size()) ? 1 : 0,
+            EFD_CLOEXEC | EFD_NONBLOCK);
+        if (event_fd == -1) {
+            int rc = errno;
+            pthread_mutex_unlock(&event_queue_mutex);
+            throw csException(rc, "eventfd");
+        }
+    }
+
+    pthread_mutex_unlock(&event_queue_mutex);
+
+    return event_fd;
+}
+
+void csEventClient::EventDrain(vector<csEvent *> &events)
+{
+    pthread_mutex_lock(&event_queue_mutex);
+    events.insert(events.end(), event_queue.begin(), event_queue.end());
+    event_queue.clear();
+    pthread_mutex_unlock(&event_queue_mutex);
+}
+
+void csEventClient::EventQueueStatus(size_t &length,
+    time_t &oldest_age, time_t &pop_age)
+{
+    time_t now = cs_monotonic_time();
+
+    pthread_mutex_lock(&event_queue_mutex);
+
+    length = event_queue.size();
+    oldest_age = pop_age = 0;
+
+    if (length) {
+        // Events are stamped as they're queued: the rest in order at the
+        // back, high priority events at the front (newest first).  The
+        // oldest is the first that isn't high priority, or the last one
+        // before it that is, so only the high priority run is walked.
+        time_t oldest = now;
+        for (vector<csEvent *>::iterator i = event_queue.begin();
+            i != event_queue.end(); i++) {
+            if ((*i)->GetTimestamp() < oldest) oldest = (*i)->GetTimestamp();
+            if (!(*i)->IsHighPriority()) break;
+        }
+        oldest_age = now - oldest;
+
+        // Only count time without progress while work is pending
+        pop_age = now - ((event_pop_time > oldest) ? event_pop_time : oldest);
+    }
+
+    pthread_mutex_unlock(&event_queue_mutex);
+}
+
 csEvent *csEventClient::EventPopWait(time_t wait_ms)
 {
     int rc;
@@ -255,11 +338,13 @@ csEvent *csEventClient::EventPopWait(time_t wait_ms)
         if (wait_ms == 0) {
             rc = pthread_cond_wait(&event_condition, &event_condition_mutex);
             pthread_mutex_unlock(&event_condition_mutex);
+            event_wakeups++;
         }
         else {
             rc = pthread_cond_timedwait(
                 &event_condition, &event_condition_mutex, &ts_abstime);
             pthread_mutex_unlock(&event_condition_mutex);
+            event_wakeups++;
             if (rc == ETIMEDOUT) break;
         }
         if (rc != 0) throw csException(rc, "pthread_cond_wait");
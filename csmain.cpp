@@ -22,16 +22,26 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <sstream>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <netinet/in.h>
 
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -46,8 +56,10 @@
 #include <limits.h>
 #include <dirent.h>
 #include <regex.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
+#include <math.h>
 
 #define OPENSSL_THREAD_DEFINES
 #include <openssl/opensslconf.h>
@@ -62,14 +74,36 @@
 #include <clearsync/csevent.h>
 #include <clearsync/csutil.h>
 #include <clearsync/csthread.h>
+#include <clearsync/csstate.h>
+#include <clearsync/csstore.h>
+#include <clearsync/csvalue.h>
+#include <clearsync/csring.h>
 #include <clearsync/cstimer.h>
 #include <clearsync/csnetlink.h>
+#include <clearsync/cssocket.h>
 #include <clearsync/csplugin.h>
 
 #include "csmain.h"
 
 static pthread_mutex_t **csCryptoMutex = NULL;
 
+static void cs_exec_path(const char *argv0, char *path, size_t length)
+{
+    ssize_t rc = readlink("/proc/self/exe", path, length - 1);
+    if (rc > 0) {
+        // An upgraded binary replaces the running one on disk
+        const char *deleted = " (deleted)";
+        path[rc] = '\0';
+        if ((size_t)rc > strlen(deleted) &&
+            !strcmp(path + rc - strlen(deleted), deleted))
+            path[rc - strlen(deleted)] = '\0';
+    }
+    else {
+        strncpy(path, argv0, length - 1);
+        path[length - 1] = '\0';
+    }
+}
+
 static void cs_crypto_lock(int mode, int n, const char *file, int line)
 {
     if (csCryptoMutex == NULL) {
@@ -114,6 +148,14 @@ void *csSignalHandler::Entry(void)
             EventBroadcast(new csEvent(csEVENT_RELOAD));
             break;
 
+        case SIGUSR1:
+            EventDispatch(new csEvent(csEVENT_STATS), parent);
+            break;
+
+        case SIGUSR2:
+            EventDispatch(new csEvent(csEVENT_REEXEC), parent);
+            break;
+
         case SIGCHLD:
             Reaper();
             break;
@@ -147,6 +189,206 @@ void csSignalHandler::Reaper()
     }
 }
 
+void *csPluginStopper::Entry(void)
+{
+    if (join_only) plugin->Join();
+    else plugin->Stop();
+    EventDispatch(new csEvent(csEVENT_STOPPED), parent);
+    return NULL;
+}
+
+csPluginProcess::csPluginProcess(const string &name, csEventClient *parent,
+    size_t stack_size, char **argv, time_t quit_timeout)
+    : csPlugin(name, parent, stack_size), argv(argv),
+    quit_timeout(quit_timeout), pid(-1), shm(NULL), shm_size(0),
+    fd_lifeline(-1), ring_tx(NULL), ring_rx(NULL), ring_thread(NULL)
+{
+    fd_doorbell[0] = fd_doorbell[1] = -1;
+}
+
+csPluginProcess::~csPluginProcess()
+{
+    Stop();
+
+    // Only if the plugin thread failed to start, see Entry()
+    if (pid > 0 && ring_rx != NULL && ring_rx->IsOpen()) {
+        kill(pid, SIGKILL);
+        ring_rx->WaitClose();
+    }
+
+    if (ring_thread != NULL) delete ring_thread;
+    if (ring_tx != NULL) delete ring_tx;
+    if (ring_rx != NULL) delete ring_rx;
+    if (shm != NULL) munmap(shm, shm_size);
+    if (fd_doorbell[0] != -1) close(fd_doorbell[0]);
+    if (fd_doorbell[1] != -1) close(fd_doorbell[1]);
+    if (fd_lifeline != -1) close(fd_lifeline);
+}
+
+void csPluginProcess::Start(void)
+{
+    int rc, fd_shm = -1, fd_pair[2];
+    size_t ring_size = csEventRing::GetMemorySize(_CS_RING_SIZE);
+
+    shm_size = ring_size * 2;
+#ifdef HAVE_MEMFD_CREATE
+    fd_shm = memfd_create("clearsync-plugin", MFD_CLOEXEC);
+#endif
+    if (fd_shm == -1) {
+        FILE *fh_temp = tmpfile();
+        if (fh_temp != NULL) {
+            fd_shm = fcntl(fileno(fh_temp), F_DUPFD_CLOEXEC, 0);
+            fclose(fh_temp);
+        }
+    }
+    if (fd_shm == -1) throw csException(errno, "Plugin memory");
+    if (ftruncate(fd_shm, shm_size) < 0) {
+        rc = errno;
+        close(fd_shm);
+        throw csException(rc, "ftruncate");
+    }
+
+    shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_shm, 0);
+    if (shm == MAP_FAILED) {
+        rc = errno;
+        shm = NULL;
+        close(fd_shm);
+        throw csException(rc, "mmap");
+    }
+
+    fd_doorbell[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fd_doorbell[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd_doorbell[0] == -1 || fd_doorbell[1] == -1 ||
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd_pair) < 0) {
+        rc = errno;
+        close(fd_shm);
+        throw csException(rc, "Plugin doorbell");
+    }
+    fd_lifeline = fd_pair[0];
+
+    ring_tx = new csEventRing(shm, _CS_RING_SIZE,
+        fd_doorbell[0], fd_lifeline);
+    ring_rx = new csEventRing((uint8_t *)shm + ring_size, _CS_RING_SIZE,
+        fd_doorbell[1], fd_lifeline);
+    ring_tx->Reset();
+    ring_rx->Reset();
+
+    // Everything the helper needs is prepared before fork(), so that the
+    // child only makes async-signal-safe calls before exec.
+    char path[PATH_MAX];
+    cs_exec_path(argv[0], path, sizeof(path));
+
+    ostringstream os;
+    os << _CS_PLUGIN_HOST_ENV << "=" << fd_shm << "," <<
+        fd_doorbell[0] << "," << fd_doorbell[1] << "," <<
+        fd_pair[1] << "," << name;
+    string host = os.str();
+
+    vector<char *> envp;
+    size_t host_length = strlen(_CS_PLUGIN_HOST_ENV);
+    for (char **e = environ; *e != NULL; e++) {
+        if (!strncmp(*e, _CS_PLUGIN_HOST_ENV, host_length) &&
+            (*e)[host_length] == '=') continue;
+        envp.push_back(*e);
+    }
+    envp.push_back((char *)host.c_str());
+    envp.push_back(NULL);
+
+    int fd_host[4] = { fd_shm, fd_doorbell[0], fd_doorbell[1], fd_pair[1] };
+
+    pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < 4; i++) fcntl(fd_host[i], F_SETFD, 0);
+        execve(path, argv, &envp[0]);
+        _exit(127);
+    }
+
+    rc = errno;
+    close(fd_shm);
+    close(fd_pair[1]);
+    if (pid < 0) throw csException(rc, "fork");
+
+    csLog::Log(csLog::Info, "%s: Plugin process started: %d",
+        name.c_str(), pid);
+
+    ring_thread = new csThreadRing(ring_rx, parent, this);
+    ring_thread->SetThreadName("ring-" + name);
+    ring_thread->Start();
+
+    csThread::Start();
+}
+
+bool csPluginProcess::Quit(time_t wait_ms)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // A helper with a full ring may never make room for the quit
+    if (!ring_tx->Push(_CS_RING_QUIT, NULL, 0, wait_ms))
+        return !ring_tx->IsOpen();
+
+    if (wait_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wait_ms -= (now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (wait_ms < 0) wait_ms = 0;
+    }
+
+    return ring_tx->WaitClose(wait_ms);
+}
+
+void *csPluginProcess::Entry(void)
+{
+    bool running = true;
+    size_t dropped = 0;
+
+    for ( ;; ) {
+        csEvent *event = EventPopWait();
+
+        switch (event->GetId()) {
+        case csEVENT_QUIT:
+            EventDestroy(event);
+            if (dropped) {
+                csLog::Log(csLog::Warning, "%s: Dropped %lu event(s).",
+                    name.c_str(), dropped);
+            }
+            if (!running) return NULL;
+
+            // The helper stops its plugin and saves its state on quit.
+            // Give up a little before csMain gives up on us, so that a
+            // stuck helper is killed rather than left behind.
+            if (!Quit((quit_timeout > 0) ?
+                quit_timeout * 1000 - quit_timeout * 100 : -1)) {
+                csLog::Log(csLog::Error,
+                    "%s: Plugin process failed to exit, killed: %d",
+                    name.c_str(), pid);
+                kill(pid, SIGKILL);
+                ring_tx->WaitClose();
+            }
+            return NULL;
+
+        case csEVENT_PLUGIN:
+            // A stalled helper mustn't keep us from seeing a quit
+            if (!running ||
+                !ring_tx->Push(static_cast<csEventPlugin *>(event), 0))
+                dropped++;
+            break;
+
+        case csEVENT_STOPPED:
+            if (running) {
+                csLog::Log(csLog::Error, "%s: Plugin process exited: %d",
+                    name.c_str(), pid);
+                running = false;
+            }
+            break;
+        }
+
+        EventDestroy(event);
+    }
+
+    return NULL;
+}
+
 csMainXmlParser::csMainXmlParser(void)
     : csXmlParser() { }
 
@@ -166,7 +408,102 @@ void csMainXmlParser::ParseElementOpen(csXmlTag *tag)
         if (_conf->version > _CS_CONF_VERSION)
             ParseError("unsupported version, too new");
     }
+    else if ((*tag) == "thread") {
+        if (!stack.size() || (*stack.back()) != "csconf")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!tag->ParamExists("name"))
+            ParseError("name parameter missing");
+
+        csThread *thread = NULL;
+        if (tag->GetParamValue("name") == "timer")
+            thread = _conf->parent->timer_thread;
+        else if (tag->GetParamValue("name") == "netlink") {
+            thread = _conf->parent->netlink_thread;
+            if (tag->ParamExists("receive-buffer")) {
+                int size = atoi(
+                    tag->GetParamValue("receive-buffer").c_str());
+                if (size <= 0) {
+                    ParseError("invalid receive-buffer: " +
+                        tag->GetParamValue("receive-buffer"));
+                }
+                _conf->parent->netlink_thread->SetReceiveBufferSize(size);
+            }
+            if (tag->ParamExists("cache")) {
+                string cache = tag->GetParamValue("cache");
+                if (cache != "true" && cache != "false")
+                    ParseError("invalid cache: " + cache);
+                _conf->parent->netlink_thread->SetCacheEnabled(
+                    cache == "true");
+            }
+            if (tag->ParamExists("route-quiet-period")) {
+                long period = atol(
+                    tag->GetParamValue("route-quiet-period").c_str());
+                if (period < 0) {
+                    ParseError("invalid route-quiet-period: " +
+                        tag->GetParamValue("route-quiet-period"));
+                }
+                _conf->parent->netlink_thread->SetRouteQuietPeriod(
+                    (time_t)period);
+            }
+            if (tag->ParamExists("link-stats-interval")) {
+                long interval = atol(
+                    tag->GetParamValue("link-stats-interval").c_str());
+                if (interval < 0) {
+                    ParseError("invalid link-stats-interval: " +
+                        tag->GetParamValue("link-stats-interval"));
+                }
+                _conf->parent->netlink_thread->SetLinkStatsInterval(
+                    (time_t)interval);
+            }
+            if (tag->ParamExists("link-stats-interfaces")) {
+                // Comma and/or space separated interface names
+                string text = tag->GetParamValue("link-stats-interfaces");
+                size_t begin = 0, end;
+                while ((begin = text.find_first_not_of(", ", begin)) !=
+                    string::npos) {
+                    end = text.find_first_of(", ", begin);
+                    _conf->parent->netlink_thread->AddLinkStatsInterface(
+                        text.substr(begin, end - begin));
+                    begin = end;
+                }
+            }
+        }
+        else
+            ParseError("unknown thread: " + tag->GetParamValue("name"));
+
+        ParseThreadAttributes(tag, thread);
+    }
+    else if ((*tag) == "watchdog") {
+        if (!stack.size() || (*stack.back()) != "csconf")
+            ParseError("unexpected tag: " + tag->GetName());
+
+        if (tag->ParamExists("max-queue-age")) {
+            _conf->watchdog_queue_age = (time_t)atol(
+                tag->GetParamValue("max-queue-age").c_str());
+        }
+        if (tag->ParamExists("max-pop-age")) {
+            _conf->watchdog_pop_age = (time_t)atol(
+                tag->GetParamValue("max-pop-age").c_str());
+        }
+        if (tag->ParamExists("action")) {
+            string action = tag->GetParamValue("action");
+            if (action == "warn")
+                _conf->watchdog_action = csMainConf::WatchdogWarn;
+            else if (action == "event")
+                _conf->watchdog_action = csMainConf::WatchdogEvent;
+            else if (action == "restart")
+                _conf->watchdog_action = csMainConf::WatchdogRestart;
+            else
+                ParseError("invalid watchdog action: " + action);
+        }
+
+        csLog::Log(csLog::Debug,
+            "Watchdog: max-queue-age: %ld, max-pop-age: %ld, action: %d",
+            _conf->watchdog_queue_age, _conf->watchdog_pop_age,
+            _conf->watchdog_action);
+    }
     else if ((*tag == "plugin")) {
+        bool stack_size_auto = false;
         size_t stack_size = _CS_THREAD_STACK_SIZE;
 
         if (stack.size() != 0)
@@ -176,12 +513,20 @@ void csMainXmlParser::ParseElementOpen(csXmlTag *tag)
         if (!tag->ParamExists("library"))
             ParseError("library parameter missing");
         if (tag->ParamExists("stack-size")) {
-            stack_size = (size_t)atol(
-                tag->GetParamValue("stack-size").c_str());
-            if (stack_size < PTHREAD_STACK_MIN)
-                stack_size = PTHREAD_STACK_MIN;
-            else if (stack_size % ::csGetPageSize())
-                stack_size += (stack_size % ::csGetPageSize());
+            if (tag->GetParamValue("stack-size") == "auto")
+                stack_size_auto = true;
+            else {
+                stack_size = (size_t)atol(
+                    tag->GetParamValue("stack-size").c_str());
+            }
+        }
+
+        bool isolated = false;
+        if (tag->ParamExists("isolation")) {
+            string isolation = tag->GetParamValue("isolation");
+            if (isolation != "thread" && isolation != "process")
+                ParseError("invalid isolation: " + isolation);
+            isolated = (isolation == "process");
         }
 
         map<string, csPluginLoader *>::iterator i;
@@ -189,38 +534,109 @@ void csMainXmlParser::ParseElementOpen(csXmlTag *tag)
         if (i != _conf->parent->plugin.end())
             ParseError("duplicate plugin: " + tag->GetParamValue("name"));
 
+        // A plugin host loads only its own plugin, in-process
+        if (!_conf->parent->plugin_host.empty()) {
+            if (tag->GetParamValue("name") != _conf->parent->plugin_host)
+                return;
+            isolated = false;
+        }
+
         csPluginLoader *plugin = NULL;
 
         try {
-            plugin = new csPluginLoader(
-                tag->GetParamValue("library"),
-                tag->GetParamValue("name"), _conf->parent, stack_size);
+            if (isolated) {
+                plugin = new csPluginLoader(tag->GetParamValue("library"),
+                    new csPluginProcess(tag->GetParamValue("name"),
+                        _conf->parent, stack_size, _conf->argv,
+                        _conf->shutdown_timeout));
+            }
+            else {
+                plugin = new csPluginLoader(
+                    tag->GetParamValue("library"),
+                    tag->GetParamValue("name"), _conf->parent, stack_size);
+            }
         } catch (csException &e) {
             csLog::Log(csLog::Error, "Plugin loader failed: %s",
                 e.estring.c_str());
         }
 
         if (plugin != NULL) {
+            // Invalid thread attributes are a parse error, as they are on
+            // a thread tag: the plugin goes, and the error is passed on.
+            try {
+                ParseThreadAttributes(tag, plugin->GetPlugin());
+            } catch (csException &e) {
+                delete plugin->GetPlugin();
+                delete plugin;
+                throw;
+            }
+
             try {
                 plugin->GetPlugin()->SetConfigurationFile(_conf->filename);
+                // The helper process measures the plugin's own stack
+                if (stack_size_auto && !isolated)
+                    plugin->GetPlugin()->SetStackSizeAuto();
                 tag->SetData(plugin->GetPlugin());
                 _conf->parent->plugin[tag->GetParamValue("name")] = plugin;
 
                 csLog::Log(csLog::Debug,
-                    "Plugin: %s (%s), stack size: %ld",
+                    "Plugin: %s (%s), stack size: %ld%s%s",
                     tag->GetParamValue("name").c_str(),
-                    tag->GetParamValue("library").c_str(), stack_size);
+                    tag->GetParamValue("library").c_str(),
+                    plugin->GetPlugin()->GetStackSize(),
+                    (stack_size_auto) ? " (auto)" : "",
+                    (isolated) ? ", isolated" : "");
             } catch (csException &e) {
                 csLog::Log(csLog::Error,
                     "Configuration error: %s: %s: %s",
                     tag->GetParamValue("name").c_str(),
                     e.estring.c_str(), e.what());
+                delete plugin->GetPlugin();
                 delete plugin;
             }
         }
     }
 }
 
+void csMainXmlParser::ParseThreadAttributes(csXmlTag *tag, csThread *thread)
+{
+    if (tag->ParamExists("cpu-affinity")) {
+        cpu_set_t cpus;
+        try {
+            csStringToCpuList(tag->GetParamValue("cpu-affinity"), cpus);
+        } catch (csException &e) {
+            ParseError("invalid cpu-affinity: " + e.estring);
+        }
+        thread->SetCpuAffinity(cpus);
+    }
+
+    if (tag->ParamExists("nice")) {
+        int nice = atoi(tag->GetParamValue("nice").c_str());
+        if (nice < -20 || nice > 19)
+            ParseError("invalid nice: " + tag->GetParamValue("nice"));
+        thread->SetNice(nice);
+    }
+
+    if (tag->ParamExists("sched-policy")) {
+        int policy = csThread::GetSchedulingPolicy(
+            tag->GetParamValue("sched-policy"));
+        if (policy == -1) {
+            ParseError("invalid sched-policy: " +
+                tag->GetParamValue("sched-policy"));
+        }
+
+        int priority = 0;
+        if (tag->ParamExists("sched-priority"))
+            priority = atoi(tag->GetParamValue("sched-priority").c_str());
+        if (priority < sched_get_priority_min(policy) ||
+            priority > sched_get_priority_max(policy)) {
+            ParseError("invalid sched-priority for policy: " +
+                tag->GetParamValue("sched-policy"));
+        }
+        thread->SetSchedulingPolicy(policy, priority);
+    }
+}
+
 void csMainXmlParser::ParseElementClose(csXmlTag *tag)
 {
     string text = tag->GetText();
@@ -237,6 +653,35 @@ void csMainXmlParser::ParseElementClose(csXmlTag *tag)
             "Plug-in configuration directory: %s",
             _conf->plugin_dir.c_str());
     }
+    else if ((*tag) == "stats-interval") {
+        if (!stack.size() || (*stack.back()) != "csconf")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!text.size())
+            ParseError("missing value for tag: " + tag->GetName());
+
+        _conf->stats_interval = (time_t)atol(text.c_str());
+        csLog::Log(csLog::Debug,
+            "Thread statistics interval: %ld", _conf->stats_interval);
+    }
+    else if ((*tag) == "shutdown-timeout") {
+        if (!stack.size() || (*stack.back()) != "csconf")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!text.size())
+            ParseError("missing value for tag: " + tag->GetName());
+
+        _conf->shutdown_timeout = (time_t)atol(text.c_str());
+        csLog::Log(csLog::Debug,
+            "Shutdown timeout: %ld", _conf->shutdown_timeout);
+    }
+    else if ((*tag) == "state-store") {
+        if (!stack.size() || (*stack.back()) != "csconf")
+            ParseError("unexpected tag: " + tag->GetName());
+        if (!text.size())
+            ParseError("missing value for tag: " + tag->GetName());
+
+        _conf->state_store = text;
+        csLog::Log(csLog::Debug, "State store: %s", text.c_str());
+    }
     else if ((*tag) == "state-file") {
         if (!stack.size() || (*stack.back()) != "plugin")
             ParseError("unexpected tag: " + tag->GetName());
@@ -245,8 +690,47 @@ void csMainXmlParser::ParseElementClose(csXmlTag *tag)
 
         csPlugin *plugin = reinterpret_cast<csPlugin *>
             (stack.back()->GetData());
-        if (plugin != NULL)
-            plugin->SetStateFile(text);
+        if (plugin == NULL) return;
+        // An isolated plugin's state is kept by its helper process
+        if (dynamic_cast<csPluginProcess *>(plugin) != NULL) return;
+
+        if (tag->ParamExists("lazy")) {
+            string lazy = tag->GetParamValue("lazy");
+            if (lazy != "true" && lazy != "false")
+                ParseError("invalid lazy: " + lazy);
+            plugin->SetStateLazy(lazy == "true");
+        }
+
+        plugin->SetStateFile(text);
+
+        if (tag->ParamExists("wal")) {
+            string wal = tag->GetParamValue("wal");
+            if (wal != "true" && wal != "false")
+                ParseError("invalid wal: " + wal);
+            if (wal == "true") {
+                time_t sync_interval = _CS_STATE_LOG_SYNC_INTERVAL;
+                size_t sync_records = _CS_STATE_LOG_SYNC_RECORDS;
+                if (tag->ParamExists("wal-sync-interval")) {
+                    sync_interval = (time_t)atol(
+                        tag->GetParamValue("wal-sync-interval").c_str());
+                }
+                if (tag->ParamExists("wal-sync-records")) {
+                    sync_records = (size_t)atol(
+                        tag->GetParamValue("wal-sync-records").c_str());
+                }
+                if (sync_records == 0)
+                    ParseError("invalid wal-sync-records");
+                plugin->SetStateLog(sync_interval, sync_records);
+            }
+        }
+
+        if (tag->ParamExists("checkpoint-interval")) {
+            time_t interval = (time_t)atol(
+                tag->GetParamValue("checkpoint-interval").c_str());
+            if (interval <= 0)
+                ParseError("invalid checkpoint-interval");
+            plugin->SetStateCheckpoint(interval);
+        }
     }
     else if ((*tag) == "event-filter") {
         if (!stack.size() || (*stack.back()) != "plugin")
@@ -265,7 +749,10 @@ csMainConf::csMainConf(csMain *parent,
     const char *filename, csMainXmlParser *parser,
     int argc, char *argv[])
     : csConf(filename, parser, argc, argv),
-    parent(parent), version(-1), plugin_dir(_CS_PLUGIN_CONF) { }
+    parent(parent), version(-1), plugin_dir(_CS_PLUGIN_CONF),
+    stats_interval(0), shutdown_timeout(_CS_SHUTDOWN_TIMEOUT),
+    watchdog_queue_age(0), watchdog_pop_age(0),
+    watchdog_action(WatchdogWarn) { }
 
 csMainConf::~csMainConf() { }
 
@@ -326,12 +813,19 @@ ScanPlugins_Leave:
 }
 
 csMain::csMain(int argc, char *argv[])
-    : csEventClient(), log_syslog(NULL), log_logfile(NULL)
+    : csEventClient(), log_syslog(NULL), log_logfile(NULL),
+    state_store(NULL), reexec(false), stats_timer(NULL),
+    watchdog_timer(NULL), host_shm(NULL), host_shm_size(0),
+    host_ring_tx(NULL), host_ring_rx(NULL), host_ring_thread(NULL)
 {
     bool debug = false;
     string conf_filename = _CS_MAIN_CONF;
     string log_file;
     sigset_t signal_set;
+    int handoff_fd = -1;
+    int host_fd[4] = { -1, -1, -1, -1 };
+    const char *dump_state = NULL;
+    csStateDump state_dump(stdout);
 
     log_stdout = new csLog();
     log_stdout->SetMask(csLog::Info | csLog::Warning | csLog::Error);
@@ -343,6 +837,10 @@ csMain::csMain(int argc, char *argv[])
         { "config", 1, 0, 'c' },
         { "debug", 0, 0, 'd' },
         { "dump-state", 1, 0, 'D' },
+        { "dump-format", 1, 0, 'F' },
+        { "dump-type", 1, 0, 'T' },
+        { "dump-prefix", 1, 0, 'P' },
+        { "dump-filter", 1, 0, 'R' },
         { "log", 1, 0, 'l' },
         { "help", 0, 0, 'h' },
 
@@ -352,7 +850,7 @@ csMain::csMain(int argc, char *argv[])
     for (optind = 1;; ) {
         int o = 0;
         if ((rc = getopt_long(argc, argv,
-            "Vc:dl:D:h?", options, &o)) == -1) break;
+            "Vc:dl:D:F:T:P:R:h?", options, &o)) == -1) break;
         switch (rc) {
         case 'V':
             Usage(true);
@@ -365,8 +863,20 @@ csMain::csMain(int argc, char *argv[])
                 csLog::Info | csLog::Warning | csLog::Error | csLog::Debug);
             break;
         case 'D':
-            DumpStateFile(optarg);
-            throw csInvalidOptionException();
+            dump_state = optarg;
+            break;
+        case 'F':
+            state_dump.SetFormat(optarg);
+            break;
+        case 'T':
+            state_dump.SetType(optarg);
+            break;
+        case 'P':
+            state_dump.SetPrefix(optarg);
+            break;
+        case 'R':
+            state_dump.SetFilter(optarg);
+            break;
         case 'l':
             log_file = optarg;
             break;
@@ -380,17 +890,40 @@ csMain::csMain(int argc, char *argv[])
         }
     }
 
+    if (dump_state != NULL) {
+        DumpStateFile(dump_state, state_dump);
+        throw csDumpStateException();
+    }
+
+    const char *handoff = getenv(_CS_HANDOFF_ENV);
+    if (handoff != NULL) {
+        handoff_fd = atoi(handoff);
+        unsetenv(_CS_HANDOFF_ENV);
+    }
+
+    const char *host = getenv(_CS_PLUGIN_HOST_ENV);
+    if (host != NULL) {
+        int offset = 0;
+        if (sscanf(host, "%d,%d,%d,%d,%n", &host_fd[0], &host_fd[1],
+            &host_fd[2], &host_fd[3], &offset) != 4 || offset == 0)
+            throw csException(EINVAL, _CS_PLUGIN_HOST_ENV);
+        plugin_host = host + offset;
+        unsetenv(_CS_PLUGIN_HOST_ENV);
+    }
+
     if (!debug) {
-        if (daemon(1, 0) != 0)
+        // A re-executed daemon or a plugin host is already detached
+        if (handoff_fd == -1 && plugin_host.empty() && daemon(1, 0) != 0)
             throw csException(errno, "daemon");
         log_syslog = new csLog("clearsyncd", LOG_PID, LOG_DAEMON);
 
-        FILE *h_pid = fopen(_CS_PID_FILE, "w+");
-        if (h_pid == NULL) {
+        FILE *h_pid = NULL;
+        if (plugin_host.empty() &&
+            (h_pid = fopen(_CS_PID_FILE, "w+")) == NULL) {
             csLog::Log(csLog::Warning, "Error saving PID file: %s",
                 _CS_PID_FILE);
         }
-        else {
+        else if (h_pid != NULL) {
             if (fprintf(h_pid, "%d\n", getpid()) <= 0) {
                 csLog::Log(csLog::Warning, "Error saving PID file: %s",
                     _CS_PID_FILE);
@@ -419,14 +952,30 @@ csMain::csMain(int argc, char *argv[])
 
     timer_thread = new csThreadTimer(this, signal_set);
 
-    netlink_thread = new csThreadNetlink(this);
+    state_thread = new csThreadState();
+
+    // A plugin host's plugin may never use netlink at all
+    netlink_thread = new csThreadNetlink(this, !plugin_host.empty());
 
     csMainXmlParser *parser = new csMainXmlParser();
     conf = new csMainConf(this, conf_filename.c_str(), parser, argc, argv);
     parser->SetConf(dynamic_cast<csConf *>(conf));
 
     conf->Reload();
-    ValidateConfiguration();
+    // A plugin host only has one plugin, and the store belongs to the daemon
+    if (plugin_host.empty()) {
+        ValidateConfiguration();
+        if (!conf->GetStateStore().empty())
+            state_store = new csStateStore(conf->GetStateStore());
+    }
+    else {
+        // The daemon's netlink cache and link statistics are its own;
+        // keeping them in every host would repeat its dumps.
+        netlink_thread->SetCacheEnabled(false);
+        netlink_thread->SetLinkStatsInterval(0);
+    }
+
+    if (handoff_fd != -1) LoadHandoff(handoff_fd);
 
     sigfillset(&signal_set);
     sigdelset(&signal_set, SIGPROF);
@@ -450,6 +999,7 @@ csMain::csMain(int argc, char *argv[])
 
     timer_thread->Start();
     netlink_thread->Start();
+    state_thread->Start();
 
     map<string, csPluginLoader *>::iterator i;
     for (i = plugin.begin(); i != plugin.end(); i++) {
@@ -460,17 +1010,55 @@ csMain::csMain(int argc, char *argv[])
         }
     }
 
+    if (!plugin_host.empty())
+        StartPluginHost(host_fd[0], host_fd[1], host_fd[2], host_fd[3]);
+
+    clock_gettime(CLOCK_MONOTONIC, &stats_time);
+    if (conf->GetStatsInterval() > 0) {
+        stats_timer = new csTimer(_CS_STATS_TIMER_ID,
+            conf->GetStatsInterval(), conf->GetStatsInterval(), this);
+        stats_timer->Start();
+    }
+
+    if (conf->IsWatchdogEnabled()) {
+        watchdog_timer = new csTimer(_CS_WATCHDOG_TIMER_ID, 1, 1, this);
+        watchdog_timer->Start();
+    }
+
     csLog::Log(csLog::Info, "ClearSync initialized.");
 }
 
 csMain::~csMain()
 {
+    if (stats_timer) delete stats_timer;
+    if (watchdog_timer) delete watchdog_timer;
+
+    vector<csEvent *> events;
+    if (!StopPlugins(events)) {
+        // A plugin that is still running goes on using this object, the
+        // shared threads and the loggers: none of them can be torn down
+        // (nor the process re-executed) under it.
+        if (reexec)
+            csLog::Log(csLog::Error, "Re-execution aborted.");
+        csLog::Log(csLog::Error, "Terminated, plugin(s) still running.");
+        fflush(NULL);
+        _exit(csEXIT_STOP_TIMEOUT);
+    }
+
+    if (reexec) SaveHandoff(events);
+    for (vector<csEvent *>::iterator j = events.begin();
+        j != events.end(); j++) EventDestroy((*j));
+
     map<string, csPluginLoader *>::iterator i;
     for (i = plugin.begin(); i != plugin.end(); i++) {
         delete i->second->GetPlugin();
         delete i->second;
     }
 
+    // A plugin host's ring thread is left running: it is blocked on the
+    // daemon, which only hangs up once this process has exited.
+    if (state_store) delete state_store;
+    if (state_thread) delete state_thread;
     if (sig_handler) delete sig_handler;
     if (timer_thread) delete timer_thread;
     if (netlink_thread) delete netlink_thread;
@@ -532,6 +1120,7 @@ void csMain::ValidateConfiguration(void)
         i != plugin_event_filter.end(); i++) {
         for (vector<string>::iterator j = i->second.begin();
             j != i->second.end(); j++) {
+            if (!strcasecmp((*j).c_str(), _CS_WATCHDOG_NAME)) continue;
             map<string, csPluginLoader *>::iterator p;
             p = plugin.find((*j));
             if (p != plugin.end()) continue;
@@ -544,12 +1133,17 @@ void csMain::ValidateConfiguration(void)
 void csMain::DispatchPluginEvent(csEventPlugin *event)
 {
     csPlugin *plugin = static_cast<csPlugin *>(event->GetSource());
-    event->SetValue("event_source", plugin->GetName());
+    DispatchPluginEvent(event, plugin->GetName());
+}
+
+void csMain::DispatchPluginEvent(csEventPlugin *event, const string &source)
+{
+    event->SetValue("event_source", source);
     for (map<csPlugin *, vector<string> >::iterator i = plugin_event_filter.begin();
         i != plugin_event_filter.end(); i++) {
         for (vector<string>::iterator j = i->second.begin();
             j != i->second.end(); j++) {
-            if (strcasecmp(plugin->GetName().c_str(), (*j).c_str()))
+            if (strcasecmp(source.c_str(), (*j).c_str()))
                 continue;
             map<string, csPluginLoader *>::iterator plugin_loader;
             plugin_loader = this->plugin.find(i->first->GetName());
@@ -560,25 +1154,994 @@ void csMain::DispatchPluginEvent(csEventPlugin *event)
     }
 }
 
-void csMain::DumpStateFile(const char *state)
+void csMain::DumpStateFile(const char *state, csStateDump &dump)
+{
+    bool legacy;
+    if (!dump.Dump(state, legacy)) throw csInvalidOptionException();
+    if (legacy) {
+        csPluginStateLoader state_loader;
+        state_loader.DumpStateFile(state, dump);
+    }
+}
+
+void csPluginStateLoader::DumpStateFile(const char *state, csStateDump &dump)
+{
+    // Load without LoadState() so that a legacy or damaged file is left
+    // untouched, and clear the file name so nothing is saved on exit.
+    bool legacy, replayed;
+    state_file = state;
+    LoadStateFile(legacy, replayed);
+    state_file.clear();
+
+    const char *key;
+    const uint8_t *value;
+    size_t key_length, length;
+    for (size_t i = 0; this->state.Next(i, key, key_length, value, length); )
+        dump.DumpRecord(key, key_length, value, length);
+}
+
+static const char *cs_hex_digits = "0123456789abcdef";
+
+csStateDump::csStateDump(FILE *fh)
+    : fh(fh), format(FormatHex), type(TypeHex), filter(NULL) { }
+
+csStateDump::~csStateDump()
+{
+    if (filter != NULL) delete filter;
+}
+
+void csStateDump::SetFormat(const string &format)
+{
+    if (format == "hex") this->format = FormatHex;
+    else if (format == "json") this->format = FormatJSON;
+    else if (format == "tsv") this->format = FormatTSV;
+    else throw csException(EINVAL, "Invalid dump format");
+}
+
+void csStateDump::SetType(const string &type)
+{
+    if (type == "hex") this->type = TypeHex;
+    else if (type == "ulong") this->type = TypeULong;
+    else if (type == "float") this->type = TypeFloat;
+    else if (type == "string") this->type = TypeString;
+    else throw csException(EINVAL, "Invalid dump type");
+}
+
+void csStateDump::SetFilter(const string &expr)
+{
+    if (filter != NULL) delete filter;
+    filter = new csRegEx(expr.c_str());
+}
+
+bool csStateDump::Dump(const string &state_file, bool &legacy)
+{
+    legacy = false;
+
+    // A state file's log follows it; after a crash there may only be a
+    // log.  A log can also be dumped directly.
+    string log_file = state_file + _CS_STATE_LOG_SUFFIX;
+    FILE *fh_state = fopen(state_file.c_str(), "r");
+    if (fh_state == NULL && (errno != ENOENT ||
+        (fh_state = fopen(log_file.c_str(), "r")) == NULL)) {
+        csLog::Log(csLog::Error, "Error opening state: %s: %s",
+            state_file.c_str(), strerror(errno));
+        return false;
+    }
+    setvbuf(fh_state, NULL, _IOFBF, _CS_STATE_DUMP_BUFFER);
+
+    uint8_t magic[4];
+    size_t bytes = fread(magic, 1, sizeof(magic), fh_state);
+    uint32_t state_magic = (bytes == sizeof(magic)) ? csGetLE32(magic) : 0;
+    if (state_magic != _CS_STATE_MAGIC && state_magic != _CS_STATE_LOG_MAGIC) {
+        // Legacy files are dumped from memory
+        fclose(fh_state);
+        legacy = (bytes > 0);
+        return true;
+    }
+
+    rewind(fh_state);
+    bool success = DumpFile(fh_state, state_file,
+        state_magic, (state_magic == _CS_STATE_LOG_MAGIC));
+    fclose(fh_state);
+
+    if (!success || state_magic == _CS_STATE_LOG_MAGIC) return success;
+
+    FILE *fh_log = fopen(log_file.c_str(), "r");
+    if (fh_log == NULL) return true;
+    setvbuf(fh_log, NULL, _IOFBF, _CS_STATE_DUMP_BUFFER);
+
+    success = DumpFile(fh_log, log_file, _CS_STATE_LOG_MAGIC, true);
+    fclose(fh_log);
+
+    return success;
+}
+
+bool csStateDump::DumpFile(FILE *fh_state,
+    const string &filename, uint32_t magic, bool log)
+{
+    struct stat state_stat;
+    if (fstat(fileno(fh_state), &state_stat) < 0) {
+        csLog::Log(csLog::Error, "Error opening state: %s: %s",
+            filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint32_t records;
+    uint8_t header[_CS_STATE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fh_state) != sizeof(header) ||
+        !csStateCheckHeader(header, magic, records)) {
+        csLog::Log(csLog::Error, "Invalid state header: %s", filename.c_str());
+        return false;
+    }
+
+    // One record is read at a time into a buffer that only grows to the
+    // largest record; a log simply ends where its records do.
+    vector<uint8_t> record;
+    uint64_t offset = _CS_STATE_HEADER_SIZE;
+    uint64_t size = (uint64_t)state_stat.st_size;
+
+    for (uint32_t r = 0; log || r < records; r++) {
+        uint8_t lengths[8];
+        size_t bytes = fread(lengths, 1, sizeof(lengths), fh_state);
+        if (bytes == 0 && log) break;
+
+        size_t key_length = 0, value_length = 0;
+        if (bytes == sizeof(lengths)) {
+            key_length = csGetLE32(lengths);
+            value_length = csGetLE32(lengths + 4);
+        }
+
+        uint64_t record_length =
+            _CS_STATE_RECORD_SIZE + (uint64_t)key_length + value_length;
+        if (bytes != sizeof(lengths) || offset + record_length > size) {
+            csLog::Log((log) ? csLog::Warning : csLog::Error,
+                "Truncated state file: %s, at offset: %llu",
+                filename.c_str(), (unsigned long long)offset);
+            return log;
+        }
+
+        record.resize((size_t)record_length);
+        memcpy(&record[0], lengths, sizeof(lengths));
+        if (fread(&record[sizeof(lengths)], 1, record.size() -
+            sizeof(lengths), fh_state) != record.size() - sizeof(lengths) ||
+            csGetLE32(&record[record.size() - 4]) !=
+            csCRC32(&record[0], record.size() - 4)) {
+            csLog::Log((log) ? csLog::Warning : csLog::Error,
+                "Corrupt state record: %s, at offset: %llu",
+                filename.c_str(), (unsigned long long)offset);
+            return log;
+        }
+
+        if (key_length > 0) {
+            DumpRecord((const char *)&record[8], key_length,
+                &record[8 + key_length], value_length, log);
+        }
+        offset += record_length;
+    }
+
+    return true;
+}
+
+void csStateDump::DumpRecord(const char *key, size_t key_length,
+    const uint8_t *value, size_t length, bool log)
+{
+    if (key_length < prefix.size() ||
+        memcmp(key, prefix.data(), prefix.size()) != 0) return;
+    if (filter != NULL &&
+        filter->Execute(string(key, key_length).c_str()) != 0) return;
+
+    line.clear();
+
+    switch (format) {
+    case FormatHex:
+        line.push_back('"');
+        line.append(key, key_length);
+        line.append("\"\n");
+        if (type == TypeHex) {
+            fwrite(line.data(), 1, line.size(), fh);
+            csHexDump(fh, value, length);
+            fputc('\n', fh);
+            return;
+        }
+        AppendValue(value, length);
+        line.append("\n\n");
+        break;
+
+    case FormatJSON:
+        line.append("{\"key\":");
+        AppendString(key, key_length);
+        line.append(",\"value\":");
+        AppendValue(value, length);
+        if (log) line.append(",\"log\":true");
+        line.append("}\n");
+        break;
+
+    case FormatTSV:
+        AppendString(key, key_length);
+        line.push_back('\t');
+        AppendValue(value, length);
+        line.push_back('\n');
+        break;
+    }
+
+    fwrite(line.data(), 1, line.size(), fh);
+}
+
+void csStateDump::AppendString(const char *data, size_t length)
+{
+    if (format == FormatHex) {
+        line.append(data, length);
+        return;
+    }
+
+    if (format == FormatJSON) line.push_back('"');
+
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = (uint8_t)data[i];
+        if (format == FormatJSON) {
+            if (c == '"' || c == '\\') {
+                line.push_back('\\');
+                line.push_back((char)c);
+            }
+            else if (c < 0x20 || c >= 0x7f) {
+                line.append("\\u00");
+                line.push_back(cs_hex_digits[c >> 4]);
+                line.push_back(cs_hex_digits[c & 0x0f]);
+            }
+            else line.push_back((char)c);
+        }
+        else {
+            if (c == '\\') line.append("\\\\");
+            else if (c == '\t') line.append("\\t");
+            else if (c == '\n') line.append("\\n");
+            else if (c == '\r') line.append("\\r");
+            else if (c < 0x20 || c >= 0x7f) {
+                line.append("\\x");
+                line.push_back(cs_hex_digits[c >> 4]);
+                line.push_back(cs_hex_digits[c & 0x0f]);
+            }
+            else line.push_back((char)c);
+        }
+    }
+
+    if (format == FormatJSON) line.push_back('"');
+}
+
+void csStateDump::AppendValue(const uint8_t *value, size_t length)
+{
+    char number[32];
+
+    // Values that don't match the type hint's size are shown as hex
+    if (type == TypeULong && length == sizeof(unsigned long)) {
+        unsigned long ulong_value;
+        memcpy(&ulong_value, value, sizeof(unsigned long));
+        snprintf(number, sizeof(number), "%lu", ulong_value);
+        line.append(number);
+    }
+    else if (type == TypeFloat && length == sizeof(float)) {
+        float float_value;
+        memcpy(&float_value, value, sizeof(float));
+        if (format == FormatJSON && (isnan(float_value) || isinf(float_value)))
+            line.append("null");
+        else {
+            snprintf(number, sizeof(number), "%.9g", float_value);
+            line.append(number);
+        }
+    }
+    else if (type == TypeString)
+        AppendString((const char *)value, length);
+    else {
+        if (format == FormatJSON) line.push_back('"');
+        size_t offset = line.size();
+        line.resize(offset + length * 2);
+        for (size_t i = 0; i < length; i++) {
+            line[offset + i * 2] = cs_hex_digits[value[i] >> 4];
+            line[offset + i * 2 + 1] = cs_hex_digits[value[i] & 0x0f];
+        }
+        if (format == FormatJSON) line.push_back('"');
+    }
+}
+
+static bool cs_handoff_write(FILE *fh, const string &value)
+{
+    uint32_t length = (uint32_t)value.size();
+    if (fwrite((const void *)&length, sizeof(uint32_t), 1, fh) != 1)
+        return false;
+    if (length && fwrite((const void *)value.c_str(),
+        sizeof(char), length, fh) != length) return false;
+    return true;
+}
+
+static bool cs_handoff_read(FILE *fh, string &value)
+{
+    uint32_t length;
+    if (fread((void *)&length, sizeof(uint32_t), 1, fh) != 1)
+        return false;
+    value.clear();
+    if (length == 0) return true;
+    char *buffer = new char[length];
+    if (fread((void *)buffer, sizeof(char), length, fh) != length) {
+        delete [] buffer;
+        return false;
+    }
+    value.assign(buffer, length);
+    delete [] buffer;
+    return true;
+}
+
+static bool cs_handoff_write(FILE *fh,
+    const string &dst, const string &src, csEventPlugin *event)
+{
+    const map<string, string> &values = event->GetValues();
+    uint32_t count = (uint32_t)values.size();
+
+    if (fputc('E', fh) == EOF) return false;
+    if (!cs_handoff_write(fh, dst) || !cs_handoff_write(fh, src)) return false;
+    if (fwrite((const void *)&count, sizeof(uint32_t), 1, fh) != 1)
+        return false;
+    for (map<string, string>::const_iterator i = values.begin();
+        i != values.end(); i++) {
+        if (!cs_handoff_write(fh, i->first) ||
+            !cs_handoff_write(fh, i->second)) return false;
+    }
+    return true;
+}
+
+void csMain::SaveHandoff(vector<csEvent *> &events)
+{
+    int fd = -1;
+    map<string, csPluginLoader *>::iterator i;
+
+    // Every plugin has stopped (see StopPlugins()), so state and queues
+    // are no longer changing; events holds what was queued for us.
+    if (netlink_thread) {
+        netlink_thread->Join();
+        netlink_thread->Handoff();
+    }
+
+    csSocket::SetHandoff();
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("clearsync-handoff", 0);
+#endif
+    if (fd == -1) {
+        FILE *fh_temp = tmpfile();
+        if (fh_temp != NULL) {
+            fd = dup(fileno(fh_temp));
+            fclose(fh_temp);
+        }
+    }
+    if (fd == -1) {
+        csLog::Log(csLog::Error, "Error creating handoff: %s",
+            strerror(errno));
+        return;
+    }
+
+    FILE *fh = fdopen(dup(fd), "w");
+    if (fh == NULL) {
+        csLog::Log(csLog::Error, "Error opening handoff: %s",
+            strerror(errno));
+        close(fd);
+        return;
+    }
+
+    size_t events_saved = 0, events_dropped = 0;
+    uint32_t header[2] = { _CS_HANDOFF_MAGIC, _CS_HANDOFF_VERSION };
+    bool success = (fwrite((const void *)header,
+        sizeof(uint32_t), 2, fh) == 2);
+
+    for (i = plugin.begin(); success && i != plugin.end(); i++) {
+        csPlugin *p = i->second->GetPlugin();
+
+        success = (fputc('S', fh) != EOF &&
+            cs_handoff_write(fh, i->first) && p->WriteState(fh));
+
+        vector<csEvent *> events;
+        p->EventDrain(events);
+        for (vector<csEvent *>::iterator j = events.begin();
+            j != events.end(); j++) {
+            if (success && (*j)->GetId() == csEVENT_PLUGIN) {
+                success = cs_handoff_write(fh, i->first, string(),
+                    static_cast<csEventPlugin *>((*j)));
+                events_saved++;
+            }
+            else if ((*j)->GetId() != csEVENT_QUIT) events_dropped++;
+            EventDestroy((*j));
+        }
+    }
+
+    for (vector<csEvent *>::iterator j = events.begin();
+        j != events.end(); j++) {
+        if (success && (*j)->GetId() == csEVENT_PLUGIN) {
+            csPlugin *src = static_cast<csPlugin *>((*j)->GetSource());
+            for (i = plugin.begin(); i != plugin.end(); i++) {
+                if (i->second->GetPlugin() != src) continue;
+                success = cs_handoff_write(fh, string(), i->first,
+                    static_cast<csEventPlugin *>((*j)));
+                events_saved++;
+                break;
+            }
+        }
+        else if ((*j)->GetId() != csEVENT_QUIT) events_dropped++;
+        EventDestroy((*j));
+    }
+    events.clear();
+
+    if (success) success = (fputc('\0', fh) != EOF);
+    if (fclose(fh) != 0) success = false;
+
+    if (!success) {
+        csLog::Log(csLog::Error, "Error writing handoff: %s",
+            strerror(errno));
+        close(fd);
+        return;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+
+    ostringstream os;
+    os << fd;
+    setenv(_CS_HANDOFF_ENV, os.str().c_str(), 1);
+
+    csLog::Log(csLog::Debug,
+        "Handoff saved: %lu plugin(s), %lu event(s), %lu dropped.",
+        plugin.size(), events_saved, events_dropped);
+}
+
+void csMain::LoadHandoff(int fd)
+{
+    FILE *fh = fdopen(fd, "r");
+    if (fh == NULL) {
+        csLog::Log(csLog::Error, "Error opening handoff: %s",
+            strerror(errno));
+        close(fd);
+        return;
+    }
+
+    uint32_t header[2];
+    if (fread((void *)header, sizeof(uint32_t), 2, fh) != 2 ||
+        header[0] != _CS_HANDOFF_MAGIC ||
+        header[1] != _CS_HANDOFF_VERSION) {
+        csLog::Log(csLog::Error, "Invalid handoff header.");
+        fclose(fh);
+        return;
+    }
+
+    size_t states = 0, events = 0;
+    for (bool run = true; run; ) {
+        string name, dst, src;
+        map<string, csPluginLoader *>::iterator i;
+
+        int type = fgetc(fh);
+        switch (type) {
+        case EOF:
+        case '\0':
+            run = false;
+            break;
+
+        case 'S':
+            if (!cs_handoff_read(fh, name)) {
+                run = false;
+                break;
+            }
+            i = plugin.find(name);
+            if (i != plugin.end()) {
+                run = i->second->GetPlugin()->ReadState(fh);
+                states++;
+            }
+            else {
+                csPluginStateLoader discard;
+                run = discard.ReadState(fh);
+            }
+            break;
+
+        case 'E':
+            if (!cs_handoff_read(fh, dst) || !cs_handoff_read(fh, src)) {
+                run = false;
+                break;
+            }
+            else {
+                uint32_t count;
+                if (fread((void *)&count, sizeof(uint32_t), 1, fh) != 1) {
+                    run = false;
+                    break;
+                }
+
+                csEventPlugin *event = new csEventPlugin(string());
+                for (uint32_t v = 0; run && v < count; v++) {
+                    string key, value;
+                    if (!cs_handoff_read(fh, key) || !cs_handoff_read(fh, value))
+                        run = false;
+                    else
+                        event->SetValue(key, value);
+                }
+                if (!run) {
+                    delete event;
+                    break;
+                }
+
+                i = plugin.find(dst.size() ? dst : src);
+                if (i == plugin.end()) {
+                    delete event;
+                    break;
+                }
+
+                if (dst.size())
+                    EventDispatch(event, i->second->GetPlugin());
+                else
+                    EventPush(event, i->second->GetPlugin());
+                events++;
+            }
+            break;
+
+        default:
+            csLog::Log(csLog::Error, "Invalid handoff record: 0x%02x", type);
+            run = false;
+        }
+    }
+
+    fclose(fh);
+
+    csLog::Log(csLog::Info,
+        "Handoff restored: %lu plugin state(s), %lu event(s).",
+        states, events);
+}
+
+void csMain::StartPluginHost(int fd_shm,
+    int fd_doorbell_rx, int fd_doorbell_tx, int fd_lifeline)
+{
+    if (plugin.find(plugin_host) == plugin.end())
+        throw csException(ENOENT, plugin_host.c_str());
+
+    size_t ring_size = csEventRing::GetMemorySize(_CS_RING_SIZE);
+    host_shm_size = ring_size * 2;
+    host_shm = mmap(NULL, host_shm_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd_shm, 0);
+    close(fd_shm);
+    if (host_shm == MAP_FAILED) {
+        host_shm = NULL;
+        throw csException(errno, "mmap");
+    }
+
+    // Not for the plugin's own children
+    fcntl(fd_doorbell_rx, F_SETFD, FD_CLOEXEC);
+    fcntl(fd_doorbell_tx, F_SETFD, FD_CLOEXEC);
+    fcntl(fd_lifeline, F_SETFD, FD_CLOEXEC);
+
+    // The daemon's transmit ring comes first
+    host_ring_rx = new csEventRing(host_shm, _CS_RING_SIZE,
+        fd_doorbell_rx, fd_lifeline);
+    host_ring_tx = new csEventRing((uint8_t *)host_shm + ring_size,
+        _CS_RING_SIZE, fd_doorbell_tx, fd_lifeline);
+
+    host_ring_thread = new csThreadRing(host_ring_rx, this, NULL);
+    host_ring_thread->Start();
+
+    csLog::Log(csLog::Debug, "Plugin host: %s", plugin_host.c_str());
+}
+
+void csMain::ReExec(char *argv[])
+{
+    csSocket::ExportHandoff();
+
+    char path[PATH_MAX];
+    cs_exec_path(argv[0], path, sizeof(path));
+
+    execv(path, argv);
+
+    csLog log_syslog("clearsyncd", LOG_PID, LOG_DAEMON);
+    csLog::Log(csLog::Error, "Error re-executing: %s: %s",
+        path, strerror(errno));
+}
+
+void csMain::DumpThreadStats(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double)(now.tv_sec - stats_time.tv_sec) +
+        (double)(now.tv_nsec - stats_time.tv_nsec) / 1000000000.0;
+    stats_time = now;
+
+    DumpThreadStats(sig_handler, elapsed);
+    DumpThreadStats(timer_thread, elapsed);
+    DumpThreadStats(netlink_thread, elapsed);
+    DumpThreadStats(state_thread, elapsed);
+
+    map<string, csPluginLoader *>::iterator i;
+    for (i = plugin.begin(); i != plugin.end(); i++)
+        DumpThreadStats(i->second->GetPlugin(), elapsed);
+}
+
+void csMain::DumpThreadStats(csThread *thread, double elapsed)
 {
-    csPluginStateLoader state_loader;
-    state_loader.DumpStateFile(state);
+    if (thread == NULL) return;
+
+    struct csThreadStats sample;
+    thread->GetStats(sample);
+
+    // CPU usage is relative to the previous sample of the same thread
+    double cpu = (double)sample.cpu_time.tv_sec +
+        (double)sample.cpu_time.tv_nsec / 1000000000.0;
+    double cpu_delta = cpu;
+    map<csThread *, struct csThreadStats>::iterator i = stats.find(thread);
+    if (i != stats.end()) {
+        cpu_delta -= (double)i->second.cpu_time.tv_sec +
+            (double)i->second.cpu_time.tv_nsec / 1000000000.0;
+    }
+    stats[thread] = sample;
+
+    csLog::Log(csLog::Info,
+        "%s: tid: %d, cpu: %.3fs (%.1f%%), ctxt: %lu/%lu, "
+        "events: %lu, wakeups: %lu",
+        thread->GetThreadName().c_str(), sample.tid, cpu,
+        (elapsed > 0.0) ? cpu_delta * 100.0 / elapsed : 0.0,
+        sample.ctxt_voluntary, sample.ctxt_involuntary,
+        sample.events, sample.wakeups);
 }
 
-void csPluginStateLoader::DumpStateFile(const char *state)
+void csMain::Watchdog(void)
 {
-    SetStateFile(state);
-    LoadState();
+    Watchdog(timer_thread);
+    Watchdog(netlink_thread);
+
+    map<string, csPluginLoader *>::iterator i;
+    for (i = plugin.begin(); i != plugin.end(); i++)
+        Watchdog(i->second->GetPlugin());
+}
 
-    for (map<string, struct csPluginStateValue *>::iterator i = this->state.begin();
-        i != this->state.end(); i++) {
-        fprintf(stdout, "\"%s\"\n", i->first.c_str());
-        csHexDump(stdout, i->second->value, i->second->length);
-        fputc('\n', stdout);
+void csMain::Watchdog(csThread *thread)
+{
+    size_t length;
+    time_t oldest_age, pop_age;
+
+    thread->EventQueueStatus(length, oldest_age, pop_age);
+
+    bool stalled = (
+        (conf->GetWatchdogQueueAge() > 0 &&
+            oldest_age >= conf->GetWatchdogQueueAge()) ||
+        (conf->GetWatchdogPopAge() > 0 &&
+            pop_age >= conf->GetWatchdogPopAge()));
+
+    set<csThread *>::iterator i = watchdog_stalled.find(thread);
+    if (!stalled) {
+        if (i != watchdog_stalled.end()) {
+            csLog::Log(csLog::Info, "%s: Recovered from stall.",
+                thread->GetThreadName().c_str());
+            watchdog_stalled.erase(i);
+        }
+        return;
+    }
+    if (i != watchdog_stalled.end()) return;
+
+    watchdog_stalled.insert(thread);
+
+    csLog::Log(csLog::Warning,
+        "%s: Stalled, queued events: %lu, oldest: %lds, last progress: %lds ago",
+        thread->GetThreadName().c_str(), length, oldest_age, pop_age);
+
+    if (conf->GetWatchdogAction() == csMainConf::WatchdogEvent) {
+        ostringstream os;
+        csEventPlugin *event = new csEventPlugin("watchdog");
+        event->SetValue("thread", thread->GetThreadName());
+        os << length;
+        event->SetValue("queue_length", os.str());
+        os.str(""); os << oldest_age;
+        event->SetValue("oldest_age", os.str());
+        os.str(""); os << pop_age;
+        event->SetValue("pop_age", os.str());
+
+        DispatchPluginEvent(event, _CS_WATCHDOG_NAME);
+        delete event;
+    }
+    else if (conf->GetWatchdogAction() == csMainConf::WatchdogRestart) {
+        // Plugins are threads of this process and a stuck thread can't
+        // be safely cancelled or joined.  Abort, and let the service
+        // manager restart the daemon (ex: systemd's Restart=on-abort).
+        csLog::Log(csLog::Error,
+            "%s: Watchdog restart, aborting.", thread->GetThreadName().c_str());
+        abort();
     }
 }
 
+bool csMain::StopPlugins(vector<csEvent *> &events)
+{
+    map<csPlugin *, csPluginStopper *> stopper;
+    map<csPlugin *, csPluginStopper *>::iterator si;
+    map<string, csPluginLoader *>::iterator i;
+
+    // Run() has broadcast csEVENT_QUIT so every plugin is already
+    // draining; join and save each one concurrently.  A plugin that was
+    // too slow to stop for a reload is still being joined; it's saved
+    // once that's done.
+    for (i = plugin.begin(); i != plugin.end(); i++) {
+        csPlugin *p = i->second->GetPlugin();
+        si = reload_stopper.find(p);
+        if (si != reload_stopper.end()) {
+            stopper[p] = si->second;
+            reload_stopper.erase(si);
+            continue;
+        }
+        csPluginStopper *s = new csPluginStopper(this, p);
+        try {
+            s->Start();
+            stopper[p] = s;
+        } catch (csException &e) {
+            csLog::Log(csLog::Warning, "%s: Error starting stopper: %s",
+                p->GetName().c_str(), e.estring.c_str());
+            delete s;
+            p->Stop();
+        }
+    }
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += conf->GetShutdownTimeout();
+
+    // Take our own queue to start with; the sticky csEVENT_QUIT from the
+    // signal handler would otherwise be returned by every EventPopWait(),
+    // and a reload's stopper may have finished behind it.
+    vector<csEvent *> popped;
+    EventDrain(popped);
+
+    for ( ;; ) {
+        for (vector<csEvent *>::iterator ei = popped.begin();
+            ei != popped.end(); ei++) {
+            if ((*ei)->GetId() == csEVENT_STOPPED) {
+                csPluginStopper *s =
+                    static_cast<csPluginStopper *>((*ei)->GetSource());
+                csPlugin *p = s->GetPlugin();
+                stopper.erase(p);
+                delete s;
+                p->Stop();
+                EventDestroy((*ei));
+            }
+            else if ((*ei)->GetId() == csEVENT_QUIT) EventDestroy((*ei));
+            else events.push_back((*ei));
+        }
+        popped.clear();
+
+        if (stopper.empty()) break;
+
+        time_t wait_ms = 1000;
+        if (conf->GetShutdownTimeout() > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            time_t remaining_ms =
+                (deadline.tv_sec - now.tv_sec) * 1000 +
+                (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (remaining_ms <= 0) break;
+            if (remaining_ms < wait_ms) wait_ms = remaining_ms;
+        }
+
+        csEvent *event = EventPopWait(wait_ms);
+        if (event == _CS_EVENT_NONE) continue;
+
+        if (event->GetId() == csEVENT_QUIT) {
+            // Another signal: take the sticky original off the queue,
+            // along with any csEVENT_STOPPED it was popped ahead of.
+            EventDestroy(event);
+            EventDrain(popped);
+        }
+        else popped.push_back(event);
+    }
+
+    // Stragglers' threads are still running: they can't be deleted, nor
+    // their libraries unloaded.
+    for (si = stopper.begin(); si != stopper.end(); si++) {
+        csLog::Log(csLog::Error,
+            "%s: Plugin failed to stop within %ld seconds.",
+            si->first->GetName().c_str(), conf->GetShutdownTimeout());
+    }
+
+    return stopper.empty();
+}
+
+void csMain::ReloadPlugins(void)
+{
+    map<string, csPluginLoader *>::iterator i;
+    for (i = plugin.begin(); i != plugin.end(); ) {
+        csPlugin *p = i->second->GetPlugin();
+        if (!i->second->IsModified() ||
+            reload_stopper.find(p) != reload_stopper.end() ||
+            !ReloadStop(p) || ReloadPlugin(i->first, i->second)) {
+            i++;
+            continue;
+        }
+        delete i->second;
+        plugin.erase(i++);
+    }
+}
+
+bool csMain::ReloadStop(csPlugin *plugin)
+{
+    csLog::Log(csLog::Info, "%s: Plugin library changed, reloading...",
+        plugin->GetName().c_str());
+
+    // A high priority quit is popped ahead of everything already queued,
+    // which is then handed over to the new instance.
+    plugin->EventPush(new csEvent(csEVENT_QUIT,
+        csEvent::Sticky | csEvent::HighPriority), this);
+
+    // Join on a thread of its own, so that a plugin that won't stop
+    // can't hold up this thread past the shutdown timeout.
+    csPluginStopper *s = new csPluginStopper(this, plugin, true);
+    try {
+        s->Start();
+    } catch (csException &e) {
+        csLog::Log(csLog::Warning, "%s: Error starting stopper: %s",
+            plugin->GetName().c_str(), e.estring.c_str());
+        delete s;
+        plugin->Join();
+        return true;
+    }
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += conf->GetShutdownTimeout();
+
+    bool stopped = false;
+    vector<csEvent *> deferred;
+    while (!stopped) {
+        time_t wait_ms = 1000;
+        if (conf->GetShutdownTimeout() > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            time_t remaining_ms =
+                (deadline.tv_sec - now.tv_sec) * 1000 +
+                (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (remaining_ms <= 0) break;
+            if (remaining_ms < wait_ms) wait_ms = remaining_ms;
+        }
+
+        csEvent *event = EventPopWait(wait_ms);
+        if (event == _CS_EVENT_NONE) continue;
+
+        if (event->GetId() == csEVENT_QUIT) {
+            // Shutting down: the sticky original stays queued for Run()
+            EventDestroy(event);
+            break;
+        }
+        if (event->GetId() == csEVENT_STOPPED && event->GetSource() == s) {
+            EventDestroy(event);
+            stopped = true;
+        }
+        else deferred.push_back(event);
+    }
+
+    // Everything else is put back, in order, for Run()
+    for (vector<csEvent *>::iterator i = deferred.begin();
+        i != deferred.end(); i++) EventPush((*i), (*i)->GetSource());
+
+    if (stopped) {
+        delete s;
+        return true;
+    }
+
+    // Its thread is still running, so the old instance (and its library)
+    // stays loaded; the reload is finished if it ever stops.
+    csLog::Log(csLog::Error,
+        "%s: Plugin failed to stop within %ld seconds, reload deferred.",
+        plugin->GetName().c_str(), conf->GetShutdownTimeout());
+    reload_stopper[plugin] = s;
+
+    return false;
+}
+
+void csMain::ReloadStopped(csPluginStopper *stopper)
+{
+    map<csPlugin *, csPluginStopper *>::iterator si;
+    for (si = reload_stopper.begin(); si != reload_stopper.end(); si++)
+        if (si->second == stopper) break;
+    if (si == reload_stopper.end()) return;
+
+    csPlugin *p = si->first;
+    reload_stopper.erase(si);
+    delete stopper;
+
+    map<string, csPluginLoader *>::iterator i;
+    for (i = plugin.begin(); i != plugin.end(); i++) {
+        if (i->second->GetPlugin() != p) continue;
+        if (!ReloadPlugin(i->first, i->second)) {
+            delete i->second;
+            plugin.erase(i);
+        }
+        break;
+    }
+}
+
+bool csMain::ReloadPlugin(const string &name, csPluginLoader *loader)
+{
+    csPlugin *p = loader->GetPlugin();
+
+    // Nothing more may be sent to this instance: the new one could be
+    // allocated at the same address.  The netlink events let go of are
+    // destroyed here, once, even if they're also in the queue.
+    vector<csEvent *> events, netlink_events;
+    if (netlink_thread) netlink_thread->Unwatch(p, netlink_events);
+
+    p->EventDrain(events);
+    for (vector<csEvent *>::iterator i = netlink_events.begin();
+        i != netlink_events.end(); i++) {
+        events.erase(remove(events.begin(), events.end(), (*i)),
+            events.end());
+        EventDestroy((*i));
+    }
+
+    csPluginAttributes attr;
+    p->GetAttributes(attr);
+
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *fh = open_memstream(&buffer, &length);
+    bool saved = (fh != NULL && p->WriteState(fh));
+    if (fh != NULL && fclose(fh) != 0) saved = false;
+
+    vector<string> event_filter;
+    map<csPlugin *, vector<string> >::iterator filter;
+    filter = plugin_event_filter.find(p);
+    if (filter != plugin_event_filter.end()) {
+        event_filter = filter->second;
+        plugin_event_filter.erase(filter);
+    }
+    stats.erase(p);
+    watchdog_stalled.erase(p);
+
+    // The plugin's code is in the library, so it has to go first; its
+    // Stop() also writes the state file and retires the state log.
+    delete p;
+    p = NULL;
+
+    bool success = true;
+    try {
+        loader->Reload();
+        p = loader->GetPlugin();
+        p->SetConfigurationFile(conf->GetFilename());
+        p->SetAttributes(attr);
+
+        FILE *fh_state = (saved) ? fmemopen(buffer, length, "r") : NULL;
+        if (fh_state != NULL) {
+            if (!p->ReadState(fh_state)) p->LoadState();
+            fclose(fh_state);
+        }
+        else if (!attr.state_file.empty()) p->LoadState();
+
+        if (event_filter.size()) plugin_event_filter[p] = event_filter;
+    } catch (csException &e) {
+        csLog::Log(csLog::Error, "%s: Error reloading plugin: %s: %s",
+            name.c_str(), e.estring.c_str(), e.what());
+        if (p != NULL) delete p;
+        success = false;
+    }
+
+    if (buffer != NULL) free(buffer);
+
+    size_t replayed = 0, dropped = 0;
+    for (vector<csEvent *>::iterator i = events.begin();
+        i != events.end(); i++) {
+        // Timers belonged to the previous instance; only plugin events
+        // are meaningful to the new one.
+        if (success && (*i)->GetId() == csEVENT_PLUGIN) {
+            p->EventPush((*i), (*i)->GetSource());
+            replayed++;
+            continue;
+        }
+        if ((*i)->GetId() != csEVENT_QUIT) dropped++;
+        EventDestroy((*i));
+    }
+
+    if (!success) return false;
+
+    try {
+        p->Start();
+    } catch (csException &e) {
+        csLog::Log(csLog::Error, "Error starting plugin: %s", e.what());
+    }
+
+    csLog::Log(csLog::Info,
+        "%s: Plugin reloaded, %lu event(s) replayed, %lu dropped.",
+        name.c_str(), replayed, dropped);
+
+    return true;
+}
+
 void csMain::Run(void)
 {
     for ( ;; ) {
@@ -591,13 +2154,56 @@ void csMain::Run(void)
             return;
 
         case csEVENT_RELOAD:
-            //conf->Reload();
+            ReloadPlugins();
+            break;
+
+        case csEVENT_REEXEC:
+            csLog::Log(csLog::Info, "Re-executing...");
+            reexec = true;
+            EventBroadcast(new csEvent(csEVENT_QUIT,
+                csEvent::Sticky | csEvent::HighPriority));
+            EventDestroy(event);
+            return;
+
+        case csEVENT_STATS:
+            DumpThreadStats();
+            break;
+
+        case csEVENT_TIMER:
+            if (static_cast<csEventTimer *>(event)->GetTimer() == stats_timer)
+                DumpThreadStats();
+            else if (static_cast<csEventTimer *>(event)->GetTimer() ==
+                watchdog_timer) Watchdog();
             break;
 
         case csEVENT_PLUGIN:
-            DispatchPluginEvent(static_cast<csEventPlugin *>(event));
+            if (plugin_host.empty())
+                DispatchPluginEvent(static_cast<csEventPlugin *>(event));
+            else if (event->GetSource() != host_ring_thread)
+                host_ring_tx->Push(static_cast<csEventPlugin *>(event));
+            else {
+                map<string, csPluginLoader *>::iterator i;
+                i = plugin.find(plugin_host);
+                if (i == plugin.end()) break;
+                EventDispatch(event, i->second->GetPlugin());
+                continue;
+            }
             break;
 
+        case csEVENT_STOPPED:
+            if (plugin_host.empty()) {
+                // A plugin that was slow to stop for a reload
+                ReloadStopped(
+                    static_cast<csPluginStopper *>(event->GetSource()));
+                break;
+            }
+            // The daemon has asked us to quit, or has gone away
+            csLog::Log(csLog::Debug, "Plugin host terminating...");
+            EventBroadcast(new csEvent(csEVENT_QUIT,
+                csEvent::Sticky | csEvent::HighPriority));
+            EventDestroy(event);
+            return;
+
         default:
             csLog::Log(csLog::Debug, "Unhandled event: %u", event->GetId());
             break;
@@ -640,6 +2246,22 @@ void csMain::Usage(bool version)
             "  -D, --dump-state <state-file>");
         csLog::Log(csLog::Info,
             "    Dump the contents of a plugin state file.");
+        csLog::Log(csLog::Info,
+            "  -F, --dump-format <hex|json|tsv>");
+        csLog::Log(csLog::Info,
+            "    Output format for --dump-state.  Default: hex");
+        csLog::Log(csLog::Info,
+            "  -T, --dump-type <hex|ulong|float|string>");
+        csLog::Log(csLog::Info,
+            "    Decode --dump-state values as the given type.  Default: hex");
+        csLog::Log(csLog::Info,
+            "  -P, --dump-prefix <prefix>");
+        csLog::Log(csLog::Info,
+            "    Only dump keys starting with the given prefix.");
+        csLog::Log(csLog::Info,
+            "  -R, --dump-filter <regex>");
+        csLog::Log(csLog::Info,
+            "    Only dump keys matching the given regular expression.");
         csLog::Log(csLog::Info,
             "  -d, --debug");
         csLog::Log(csLog::Info,
@@ -674,7 +2296,16 @@ int main(int argc, char *argv[])
         rc = csEXIT_UNHANDLED_EX;
     }
 
-    if (cs_main) delete cs_main;
+    bool reexec = false;
+    if (cs_main) {
+        reexec = cs_main->IsReExec();
+        delete cs_main;
+    }
+
+    if (reexec) {
+        csMain::ReExec(argv);
+        rc = csEXIT_REEXEC_FAILED;
+    }
 
     return rc;
 }
@@ -39,16 +39,44 @@
 #endif
 #endif
 
+#ifndef _CS_HANDOFF_ENV
+#define _CS_HANDOFF_ENV         "CLEARSYNC_HANDOFF_FD"
+#endif
+
+#ifndef _CS_PLUGIN_HOST_ENV
+#define _CS_PLUGIN_HOST_ENV     "CLEARSYNC_PLUGIN_HOST"
+#endif
+
+#define _CS_STATS_TIMER_ID      0x0001
+#define _CS_WATCHDOG_TIMER_ID   0x0002
+
+#define _CS_WATCHDOG_NAME       "Watchdog"
+
+#ifndef _CS_SHUTDOWN_TIMEOUT
+#define _CS_SHUTDOWN_TIMEOUT    30
+#endif
+
+#ifndef _CS_STATE_DUMP_BUFFER
+#define _CS_STATE_DUMP_BUFFER   (1024 * 1024)
+#endif
+
+#define _CS_HANDOFF_MAGIC       0x4f485343
+#define _CS_HANDOFF_VERSION     2
+
 #define csEXIT_SUCCESS          0
 #define csEXIT_INVALID_OPTION   1
 #define csEXIT_XML_PARSE_ERROR  2
 #define csEXIT_UNHANDLED_EX     3
+#define csEXIT_REEXEC_FAILED    4
+#define csEXIT_STOP_TIMEOUT     5
 
 class csSignalHandler : public csThread
 {
 public:
     csSignalHandler(csEventClient *parent, const sigset_t &signal_set)
-        : csThread(), parent(parent), signal_set(signal_set) { };
+        : csThread(), parent(parent), signal_set(signal_set) {
+        SetThreadName("signal");
+    };
     virtual ~csSignalHandler() {
         pthread_kill(id, SIGTERM);
         Join();
@@ -62,7 +90,64 @@ protected:
     sigset_t signal_set;
 };
 
+// Stops (or, for a reload, only joins) a plugin that has been sent a
+// quit, then sends parent a csEVENT_STOPPED.
+class csPluginStopper : public csThread
+{
+public:
+    csPluginStopper(csEventClient *parent, csPlugin *plugin,
+        bool join_only = false)
+        : csThread(), parent(parent), plugin(plugin), join_only(join_only) {
+        SetThreadName("stop-" + plugin->GetName());
+    };
+    virtual ~csPluginStopper() { Join(); };
+
+    virtual void *Entry(void);
+
+    inline csPlugin *GetPlugin(void) { return plugin; };
+
+protected:
+    csEventClient *parent;
+    csPlugin *plugin;
+    bool join_only;
+};
+
+// Stands in for a plugin isolated in a helper process: a clearsyncd
+// re-executed to host only that plugin.  Events for the plugin are
+// forwarded over a shared memory ring, and its events are relayed back
+// by a ring thread as if sent from here.  The plugin's state is kept by
+// the helper.
+class csPluginProcess : public csPlugin
+{
+public:
+    csPluginProcess(const string &name, csEventClient *parent,
+        size_t stack_size, char **argv, time_t quit_timeout);
+    virtual ~csPluginProcess();
+
+    virtual void Start(void);
+    virtual void *Entry(void);
+
+    virtual void LoadState(void) { };
+    virtual void SaveState(void) { };
+
+protected:
+    char **argv;
+    time_t quit_timeout;
+    pid_t pid;
+    void *shm;
+    size_t shm_size;
+    int fd_doorbell[2];
+    int fd_lifeline;
+    csEventRing *ring_tx;
+    csEventRing *ring_rx;
+    csThreadRing *ring_thread;
+
+    // Asks the helper to quit, true if it exits within wait_ms
+    bool Quit(time_t wait_ms);
+};
+
 class csMainConf;
+class csStateDump;
 class csMainXmlParser : public csXmlParser
 {
 public:
@@ -70,24 +155,50 @@ public:
 
     virtual void ParseElementOpen(csXmlTag *tag);
     virtual void ParseElementClose(csXmlTag *tag);
+
+protected:
+    void ParseThreadAttributes(csXmlTag *tag, csThread *thread);
 };
 
 class csMain;
 class csMainConf : public csConf
 {
 public:
+    enum WatchdogAction
+    {
+        WatchdogWarn,
+        WatchdogEvent,
+        WatchdogRestart
+    };
+
     csMainConf(csMain *parent, const char *filename,
         csMainXmlParser *parser, int argc, char *argv[]);
     virtual ~csMainConf();
 
     virtual void Reload(void);
 
+    inline time_t GetStatsInterval(void) { return stats_interval; };
+    inline time_t GetShutdownTimeout(void) { return shutdown_timeout; };
+    inline const string &GetStateStore(void) { return state_store; };
+    inline bool IsWatchdogEnabled(void) {
+        return (watchdog_queue_age > 0 || watchdog_pop_age > 0);
+    };
+    inline time_t GetWatchdogQueueAge(void) { return watchdog_queue_age; };
+    inline time_t GetWatchdogPopAge(void) { return watchdog_pop_age; };
+    inline WatchdogAction GetWatchdogAction(void) { return watchdog_action; };
+
 protected:
     friend class csMainXmlParser;
 
     csMain *parent;
     int version;
     string plugin_dir;
+    time_t stats_interval;
+    time_t shutdown_timeout;
+    string state_store;
+    time_t watchdog_queue_age;
+    time_t watchdog_pop_age;
+    WatchdogAction watchdog_action;
 
     void ScanPlugins(void);
 };
@@ -101,6 +212,9 @@ public:
     void Run(void);
     void Usage(bool version = false);
 
+    inline bool IsReExec(void) { return reexec; };
+    static void ReExec(char *argv[]);
+
 protected:
     friend class csMainXmlParser;
 
@@ -111,14 +225,93 @@ protected:
     csSignalHandler *sig_handler;
     csThreadTimer *timer_thread;
     csThreadNetlink *netlink_thread;
+    csThreadState *state_thread;
+    csStateStore *state_store;
     map<string, csPluginLoader *> plugin;
     map<csPlugin *, vector<string> > plugin_event_filter;
+    bool reexec;
+    csTimer *stats_timer;
+    struct timespec stats_time;
+    map<csThread *, struct csThreadStats> stats;
+    csTimer *watchdog_timer;
+    set<csThread *> watchdog_stalled;
+    map<csPlugin *, csPluginStopper *> reload_stopper;
+    string plugin_host;
+    void *host_shm;
+    size_t host_shm_size;
+    csEventRing *host_ring_tx;
+    csEventRing *host_ring_rx;
+    csThreadRing *host_ring_thread;
+
+    void StartPluginHost(int fd_shm,
+        int fd_doorbell_rx, int fd_doorbell_tx, int fd_lifeline);
 
     void ParseEventFilter(csPlugin *plugin, const string &text);
     void ValidateConfiguration(void);
     void DispatchPluginEvent(csEventPlugin *event);
+    void DispatchPluginEvent(csEventPlugin *event, const string &source);
+
+    void DumpStateFile(const char *state, csStateDump &dump);
+    void DumpThreadStats(void);
+    void DumpThreadStats(csThread *thread, double elapsed);
+
+    void Watchdog(void);
+    void Watchdog(csThread *thread);
+
+    bool StopPlugins(vector<csEvent *> &events);
+    void ReloadPlugins(void);
+    bool ReloadStop(csPlugin *plugin);
+    void ReloadStopped(csPluginStopper *stopper);
+    bool ReloadPlugin(const string &name, csPluginLoader *loader);
+
+    void SaveHandoff(vector<csEvent *> &events);
+    void LoadHandoff(int fd);
+};
+
+// Streams a state file (and its log) record by record, so files of any
+// size can be dumped without loading them.
+class csStateDump
+{
+public:
+    enum Format
+    {
+        FormatHex,
+        FormatJSON,
+        FormatTSV
+    };
+
+    enum Type
+    {
+        TypeHex,
+        TypeULong,
+        TypeFloat,
+        TypeString
+    };
+
+    csStateDump(FILE *fh);
+    virtual ~csStateDump();
+
+    void SetFormat(const string &format);
+    void SetType(const string &type);
+    inline void SetPrefix(const string &prefix) { this->prefix = prefix; };
+    void SetFilter(const string &expr);
+
+    bool Dump(const string &state_file, bool &legacy);
+    void DumpRecord(const char *key, size_t key_length,
+        const uint8_t *value, size_t length, bool log = false);
+
+protected:
+    FILE *fh;
+    Format format;
+    Type type;
+    string prefix;
+    csRegEx *filter;
+    string line;
 
-    void DumpStateFile(const char *state);
+    bool DumpFile(FILE *fh_state,
+        const string &filename, uint32_t magic, bool log);
+    void AppendString(const char *data, size_t length);
+    void AppendValue(const uint8_t *value, size_t length);
 };
 
 class csPluginStateLoader : public csPlugin
@@ -128,7 +321,7 @@ public:
 
     virtual void *Entry(void) { return NULL; };
 
-    void DumpStateFile(const char *state);
+    void DumpStateFile(const char *state, csStateDump &dump);
 };
 
 class csUsageException : public csException
@@ -0,0 +1,717 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+#include <linux/neighbour.h>
+
+#include <net/if.h>
+
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <clearsync/csnetcache.h>
+
+static size_t cs_netcache_addrlen(uint8_t family)
+{
+    return (family == AF_INET) ? 4 : 16;
+}
+
+static void cs_netcache_copy(uint8_t *dst, struct rtattr *rta, size_t size)
+{
+    size_t length = RTA_PAYLOAD(rta);
+    memcpy(dst, RTA_DATA(rta), (length < size) ? length : size);
+}
+
+// Keys are built so that the maps iterate in the snapshots' sort order
+static void cs_netcache_put32(string &key, uint32_t value)
+{
+    key += (char)(value >> 24);
+    key += (char)(value >> 16);
+    key += (char)(value >> 8);
+    key += (char)value;
+}
+
+static string cs_netcache_key(const csNetlinkAddress &address)
+{
+    string key;
+    cs_netcache_put32(key, (uint32_t)address.index);
+    key += (char)address.family;
+    key += (char)address.prefix_length;
+    key.append((const char *)address.address, sizeof(address.address));
+    return key;
+}
+
+static string cs_netcache_key(const csNetlinkRoute &route)
+{
+    string key;
+    key += (char)route.family;
+    key += (char)(255 - route.dst_length);
+    key.append((const char *)route.dst, sizeof(route.dst));
+    cs_netcache_put32(key, route.table);
+    cs_netcache_put32(key, route.priority);
+    key += (char)route.tos;
+    return key;
+}
+
+static string cs_netcache_key(const csNetlinkNeighbour &neighbour)
+{
+    string key;
+    cs_netcache_put32(key, (uint32_t)neighbour.index);
+    key += (char)neighbour.family;
+    key.append((const char *)neighbour.address, sizeof(neighbour.address));
+    return key;
+}
+
+static bool cs_netcache_link_less(
+    const csNetlinkLink &a, const csNetlinkLink &b)
+{
+    return (a.index < b.index);
+}
+
+static bool cs_netcache_address_less(
+    const csNetlinkAddress &a, const csNetlinkAddress &b)
+{
+    return (a.index < b.index);
+}
+
+static bool cs_netcache_neighbour_less(
+    const csNetlinkNeighbour &a, const csNetlinkNeighbour &b)
+{
+    if (a.index != b.index) return (a.index < b.index);
+    if (a.family != b.family) return (a.family < b.family);
+    return (memcmp(a.address, b.address, sizeof(a.address)) < 0);
+}
+
+// Within a range of routes of one family and prefix length
+static bool cs_netcache_dst_less(
+    const csNetlinkRoute &a, const csNetlinkRoute &b)
+{
+    return (memcmp(a.dst, b.dst, sizeof(a.dst)) < 0);
+}
+
+csNetlinkSnapshot::csNetlinkSnapshot()
+    : refs(1), complete(false), links(NULL), addresses(NULL),
+    routes(NULL), route_range(NULL), neighbours(NULL) { }
+
+csNetlinkSnapshot::~csNetlinkSnapshot()
+{
+    if (links != NULL) links->Unref();
+    if (addresses != NULL) addresses->Unref();
+    if (routes != NULL) routes->Unref();
+    if (route_range != NULL) route_range->Unref();
+    if (neighbours != NULL) neighbours->Unref();
+}
+
+void csNetlinkSnapshot::Ref(void)
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void csNetlinkSnapshot::Unref(void)
+{
+    // Freed by the cache, once no reader can still be taking a reference
+    __sync_sub_and_fetch(&refs, 1);
+}
+
+const csNetlinkLink *csNetlinkSnapshot::FindLink(int index) const
+{
+    csNetlinkLink probe;
+    probe.index = index;
+
+    const vector<csNetlinkLink> &entries = links->entries;
+    vector<csNetlinkLink>::const_iterator i = lower_bound(
+        entries.begin(), entries.end(), probe, cs_netcache_link_less);
+    if (i == entries.end() || i->index != index) return NULL;
+
+    return &(*i);
+}
+
+const csNetlinkLink *csNetlinkSnapshot::FindLink(const string &name) const
+{
+    for (vector<csNetlinkLink>::const_iterator i = links->entries.begin();
+        i != links->entries.end(); i++) {
+        if (i->name == name) return &(*i);
+    }
+
+    return NULL;
+}
+
+void csNetlinkSnapshot::FindAddresses(int index,
+    vector<const csNetlinkAddress *> &result) const
+{
+    csNetlinkAddress probe;
+    probe.index = index;
+
+    const vector<csNetlinkAddress> &entries = addresses->entries;
+    vector<csNetlinkAddress>::const_iterator i = lower_bound(
+        entries.begin(), entries.end(), probe, cs_netcache_address_less);
+    for ( ; i != entries.end() && i->index == index; i++)
+        result.push_back(&(*i));
+}
+
+const csNetlinkNeighbour *csNetlinkSnapshot::FindNeighbour(int index,
+    uint8_t family, const uint8_t *address) const
+{
+    csNetlinkNeighbour probe;
+    probe.index = index;
+    probe.family = family;
+    memset(probe.address, 0, sizeof(probe.address));
+    memcpy(probe.address, address, cs_netcache_addrlen(family));
+
+    const vector<csNetlinkNeighbour> &entries = neighbours->entries;
+    vector<csNetlinkNeighbour>::const_iterator i = lower_bound(
+        entries.begin(), entries.end(), probe, cs_netcache_neighbour_less);
+    if (i == entries.end() || cs_netcache_neighbour_less(probe, *i))
+        return NULL;
+
+    return &(*i);
+}
+
+const csNetlinkRoute *csNetlinkSnapshot::FindRoute(uint8_t family,
+    const uint8_t *dst, uint8_t dst_length, uint32_t table) const
+{
+    const vector<RouteRange> &ranges = route_range->entries;
+    for (vector<RouteRange>::const_iterator i = ranges.begin();
+        i != ranges.end(); i++) {
+        if (i->family != family || i->dst_length != dst_length) continue;
+        return FindRoute(*i, dst, table);
+    }
+
+    return NULL;
+}
+
+const csNetlinkRoute *csNetlinkSnapshot::LookupRoute(uint8_t family,
+    const uint8_t *address, uint32_t table) const
+{
+    size_t length = cs_netcache_addrlen(family);
+
+    // Ranges are ordered longest prefix first
+    const vector<RouteRange> &ranges = route_range->entries;
+    for (vector<RouteRange>::const_iterator i = ranges.begin();
+        i != ranges.end(); i++) {
+        if (i->family != family) continue;
+
+        uint8_t dst[16];
+        memset(dst, 0, sizeof(dst));
+        memcpy(dst, address, length);
+
+        size_t bytes = i->dst_length / 8;
+        if (bytes < length) {
+            dst[bytes] &= (uint8_t)(0xff00 >> (i->dst_length % 8));
+            memset(dst + bytes + 1, 0, sizeof(dst) - bytes - 1);
+        }
+
+        const csNetlinkRoute *route = FindRoute(*i, dst, table);
+        if (route != NULL) return route;
+    }
+
+    return NULL;
+}
+
+const csNetlinkRoute *csNetlinkSnapshot::FindRoute(const RouteRange &range,
+    const uint8_t *dst, uint32_t table) const
+{
+    csNetlinkRoute probe;
+    memset(probe.dst, 0, sizeof(probe.dst));
+    memcpy(probe.dst, dst, cs_netcache_addrlen(range.family));
+
+    const vector<csNetlinkRoute> &entries = routes->entries;
+    vector<csNetlinkRoute>::const_iterator i = lower_bound(
+        entries.begin() + range.begin, entries.begin() + range.end,
+        probe, cs_netcache_dst_less);
+
+    // The routes to a prefix are ordered by table, then priority
+    for ( ; i != entries.begin() + range.end &&
+        !cs_netcache_dst_less(probe, *i); i++) {
+        if (i->table == table) return &(*i);
+    }
+
+    return NULL;
+}
+
+csNetlinkCache::csNetlinkCache()
+    : dumped(0), dirty(0), snapshot(NULL), readers(0)
+{
+    memset(generation, 0, sizeof(generation));
+}
+
+csNetlinkCache::~csNetlinkCache()
+{
+    // Every other thread is gone by now
+    csNetlinkSnapshot *current = snapshot;
+    if (current != NULL) retired.push_back(current);
+    for (vector<csNetlinkSnapshot *>::iterator i = retired.begin();
+        i != retired.end(); i++) delete (*i);
+}
+
+csNetlinkSnapshot *csNetlinkCache::GetSnapshot(void)
+{
+    __sync_add_and_fetch(&readers, 1);
+    csNetlinkSnapshot *current = snapshot;
+    if (current != NULL) current->Ref();
+    __sync_sub_and_fetch(&readers, 1);
+
+    return current;
+}
+
+int csNetlinkCache::GetTable(uint16_t type)
+{
+    switch (type) {
+    case RTM_GETLINK:
+        return TableLink;
+    case RTM_GETADDR:
+        return TableAddress;
+    case RTM_GETROUTE:
+        return TableRoute;
+    case RTM_GETNEIGH:
+        return TableNeighbour;
+    }
+
+    return -1;
+}
+
+bool csNetlinkCache::Update(struct nlmsghdr *nh)
+{
+    switch (nh->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        return UpdateLink(nh);
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        UpdateAddress(nh);
+        break;
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+        UpdateRoute(nh);
+        break;
+    case RTM_NEWNEIGH:
+    case RTM_DELNEIGH:
+        UpdateNeighbour(nh);
+        break;
+    }
+
+    return false;
+}
+
+bool csNetlinkCache::UpdateLink(struct nlmsghdr *nh)
+{
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg))) return false;
+
+    struct ifinfomsg *ifi = (struct ifinfomsg *)NLMSG_DATA(nh);
+    map<int, csNetlinkLink>::iterator i = links.find(ifi->ifi_index);
+
+    dirty |= (1 << TableLink);
+
+    if (nh->nlmsg_type == RTM_DELLINK) {
+        if (i == links.end()) return false;
+        links.erase(i);
+        Purge(ifi->ifi_index);
+        return true;
+    }
+
+    bool down = (i != links.end() &&
+        (i->second.flags & IFF_UP) && !(ifi->ifi_flags & IFF_UP));
+
+    csNetlinkLink &link = links[ifi->ifi_index];
+    link.index = ifi->ifi_index;
+    link.type = ifi->ifi_type;
+    link.flags = ifi->ifi_flags;
+    link.generation = generation[TableLink];
+    if (i == links.end()) {
+        link.mtu = 0;
+        link.master = 0;
+    }
+
+    // Notifications may leave out attributes that haven't changed
+    struct rtattr *rta = IFLA_RTA(ifi);
+    int length = IFLA_PAYLOAD(nh);
+    for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        switch (rta->rta_type) {
+        case IFLA_IFNAME:
+            link.name.assign((const char *)RTA_DATA(rta),
+                strnlen((const char *)RTA_DATA(rta), RTA_PAYLOAD(rta)));
+            break;
+        case IFLA_MTU:
+            if (RTA_PAYLOAD(rta) >= sizeof(uint32_t))
+                link.mtu = *(uint32_t *)RTA_DATA(rta);
+            break;
+        case IFLA_MASTER:
+            if (RTA_PAYLOAD(rta) >= sizeof(uint32_t))
+                link.master = *(int *)RTA_DATA(rta);
+            break;
+        case IFLA_ADDRESS:
+            link.address.assign((uint8_t *)RTA_DATA(rta),
+                (uint8_t *)RTA_DATA(rta) + RTA_PAYLOAD(rta));
+            break;
+        }
+    }
+
+    // IPv4 routes through a link are flushed quietly when it goes down
+    return down;
+}
+
+void csNetlinkCache::UpdateAddress(struct nlmsghdr *nh)
+{
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg))) return;
+
+    struct ifaddrmsg *ifa = (struct ifaddrmsg *)NLMSG_DATA(nh);
+    if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) return;
+
+    csNetlinkAddress address;
+    address.index = ifa->ifa_index;
+    address.family = ifa->ifa_family;
+    address.prefix_length = ifa->ifa_prefixlen;
+    address.scope = ifa->ifa_scope;
+    address.flags = ifa->ifa_flags;
+    address.generation = generation[TableAddress];
+    memset(address.address, 0, sizeof(address.address));
+
+    // The local address, if given; IFA_ADDRESS is the peer's on a
+    // point-to-point link
+    bool local = false;
+    struct rtattr *rta = IFA_RTA(ifa);
+    int length = IFA_PAYLOAD(nh);
+    for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        switch (rta->rta_type) {
+        case IFA_LOCAL:
+            cs_netcache_copy(address.address, rta, sizeof(address.address));
+            local = true;
+            break;
+        case IFA_ADDRESS:
+            if (!local) {
+                cs_netcache_copy(address.address,
+                    rta, sizeof(address.address));
+            }
+            break;
+        case IFA_LABEL:
+            address.label.assign((const char *)RTA_DATA(rta),
+                strnlen((const char *)RTA_DATA(rta), RTA_PAYLOAD(rta)));
+            break;
+        }
+    }
+
+    dirty |= (1 << TableAddress);
+    if (nh->nlmsg_type == RTM_DELADDR)
+        addresses.erase(cs_netcache_key(address));
+    else
+        addresses[cs_netcache_key(address)] = address;
+}
+
+void csNetlinkCache::UpdateRoute(struct nlmsghdr *nh)
+{
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) return;
+
+    struct rtmsg *rtm = (struct rtmsg *)NLMSG_DATA(nh);
+    if (rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6) return;
+    if (rtm->rtm_flags & RTM_F_CLONED) return;
+
+    csNetlinkRoute route;
+    memset(&route, 0, sizeof(route));
+    route.family = rtm->rtm_family;
+    route.dst_length = rtm->rtm_dst_len;
+    route.tos = rtm->rtm_tos;
+    route.protocol = rtm->rtm_protocol;
+    route.scope = rtm->rtm_scope;
+    route.type = rtm->rtm_type;
+    route.table = rtm->rtm_table;
+    route.generation = generation[TableRoute];
+
+    struct rtattr *rta = RTM_RTA(rtm);
+    int length = RTM_PAYLOAD(nh);
+    for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        switch (rta->rta_type) {
+        case RTA_DST:
+            cs_netcache_copy(route.dst, rta, sizeof(route.dst));
+            break;
+        case RTA_GATEWAY:
+            cs_netcache_copy(route.gateway, rta, sizeof(route.gateway));
+            route.has_gateway = true;
+            break;
+        case RTA_PREFSRC:
+            cs_netcache_copy(route.prefsrc, rta, sizeof(route.prefsrc));
+            break;
+        case RTA_OIF:
+            if (RTA_PAYLOAD(rta) >= sizeof(int))
+                route.oif = *(int *)RTA_DATA(rta);
+            break;
+        case RTA_PRIORITY:
+            if (RTA_PAYLOAD(rta) >= sizeof(uint32_t))
+                route.priority = *(uint32_t *)RTA_DATA(rta);
+            break;
+        case RTA_TABLE:
+            if (RTA_PAYLOAD(rta) >= sizeof(uint32_t))
+                route.table = *(uint32_t *)RTA_DATA(rta);
+            break;
+        case RTA_MULTIPATH:
+            if (RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)) {
+                struct rtnexthop *rtnh = (struct rtnexthop *)RTA_DATA(rta);
+                if (rtnh->rtnh_len < sizeof(struct rtnexthop) ||
+                    rtnh->rtnh_len > RTA_PAYLOAD(rta)) break;
+                route.oif = rtnh->rtnh_ifindex;
+
+                struct rtattr *nh_rta = RTNH_DATA(rtnh);
+                int nh_length = rtnh->rtnh_len - sizeof(struct rtnexthop);
+                for ( ; RTA_OK(nh_rta, nh_length);
+                    nh_rta = RTA_NEXT(nh_rta, nh_length)) {
+                    if (nh_rta->rta_type != RTA_GATEWAY) continue;
+                    cs_netcache_copy(route.gateway,
+                        nh_rta, sizeof(route.gateway));
+                    route.has_gateway = true;
+                }
+            }
+            break;
+        }
+    }
+
+    dirty |= (1 << TableRoute);
+    if (nh->nlmsg_type == RTM_DELROUTE)
+        routes.erase(cs_netcache_key(route));
+    else
+        routes[cs_netcache_key(route)] = route;
+}
+
+void csNetlinkCache::UpdateNeighbour(struct nlmsghdr *nh)
+{
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ndmsg))) return;
+
+    struct ndmsg *ndm = (struct ndmsg *)NLMSG_DATA(nh);
+    if (ndm->ndm_family != AF_INET && ndm->ndm_family != AF_INET6) return;
+
+    csNetlinkNeighbour neighbour;
+    neighbour.index = ndm->ndm_ifindex;
+    neighbour.family = ndm->ndm_family;
+    neighbour.flags = ndm->ndm_flags;
+    neighbour.state = ndm->ndm_state;
+    neighbour.generation = generation[TableNeighbour];
+    memset(neighbour.address, 0, sizeof(neighbour.address));
+
+    struct rtattr *rta = (struct rtattr *)((uint8_t *)ndm +
+        NLMSG_ALIGN(sizeof(struct ndmsg)));
+    int length = nh->nlmsg_len - NLMSG_LENGTH(sizeof(struct ndmsg));
+    for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        switch (rta->rta_type) {
+        case NDA_DST:
+            cs_netcache_copy(neighbour.address,
+                rta, sizeof(neighbour.address));
+            break;
+        case NDA_LLADDR:
+            neighbour.lladdr.assign((uint8_t *)RTA_DATA(rta),
+                (uint8_t *)RTA_DATA(rta) + RTA_PAYLOAD(rta));
+            break;
+        }
+    }
+
+    dirty |= (1 << TableNeighbour);
+    if (nh->nlmsg_type == RTM_DELNEIGH)
+        neighbours.erase(cs_netcache_key(neighbour));
+    else
+        neighbours[cs_netcache_key(neighbour)] = neighbour;
+}
+
+void csNetlinkCache::Purge(int index)
+{
+    dirty |= (1 << TableAddress) | (1 << TableRoute) | (1 << TableNeighbour);
+
+    map<string, csNetlinkAddress>::iterator ai;
+    for (ai = addresses.begin(); ai != addresses.end(); ) {
+        if (ai->second.index == index) addresses.erase(ai++);
+        else ai++;
+    }
+
+    map<string, csNetlinkRoute>::iterator ri;
+    for (ri = routes.begin(); ri != routes.end(); ) {
+        if (ri->second.oif == index) routes.erase(ri++);
+        else ri++;
+    }
+
+    map<string, csNetlinkNeighbour>::iterator ni;
+    for (ni = neighbours.begin(); ni != neighbours.end(); ) {
+        if (ni->second.index == index) neighbours.erase(ni++);
+        else ni++;
+    }
+}
+
+void csNetlinkCache::BeginDump(uint16_t type)
+{
+    int table = GetTable(type);
+    if (table != -1) generation[table]++;
+}
+
+void csNetlinkCache::EndDump(uint16_t type, bool complete)
+{
+    int table = GetTable(type);
+    if (table == -1) return;
+
+    dirty |= (1 << table);
+    // An interrupted dump doesn't show what's gone
+    if (!complete) return;
+
+    dumped |= (1 << table);
+
+    uint32_t current = generation[table];
+    switch (table) {
+    case TableLink: {
+        map<int, csNetlinkLink>::iterator i;
+        for (i = links.begin(); i != links.end(); ) {
+            if (i->second.generation != current) links.erase(i++);
+            else i++;
+        }
+        break;
+    }
+    case TableAddress: {
+        map<string, csNetlinkAddress>::iterator i;
+        for (i = addresses.begin(); i != addresses.end(); ) {
+            if (i->second.generation != current) addresses.erase(i++);
+            else i++;
+        }
+        break;
+    }
+    case TableRoute: {
+        map<string, csNetlinkRoute>::iterator i;
+        for (i = routes.begin(); i != routes.end(); ) {
+            if (i->second.generation != current) routes.erase(i++);
+            else i++;
+        }
+        break;
+    }
+    case TableNeighbour: {
+        map<string, csNetlinkNeighbour>::iterator i;
+        for (i = neighbours.begin(); i != neighbours.end(); ) {
+            if (i->second.generation != current) neighbours.erase(i++);
+            else i++;
+        }
+        break;
+    }
+    }
+}
+
+void csNetlinkCache::Publish(void)
+{
+    if (!dirty) return;
+
+    // Tables that haven't changed are shared with the current snapshot
+    csNetlinkSnapshot *current = snapshot;
+    unsigned rebuild = (current == NULL) ? (1 << TableMax) - 1 : dirty;
+    dirty = 0;
+
+    csNetlinkSnapshot *next = new csNetlinkSnapshot();
+    next->complete = (dumped == (1 << TableMax) - 1);
+
+    if (!(rebuild & (1 << TableLink)))
+        next->links = current->links->Ref();
+    else {
+        next->links = new csNetlinkSnapshot::Table<csNetlinkLink>();
+        vector<csNetlinkLink> &entries = next->links->entries;
+        entries.reserve(links.size());
+        for (map<int, csNetlinkLink>::iterator i = links.begin();
+            i != links.end(); i++) entries.push_back(i->second);
+    }
+
+    if (!(rebuild & (1 << TableAddress)))
+        next->addresses = current->addresses->Ref();
+    else {
+        next->addresses = new csNetlinkSnapshot::Table<csNetlinkAddress>();
+        vector<csNetlinkAddress> &entries = next->addresses->entries;
+        entries.reserve(addresses.size());
+        for (map<string, csNetlinkAddress>::iterator i = addresses.begin();
+            i != addresses.end(); i++) entries.push_back(i->second);
+    }
+
+    if (!(rebuild & (1 << TableRoute))) {
+        next->routes = current->routes->Ref();
+        next->route_range = current->route_range->Ref();
+    }
+    else {
+        next->routes = new csNetlinkSnapshot::Table<csNetlinkRoute>();
+        next->route_range =
+            new csNetlinkSnapshot::Table<csNetlinkSnapshot::RouteRange>();
+        vector<csNetlinkRoute> &entries = next->routes->entries;
+        vector<csNetlinkSnapshot::RouteRange> &ranges =
+            next->route_range->entries;
+        entries.reserve(routes.size());
+        for (map<string, csNetlinkRoute>::iterator i = routes.begin();
+            i != routes.end(); i++) {
+            const csNetlinkRoute &route = i->second;
+            if (ranges.empty() ||
+                ranges.back().family != route.family ||
+                ranges.back().dst_length != route.dst_length) {
+                csNetlinkSnapshot::RouteRange range;
+                range.family = route.family;
+                range.dst_length = route.dst_length;
+                range.begin = range.end = entries.size();
+                ranges.push_back(range);
+            }
+            entries.push_back(route);
+            ranges.back().end++;
+        }
+    }
+
+    if (!(rebuild & (1 << TableNeighbour)))
+        next->neighbours = current->neighbours->Ref();
+    else {
+        next->neighbours = new csNetlinkSnapshot::Table<csNetlinkNeighbour>();
+        vector<csNetlinkNeighbour> &entries = next->neighbours->entries;
+        entries.reserve(neighbours.size());
+        for (map<string, csNetlinkNeighbour>::iterator i = neighbours.begin();
+            i != neighbours.end(); i++) entries.push_back(i->second);
+    }
+
+    __sync_synchronize();
+    csNetlinkSnapshot *previous = snapshot;
+    snapshot = next;
+    __sync_synchronize();
+
+    if (previous != NULL) {
+        retired.push_back(previous);
+        previous->Unref();
+    }
+
+    Reap();
+}
+
+void csNetlinkCache::Reap(void)
+{
+    // A reader that loaded an old pointer is counted until its Ref()
+    // is done, so with no readers the reference counts can be trusted.
+    if (readers != 0) return;
+    __sync_synchronize();
+
+    for (vector<csNetlinkSnapshot *>::iterator i = retired.begin();
+        i != retired.end(); ) {
+        if ((*i)->refs != 0) {
+            i++;
+            continue;
+        }
+        delete (*i);
+        i = retired.erase(i);
+    }
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
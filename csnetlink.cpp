@@ -20,22 +20,32 @@
 
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/filter.h>
 
 #include <vector>
 #include <map>
 #include <string>
 #include <stdexcept>
+#include <sstream>
+#include <algorithm>
 
 #include <unistd.h>
+#include <poll.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <regex.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -45,11 +55,201 @@
 #include <clearsync/csevent.h>
 #include <clearsync/csthread.h>
 #include <clearsync/csnetlink.h>
+#include <clearsync/csnetcache.h>
 
-#define _EVENT_TIMEOUT_MS       (500)
+static pthread_mutex_t cs_netlink_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static csNetlinkBuffer *cs_netlink_pool[_CS_NETLINK_POOL];
+static int cs_netlink_pool_count = 0;
+
+csNetlinkBuffer::csNetlinkBuffer(size_t size)
+    : data(new uint8_t[size]), size(size), refs(1) { }
+
+csNetlinkBuffer::~csNetlinkBuffer()
+{
+    delete [] data;
+}
+
+csNetlinkBuffer *csNetlinkBuffer::Get(size_t size)
+{
+    csNetlinkBuffer *buffer = NULL;
+
+    pthread_mutex_lock(&cs_netlink_pool_mutex);
+    while (buffer == NULL && cs_netlink_pool_count > 0) {
+        buffer = cs_netlink_pool[--cs_netlink_pool_count];
+        // Left over from before the buffers were resized
+        if (buffer->size != size) {
+            delete buffer;
+            buffer = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cs_netlink_pool_mutex);
+
+    if (buffer == NULL) return new csNetlinkBuffer(size);
+
+    buffer->refs = 1;
+    return buffer;
+}
+
+void csNetlinkBuffer::Purge(void)
+{
+    pthread_mutex_lock(&cs_netlink_pool_mutex);
+    while (cs_netlink_pool_count > 0)
+        delete cs_netlink_pool[--cs_netlink_pool_count];
+    pthread_mutex_unlock(&cs_netlink_pool_mutex);
+}
+
+void csNetlinkBuffer::Ref(void)
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void csNetlinkBuffer::Unref(void)
+{
+    if (__sync_sub_and_fetch(&refs, 1) != 0) return;
+
+    pthread_mutex_lock(&cs_netlink_pool_mutex);
+    if (cs_netlink_pool_count < _CS_NETLINK_POOL) {
+        cs_netlink_pool[cs_netlink_pool_count++] = this;
+        pthread_mutex_unlock(&cs_netlink_pool_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&cs_netlink_pool_mutex);
+
+    delete this;
+}
+
+csNetlinkReply::csNetlinkReply()
+    : buffer(NULL), next(NULL), end(NULL) { }
+
+csNetlinkReply::csNetlinkReply(csNetlinkBuffer *buffer, struct nlmsghdr *nh)
+    : buffer(buffer), next((uint8_t *)nh),
+    end((uint8_t *)nh + NLMSG_ALIGN(nh->nlmsg_len))
+{
+    buffer->Ref();
+}
+
+csNetlinkReply::csNetlinkReply(const csNetlinkReply &reply)
+    : buffer(reply.buffer), next(reply.next), end(reply.end)
+{
+    if (buffer != NULL) buffer->Ref();
+}
+
+csNetlinkReply::~csNetlinkReply()
+{
+    if (buffer != NULL) buffer->Unref();
+}
+
+csNetlinkReply &csNetlinkReply::operator=(const csNetlinkReply &reply)
+{
+    if (reply.buffer != NULL) reply.buffer->Ref();
+    if (buffer != NULL) buffer->Unref();
+
+    buffer = reply.buffer;
+    next = reply.next;
+    end = reply.end;
+
+    return *this;
+}
+
+struct nlmsghdr *csNetlinkReply::Next(void)
+{
+    // Messages were checked with NLMSG_OK() when they were received
+    if (next >= end) return NULL;
+
+    struct nlmsghdr *nh = (struct nlmsghdr *)next;
+    next += NLMSG_ALIGN(nh->nlmsg_len);
+
+    return nh;
+}
+
+bool csNetlinkReply::Extend(csNetlinkBuffer *buffer, struct nlmsghdr *nh)
+{
+    if (buffer != this->buffer || (uint8_t *)nh != end) return false;
+
+    end += NLMSG_ALIGN(nh->nlmsg_len);
+
+    return true;
+}
+
+csNetlinkFilter::csNetlinkFilter()
+    : type(0), family(AF_UNSPEC), protocol(0), table(0), ifindex(0) { }
+
+bool csNetlinkFilter::Match(struct nlmsghdr *nh) const
+{
+    if (type != 0 && nh->nlmsg_type != type) return false;
+
+    // What doesn't apply to the message matches
+    uint8_t nh_family = family, nh_protocol = protocol;
+    uint32_t nh_table = table;
+    int nh_ifindex = 0;
+
+    switch (nh->nlmsg_type) {
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE: {
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+            return false;
+
+        struct rtmsg *rtm = (struct rtmsg *)NLMSG_DATA(nh);
+        nh_family = rtm->rtm_family;
+        nh_protocol = rtm->rtm_protocol;
+        nh_table = rtm->rtm_table;
+
+        struct rtattr *rta = RTM_RTA(rtm);
+        int length = RTM_PAYLOAD(nh);
+        for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+            if (RTA_PAYLOAD(rta) < sizeof(uint32_t)) continue;
+            if (rta->rta_type == RTA_TABLE)
+                nh_table = *(uint32_t *)RTA_DATA(rta);
+            else if (rta->rta_type == RTA_OIF)
+                nh_ifindex = *(int *)RTA_DATA(rta);
+        }
+        break;
+    }
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+            return false;
+        nh_ifindex = ((struct ifinfomsg *)NLMSG_DATA(nh))->ifi_index;
+        break;
+
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg)))
+            return false;
+        nh_family = ((struct ifaddrmsg *)NLMSG_DATA(nh))->ifa_family;
+        nh_ifindex = ((struct ifaddrmsg *)NLMSG_DATA(nh))->ifa_index;
+        break;
+
+    case RTM_NEWNEIGH:
+    case RTM_DELNEIGH:
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ndmsg)))
+            return false;
+        nh_family = ((struct ndmsg *)NLMSG_DATA(nh))->ndm_family;
+        nh_ifindex = ((struct ndmsg *)NLMSG_DATA(nh))->ndm_ifindex;
+        break;
+
+    default:
+        return false;
+    }
+
+    if (family != AF_UNSPEC && nh_family != family) return false;
+    if (protocol != 0 && nh_protocol != protocol) return false;
+    if (table != 0 && nh_table != table) return false;
+    if (ifindex != 0 && nh_ifindex != ifindex) return false;
+
+    return true;
+}
+
+bool csNetlinkFilter::operator==(const csNetlinkFilter &filter) const
+{
+    return (type == filter.type && family == filter.family &&
+        protocol == filter.protocol && table == filter.table &&
+        ifindex == filter.ifindex);
+}
 
 csEventNetlink::csEventNetlink(enum Type type, uint16_t query)
-    : csEvent(csEVENT_NETLINK), type(type), query(query), query_seq(0)
+    : csEvent(csEVENT_NETLINK), type(type), query(query), query_seq(0),
+    quiet_period(-1), reply_index(0)
 {
     reply_mutex = new pthread_mutex_t;
     pthread_mutex_init(reply_mutex, NULL);
@@ -58,135 +258,1001 @@ csEventNetlink::csEventNetlink(enum Type type, uint16_t query)
 csEventNetlink::~csEventNetlink()
 {
     pthread_mutex_destroy(reply_mutex);
+    delete reply_mutex;
+}
+
+bool csEventNetlink::Match(struct nlmsghdr *nh)
+{
+    if (filter.empty()) return true;
+
+    vector<csNetlinkFilter>::iterator i;
+    for (i = filter.begin(); i != filter.end(); i++)
+        if (i->Match(nh)) return true;
+
+    return false;
+}
+
+void csEventNetlink::AddReply(csNetlinkBuffer *buffer, struct nlmsghdr *nh)
+{
+    pthread_mutex_lock(reply_mutex);
+    if (reply.size() == reply_index || !reply.back().Extend(buffer, nh))
+        reply.push_back(csNetlinkReply(buffer, nh));
+    pthread_mutex_unlock(reply_mutex);
 }
 
-void csEventNetlink::AddReply(struct nlmsghdr *nh)
+bool csEventNetlink::GetReply(csNetlinkReply &reply)
 {
-    struct nlmsghdr *_nh;
-    size_t length = NLMSG_LENGTH(nh->nlmsg_len);
+    bool found = false;
+
+    pthread_mutex_lock(reply_mutex);
+    if (reply_index < this->reply.size()) {
+        reply = this->reply[reply_index++];
+        found = true;
+    }
+    if (reply_index == this->reply.size()) {
+        this->reply.clear();
+        reply_index = 0;
+    }
+    pthread_mutex_unlock(reply_mutex);
 
-    _nh = (struct nlmsghdr *)new uint8_t[length];
-    memcpy(_nh, nh, length);
+    return found;
+}
+
+struct nlmsghdr *csEventNetlink::GetReply(void)
+{
+    struct nlmsghdr *nh = NULL, *_nh = NULL;
 
     pthread_mutex_lock(reply_mutex);
-    reply.push_back(_nh);
+    while (nh == NULL && reply_index < reply.size()) {
+        if ((nh = reply[reply_index].Next()) == NULL) reply_index++;
+    }
+    if (nh != NULL) {
+        _nh = (struct nlmsghdr *)new uint8_t[nh->nlmsg_len];
+        memcpy(_nh, nh, nh->nlmsg_len);
+    }
+    if (reply_index == reply.size()) {
+        reply.clear();
+        reply_index = 0;
+    }
     pthread_mutex_unlock(reply_mutex);
+
+    return _nh;
+}
+
+csEvent *csEventNetlink::Clone(void)
+{
+    // Error!  Can't broadcast or clone this event type!
+    throw csException(EINVAL, "Broadcast/clone");
+}
+
+// For each type of watch: its notifications, the dump that resyncs it,
+// and the multicast groups to join (the route groups are bound)
+static const struct {
+    csEventNetlink::Type watch;
+    uint16_t type_new;
+    uint16_t type_del;
+    uint16_t dump;
+    int group[2];
+} cs_netlink_watch[] = {
+    { csEventNetlink::NL_LinkWatch,
+        RTM_NEWLINK, RTM_DELLINK, RTM_GETLINK, { RTNLGRP_LINK, 0 } },
+    { csEventNetlink::NL_AddrWatch,
+        RTM_NEWADDR, RTM_DELADDR, RTM_GETADDR,
+        { RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR } },
+    { csEventNetlink::NL_RouteWatch,
+        RTM_NEWROUTE, RTM_DELROUTE, RTM_GETROUTE, { 0, 0 } },
+    { csEventNetlink::NL_NeighWatch,
+        RTM_NEWNEIGH, RTM_DELNEIGH, RTM_GETNEIGH, { RTNLGRP_NEIGH, 0 } },
+};
+
+#define _CS_NETLINK_WATCH_TYPES \
+    (sizeof(cs_netlink_watch) / sizeof(cs_netlink_watch[0]))
+
+// The watch type of a notification or dump request, NL_Query if none
+static csEventNetlink::Type cs_netlink_watch_type(uint16_t type)
+{
+    for (size_t i = 0; i < _CS_NETLINK_WATCH_TYPES; i++) {
+        if (type == cs_netlink_watch[i].type_new ||
+            type == cs_netlink_watch[i].type_del ||
+            type == cs_netlink_watch[i].dump)
+            return cs_netlink_watch[i].watch;
+    }
+
+    return csEventNetlink::NL_Query;
+}
+
+static bool cs_netlink_is_delete(uint16_t type)
+{
+    for (size_t i = 0; i < _CS_NETLINK_WATCH_TYPES; i++)
+        if (type == cs_netlink_watch[i].type_del) return true;
+
+    return false;
+}
+
+static time_t cs_netlink_clock_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (time_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+csThreadNetlink *csThreadNetlink::instance = NULL;
+
+csThreadNetlink::csThreadNetlink(csEventClient *parent, bool on_demand)
+    : csThread(),
+    name("csThreadNetlink"), parent(parent), cache(NULL), cache_enable(false),
+    route_quiet_period(_CS_NETLINK_QUIET_PERIOD), stats_interval(0),
+    stats_mutex(NULL), stats_sample_ms(0), stats_last_ms(0),
+    stats_next_ms(0), fd_netlink(-1), nl_buffer(NULL), nl_buffer_size(0), nl_msgs(NULL),
+    nl_iov(NULL), nl_seq(0), nl_dump_type(0), nl_dump_seq(0),
+    nl_groups(0), nl_resync(0), nl_resync_seq(0), nl_overruns(0),
+    nl_filter_attached(false), unwatch_mutex(NULL), unwatch_cond(NULL),
+    nl_running(false), nl_rcvbuf(_CS_NETLINK_RCVBUF), on_demand(on_demand)
+{
+    if (instance != NULL)
+        throw csException(EEXIST, name.c_str());
+
+    instance = this;
+    SetThreadName("netlink");
+
+    stats_mutex = new pthread_mutex_t;
+    pthread_mutex_init(stats_mutex, NULL);
+    unwatch_mutex = new pthread_mutex_t;
+    pthread_mutex_init(unwatch_mutex, NULL);
+    unwatch_cond = new pthread_cond_t;
+    pthread_cond_init(unwatch_cond, NULL);
+
+    nl_buffer = new csNetlinkBuffer *[_CS_NETLINK_BATCH];
+    memset(nl_buffer, 0, sizeof(csNetlinkBuffer *) * _CS_NETLINK_BATCH);
+    nl_msgs = new struct mmsghdr[_CS_NETLINK_BATCH];
+    nl_iov = new struct iovec[_CS_NETLINK_BATCH];
+    AllocateBuffers(_CS_NETLINK_BUFFER_SIZE);
+
+    memset(&sa_local, 0, sizeof(sa_local));
+    sa_local.nl_family = AF_NETLINK;
+    // Assigned by the kernel on bind(), see Open()
+    sa_local.nl_pid = 0;
+    sa_local.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+
+    // Otherwise opened for the first watch, queries have their own sockets
+    if (!on_demand) Open();
+
+    csLog::Log(csLog::Debug, "%s: Initialized.", name.c_str());
+}
+
+csThreadNetlink::~csThreadNetlink()
+{
+    Join();
+
+    if (instance != this) return;
+    if (fd_netlink != -1) close(fd_netlink);
+    for (size_t i = 0; i < nl_socket.size(); i++) close(nl_socket[i].fd);
+    if (nl_buffer != NULL) {
+        for (int i = 0; i < _CS_NETLINK_BATCH; i++)
+            if (nl_buffer[i] != NULL) nl_buffer[i]->Unref();
+        delete [] nl_buffer;
+    }
+    if (nl_msgs != NULL) delete [] nl_msgs;
+    if (nl_iov != NULL) delete [] nl_iov;
+
+    csNetlinkBuffer::Purge();
+
+    if (cache != NULL) delete cache;
+
+    pthread_mutex_destroy(stats_mutex);
+    delete stats_mutex;
+    pthread_cond_destroy(unwatch_cond);
+    delete unwatch_cond;
+    pthread_mutex_destroy(unwatch_mutex);
+    delete unwatch_mutex;
+}
+
+void csThreadNetlink::Open(void)
+{
+    const char *handoff = getenv(_CS_NETLINK_HANDOFF_ENV);
+    if (handoff != NULL) {
+        struct sockaddr_nl sa_handoff;
+        socklen_t sa_length = sizeof(sa_handoff);
+
+        fd_netlink = atoi(handoff);
+        unsetenv(_CS_NETLINK_HANDOFF_ENV);
+
+        if (getsockname(fd_netlink,
+            (struct sockaddr *)&sa_handoff, &sa_length) == -1 ||
+            sa_handoff.nl_family != AF_NETLINK) {
+            csLog::Log(csLog::Warning, "%s: Invalid handoff descriptor: %s",
+                name.c_str(), handoff);
+            fd_netlink = -1;
+        }
+        else {
+            sa_local.nl_pid = sa_handoff.nl_pid;
+            // Filters are set again as watches are registered
+            setsockopt(fd_netlink, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+            csLog::Log(csLog::Debug, "%s: Adopted handoff descriptor: %d",
+                name.c_str(), fd_netlink);
+        }
+    }
+
+    if (fd_netlink == -1) {
+        fd_netlink = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+        if (fd_netlink == -1) {
+            csLog::Log(csLog::Error, "%s: socket: %s",
+                name.c_str(), strerror(errno));
+            return;
+        }
+
+        // A query socket may already hold getpid() as its port ID, so
+        // let the kernel pick one, and find out which.
+        struct sockaddr_nl sa_bound;
+        socklen_t sa_length = sizeof(sa_bound);
+
+        sa_local.nl_pid = 0;
+        if (bind(fd_netlink,
+            (struct sockaddr *)&sa_local, sizeof(sa_local)) == -1) {
+            csLog::Log(csLog::Error, "%s: bind: %s",
+                name.c_str(), strerror(errno));
+            close(fd_netlink);
+            fd_netlink = -1;
+            return;
+        }
+        if (getsockname(fd_netlink,
+            (struct sockaddr *)&sa_bound, &sa_length) == -1) {
+            csLog::Log(csLog::Error, "%s: getsockname: %s",
+                name.c_str(), strerror(errno));
+            close(fd_netlink);
+            fd_netlink = -1;
+            return;
+        }
+        sa_local.nl_pid = sa_bound.nl_pid;
+    }
+
+    SetReceiveBufferSize(nl_rcvbuf);
+}
+
+void csThreadNetlink::Handoff(void)
+{
+    if (fd_netlink == -1) return;
+
+    ostringstream os;
+    os << fd_netlink;
+    setenv(_CS_NETLINK_HANDOFF_ENV, os.str().c_str(), 1);
+
+    // The descriptor now belongs to the next process image.
+    fd_netlink = -1;
+}
+
+void csThreadNetlink::SetReceiveBufferSize(int size)
+{
+    nl_rcvbuf = size;
+    if (fd_netlink == -1) return;
+
+    // Privileged processes may exceed net.core.rmem_max
+    if (setsockopt(fd_netlink, SOL_SOCKET, SO_RCVBUFFORCE,
+        &size, sizeof(size)) == -1 &&
+        setsockopt(fd_netlink, SOL_SOCKET, SO_RCVBUF,
+        &size, sizeof(size)) == -1) {
+        csLog::Log(csLog::Warning, "%s: SO_RCVBUF: %s",
+            name.c_str(), strerror(errno));
+        return;
+    }
+
+    socklen_t length = sizeof(size);
+    if (getsockopt(fd_netlink, SOL_SOCKET, SO_RCVBUF, &size, &length) == 0) {
+        csLog::Log(csLog::Debug, "%s: Receive buffer: %d bytes",
+            name.c_str(), size);
+    }
+}
+
+void csThreadNetlink::AllocateBuffers(size_t size)
+{
+    size_t page_size = (size_t)::csGetPageSize();
+    size = (size + page_size - 1) / page_size * page_size;
+
+    nl_buffer_size = size;
+
+    memset(nl_msgs, 0, sizeof(struct mmsghdr) * _CS_NETLINK_BATCH);
+    for (int i = 0; i < _CS_NETLINK_BATCH; i++) {
+        if (nl_buffer[i] != NULL) nl_buffer[i]->Unref();
+        nl_buffer[i] = csNetlinkBuffer::Get(size);
+        nl_iov[i].iov_base = nl_buffer[i]->GetData();
+        nl_iov[i].iov_len = size;
+        nl_msgs[i].msg_hdr.msg_iov = &nl_iov[i];
+        nl_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    csLog::Log(csLog::Debug, "%s: Receive buffers: %d x %lu bytes",
+        name.c_str(), _CS_NETLINK_BATCH, size);
+}
+
+csNetlinkSnapshot *csThreadNetlink::GetSnapshot(void)
+{
+    csNetlinkCache *current = cache;
+    if (current == NULL) return NULL;
+
+    return current->GetSnapshot();
+}
+
+bool csThreadNetlink::GetLinkStats(int index, csNetlinkLinkStats &stats)
+{
+    bool found = false;
+
+    pthread_mutex_lock(stats_mutex);
+    map<int, csNetlinkLinkStats>::iterator i = this->stats.find(index);
+    if (i != this->stats.end()) {
+        stats = i->second;
+        found = true;
+    }
+    pthread_mutex_unlock(stats_mutex);
+
+    return found;
+}
+
+bool csThreadNetlink::GetLinkStats(const string &name,
+    csNetlinkLinkStats &stats)
+{
+    bool found = false;
+
+    pthread_mutex_lock(stats_mutex);
+    map<int, csNetlinkLinkStats>::iterator i;
+    for (i = this->stats.begin(); i != this->stats.end(); i++) {
+        if (i->second.name != name) continue;
+        stats = i->second;
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(stats_mutex);
+
+    return found;
+}
+
+void csThreadNetlink::GetLinkStats(vector<csNetlinkLinkStats> &stats)
+{
+    stats.clear();
+
+    pthread_mutex_lock(stats_mutex);
+    map<int, csNetlinkLinkStats>::iterator i;
+    for (i = this->stats.begin(); i != this->stats.end(); i++)
+        stats.push_back(i->second);
+    pthread_mutex_unlock(stats_mutex);
+}
+
+void csThreadNetlink::Unwatch(csEventClient *client,
+    vector<csEvent *> &events)
+{
+    nl_unwatch_t unwatch;
+    unwatch.done = false;
+    unwatch.events = &events;
+
+    csEventNetlink *event = new csEventNetlink(csEventNetlink::NL_Unwatch);
+    event->SetUserData(&unwatch);
+
+    pthread_mutex_lock(unwatch_mutex);
+    if (!nl_running) {
+        // Nothing is sent to anyone either
+        pthread_mutex_unlock(unwatch_mutex);
+        delete event;
+        return;
+    }
+    EventPush(event, client);
+    while (!unwatch.done && nl_running)
+        pthread_cond_wait(unwatch_cond, unwatch_mutex);
+    pthread_mutex_unlock(unwatch_mutex);
+}
+
+void *csThreadNetlink::Entry(void)
+{
+    pthread_mutex_lock(unwatch_mutex);
+    nl_running = true;
+    pthread_mutex_unlock(unwatch_mutex);
+
+    void *rc = EventLoop();
+
+    pthread_mutex_lock(unwatch_mutex);
+    nl_running = false;
+    pthread_cond_broadcast(unwatch_cond);
+    pthread_mutex_unlock(unwatch_mutex);
+
+    return rc;
+}
+
+void *csThreadNetlink::EventLoop(void)
+{
+    // Sleep until either the kernel or another thread has something for
+    // us; there's no timeout, so an idle thread is never woken.
+    vector<struct pollfd> fds(2);
+    fds[0].fd = fd_netlink;
+    fds[0].events = POLLIN;
+    fds[1].fd = EventGetDescriptor();
+    fds[1].events = POLLIN;
+
+    csLog::Log(csLog::Debug, "Netlink thread started.");
+
+    if (cache_enable && fd_netlink != -1) {
+        JoinGroups(csEventNetlink::NL_LinkWatch);
+        JoinGroups(csEventNetlink::NL_AddrWatch);
+        JoinGroups(csEventNetlink::NL_NeighWatch);
+
+        // Published once, for GetSnapshot() in other threads
+        csNetlinkCache *netlink_cache = new csNetlinkCache();
+        __sync_synchronize();
+        cache = netlink_cache;
+
+        QueueDump(RTM_GETLINK);
+        QueueDump(RTM_GETADDR);
+        QueueDump(RTM_GETROUTE);
+        QueueDump(RTM_GETNEIGH);
+        StartDump();
+    }
+
+    UpdateFilter();
+
+    if (stats_interval > 0 && fd_netlink != -1)
+        stats_next_ms = cs_netlink_clock_ms();
+
+    for ( ;; ) {
+        int wait_ms = ReleaseChanges();
+        if (stats_next_ms != 0) {
+            int sample_ms = SampleLinkStats();
+            if (wait_ms == -1 || sample_ms < wait_ms) wait_ms = sample_ms;
+        }
+
+        // Request sockets are opened as queries need them
+        fds.resize(2 + nl_socket.size());
+        fds[0].fd = fd_netlink;
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (i >= 2) fds[i].fd = nl_socket[i - 2].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(&fds[0], fds.size(), wait_ms) < 0) {
+            if (errno == EINTR) continue;
+            csLog::Log(csLog::Error, "%s: poll: %s",
+                name.c_str(), strerror(errno));
+            return NULL;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(fds[1].fd, &count, sizeof(count)) < 0 &&
+                errno != EAGAIN) {
+                csLog::Log(csLog::Error, "%s: read: %s",
+                    name.c_str(), strerror(errno));
+            }
+            event_wakeups++;
+
+            csEvent *event;
+            while ((event = EventPop()) != NULL) {
+                switch (event->GetId()) {
+                case csEVENT_QUIT:
+                    csLog::Log(csLog::Debug,
+                        "Netlink thread terminated.");
+                    EventDestroy(event);
+                    return NULL;
+
+                case csEVENT_NETLINK:
+                    ProcessEvent(static_cast<csEventNetlink *>(event));
+                    break;
+
+                default:
+                    csLog::Log(csLog::Debug,
+                        "csThreadNetlink: unhandled event: %u",
+                        event->GetId());
+                    EventDestroy(event);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (i == 1 || fds[i].revents == 0) continue;
+            if (!ReceiveNetlinkMessages(fds[i].fd)) return NULL;
+        }
+    }
+
+    return NULL;
 }
 
-struct nlmsghdr *csEventNetlink::GetReply(void)
-{
-    struct nlmsghdr *nh = NULL;
-    vector<struct nlmsghdr *>::iterator i;
+bool csThreadNetlink::ReceiveNetlinkMessages(int fd)
+{
+    for ( ;; ) {
+        // Make room for the next message, or it would be truncated
+        ssize_t length = recv(fd, NULL, 0,
+            MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+        int count = -1;
+        if (length >= 0) {
+            if ((size_t)length > nl_buffer_size) AllocateBuffers(length);
+            count = recvmmsg(fd,
+                nl_msgs, _CS_NETLINK_BATCH, MSG_DONTWAIT, NULL);
+        }
+
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            if (errno == ENOBUFS) {
+                Overrun(fd);
+                continue;
+            }
+            csLog::Log(csLog::Error, "%s: recvmmsg: %s",
+                name.c_str(), strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < count; i++) {
+            // Only the first message was measured
+            if (nl_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                Overrun(fd);
+                continue;
+            }
+            ProcessNetlinkMessage(fd, nl_buffer[i], nl_msgs[i].msg_len);
+        }
+
+        // Buffers that replies point into can't be reused yet
+        for (int i = 0; i < count; i++) {
+            if (!nl_buffer[i]->IsShared()) continue;
+            nl_buffer[i]->Unref();
+            nl_buffer[i] = csNetlinkBuffer::Get(nl_buffer_size);
+            nl_iov[i].iov_base = nl_buffer[i]->GetData();
+        }
+
+        DispatchReplies();
+    }
+
+    if (cache != NULL) cache->Publish();
+    StartDump();
+    StartQueries();
+
+    return true;
+}
+
+void csThreadNetlink::Overrun(int fd)
+{
+    if (fd != fd_netlink) {
+        // Dumps are paced by the reader, this shouldn't happen
+        csLog::Log(csLog::Warning, "%s: Netlink query reply lost.",
+            name.c_str());
+        return;
+    }
+
+    nl_overruns++;
+    csLog::Log(csLog::Warning,
+        "%s: Netlink messages lost (%lu overruns), resynchronizing.",
+        name.c_str(), nl_overruns);
+
+    // Tables that are neither cached nor watched are skipped
+    for (size_t i = 0; i < _CS_NETLINK_WATCH_TYPES; i++) {
+        nl_resync |= (1 << cs_netlink_watch[i].watch);
+        QueueDump(cs_netlink_watch[i].dump);
+    }
+}
+
+bool csThreadNetlink::IsWatched(csEventNetlink::Type type)
+{
+    vector<csEventNetlink *>::iterator i;
+    for (i = event_watch.begin(); i != event_watch.end(); i++)
+        if ((*i)->GetType() == type) return true;
+
+    return false;
+}
+
+void csThreadNetlink::JoinGroups(csEventNetlink::Type type)
+{
+    if (fd_netlink == -1) return;
+
+    for (size_t i = 0; i < _CS_NETLINK_WATCH_TYPES; i++) {
+        if (cs_netlink_watch[i].watch != type) continue;
+
+        for (int j = 0; j < 2; j++) {
+            int group = cs_netlink_watch[i].group[j];
+            if (group == 0 || (nl_groups & (1 << group))) continue;
+
+            if (setsockopt(fd_netlink, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+                &group, sizeof(group)) == -1) {
+                csLog::Log(csLog::Warning,
+                    "%s: NETLINK_ADD_MEMBERSHIP: %d: %s",
+                    name.c_str(), group, strerror(errno));
+                continue;
+            }
+            nl_groups |= (1 << group);
+        }
+    }
+}
+
+// Messages are accepted whole, or dropped
+#define _CS_NETLINK_BPF_ACCEPT  0xffffffff
+#define _CS_NETLINK_BPF_DROP    0
+
+// Offsets into messages: links, addresses and neighbours all have the
+// interface index at the same offset; routes have it as an attribute
+#define _CS_NETLINK_BPF_TYPE    offsetof(struct nlmsghdr, nlmsg_type)
+#define _CS_NETLINK_BPF_PID     offsetof(struct nlmsghdr, nlmsg_pid)
+#define _CS_NETLINK_BPF_FAMILY  NLMSG_HDRLEN
+#define _CS_NETLINK_BPF_IFINDEX \
+    (NLMSG_HDRLEN + offsetof(struct ifaddrmsg, ifa_index))
+#define _CS_NETLINK_BPF_RTM(m)  (NLMSG_HDRLEN + offsetof(struct rtmsg, m))
+#define _CS_NETLINK_BPF_RTA     NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct rtmsg)))
+
+static void cs_netlink_bpf(vector<struct sock_filter> &program,
+    uint16_t code, uint32_t k, uint8_t jt = 0, uint8_t jf = 0)
+{
+    struct sock_filter insn;
+
+    insn.code = code;
+    insn.jt = jt;
+    insn.jf = jf;
+    insn.k = k;
+
+    program.push_back(insn);
+}
+
+// Compares A with k, adding a jump to fail (patched later) on mismatch
+static void cs_netlink_bpf_match(vector<struct sock_filter> &program,
+    vector<size_t> &fail, uint32_t k, uint16_t op = BPF_JEQ)
+{
+    fail.push_back(program.size());
+    cs_netlink_bpf(program, BPF_JMP | op | BPF_K, k);
+}
+
+// Loads a 32-bit route attribute into A; a missing attribute fails
+static void cs_netlink_bpf_attr(vector<struct sock_filter> &program,
+    vector<size_t> &fail, uint16_t type)
+{
+    cs_netlink_bpf(program, BPF_LD | BPF_IMM, _CS_NETLINK_BPF_RTA);
+    cs_netlink_bpf(program, BPF_LDX | BPF_IMM, type);
+    cs_netlink_bpf(program, BPF_LD | BPF_W | BPF_ABS,
+        SKF_AD_OFF + SKF_AD_NLATTR);
+    cs_netlink_bpf_match(program, fail, 0, BPF_JGT);
+    cs_netlink_bpf(program, BPF_MISC | BPF_TAX, 0);
+    cs_netlink_bpf(program, BPF_LD | BPF_W | BPF_IND, sizeof(struct nlattr));
+}
+
+// Accepts a message that matches the filter, or moves on to what follows
+static void cs_netlink_bpf_filter(vector<struct sock_filter> &program,
+    csEventNetlink::Type watch, const csNetlinkFilter &filter)
+{
+    vector<size_t> fail;
+    bool route = (watch == csEventNetlink::NL_RouteWatch);
+
+    if (filter.type != 0) {
+        cs_netlink_bpf(program,
+            BPF_LD | BPF_H | BPF_ABS, _CS_NETLINK_BPF_TYPE);
+        cs_netlink_bpf_match(program, fail, htons(filter.type));
+    }
+    if (filter.family != AF_UNSPEC &&
+        watch != csEventNetlink::NL_LinkWatch) {
+        cs_netlink_bpf(program,
+            BPF_LD | BPF_B | BPF_ABS, _CS_NETLINK_BPF_FAMILY);
+        cs_netlink_bpf_match(program, fail, filter.family);
+    }
+    if (route && filter.protocol != 0) {
+        cs_netlink_bpf(program, BPF_LD | BPF_B | BPF_ABS,
+            _CS_NETLINK_BPF_RTM(rtm_protocol));
+        cs_netlink_bpf_match(program, fail, filter.protocol);
+    }
+    if (route && filter.table != 0 && filter.table < 256) {
+        cs_netlink_bpf(program, BPF_LD | BPF_B | BPF_ABS,
+            _CS_NETLINK_BPF_RTM(rtm_table));
+        cs_netlink_bpf_match(program, fail, filter.table);
+    }
+    else if (route && filter.table != 0) {
+        cs_netlink_bpf_attr(program, fail, RTA_TABLE);
+        cs_netlink_bpf_match(program, fail, htonl(filter.table));
+    }
+    if (route && filter.ifindex != 0)
+        cs_netlink_bpf_attr(program, fail, RTA_OIF);
+    else if (filter.ifindex != 0) {
+        cs_netlink_bpf(program,
+            BPF_LD | BPF_W | BPF_ABS, _CS_NETLINK_BPF_IFINDEX);
+    }
+    if (filter.ifindex != 0)
+        cs_netlink_bpf_match(program, fail, htonl(filter.ifindex));
+
+    cs_netlink_bpf(program, BPF_RET | BPF_K, _CS_NETLINK_BPF_ACCEPT);
+
+    for (size_t i = 0; i < fail.size(); i++)
+        program[fail[i]].jf = program.size() - fail[i] - 1;
+}
+
+// Accepts everything but notifications of the kinds watches are sent,
+// which must match a filter of the watch type; every notification of a
+// type with an empty union, and none of an unwatched type.  Packet loads
+// are big-endian, netlink is host order: hence the htonl().
+static void cs_netlink_bpf_compile(
+    const map<int, vector<csNetlinkFilter> > &filter,
+    uint32_t pid, vector<struct sock_filter> &program)
+{
+    vector<size_t> section;
+
+    program.clear();
+
+    cs_netlink_bpf(program, BPF_LD | BPF_H | BPF_ABS, _CS_NETLINK_BPF_TYPE);
+    for (size_t i = 0; i < _CS_NETLINK_WATCH_TYPES; i++) {
+        cs_netlink_bpf(program, BPF_JMP | BPF_JEQ | BPF_K,
+            htons(cs_netlink_watch[i].type_new), 1, 0);
+        cs_netlink_bpf(program, BPF_JMP | BPF_JEQ | BPF_K,
+            htons(cs_netlink_watch[i].type_del), 0, 1);
+        // Sections may be too far for a conditional jump
+        section.push_back(program.size());
+        cs_netlink_bpf(program, BPF_JMP | BPF_JA, 0);
+    }
+    cs_netlink_bpf(program, BPF_RET | BPF_K, _CS_NETLINK_BPF_ACCEPT);
+
+    for (size_t i = 0; i < _CS_NETLINK_WATCH_TYPES; i++) {
+        program[section[i]].k = program.size() - section[i] - 1;
+
+        // Replies to our own dumps
+        cs_netlink_bpf(program, BPF_LD | BPF_W | BPF_ABS, _CS_NETLINK_BPF_PID);
+        cs_netlink_bpf(program, BPF_JMP | BPF_JEQ | BPF_K, htonl(pid), 0, 1);
+        cs_netlink_bpf(program, BPF_RET | BPF_K, _CS_NETLINK_BPF_ACCEPT);
+
+        map<int, vector<csNetlinkFilter> >::const_iterator j;
+        j = filter.find(cs_netlink_watch[i].watch);
+        if (j != filter.end() && j->second.empty()) {
+            cs_netlink_bpf(program, BPF_RET | BPF_K, _CS_NETLINK_BPF_ACCEPT);
+            continue;
+        }
+
+        if (j != filter.end()) {
+            vector<csNetlinkFilter>::const_iterator k;
+            for (k = j->second.begin(); k != j->second.end(); k++)
+                cs_netlink_bpf_filter(program, cs_netlink_watch[i].watch, *k);
+        }
 
-    pthread_mutex_lock(reply_mutex);
-    if (reply.size() > 0) {
-        i = reply.begin();
-        nh = (*i);
-        reply.erase(i);
+        cs_netlink_bpf(program, BPF_RET | BPF_K, _CS_NETLINK_BPF_DROP);
     }
-    pthread_mutex_unlock(reply_mutex);
-
-    return nh;
 }
 
-csEvent *csEventNetlink::Clone(void)
+void csThreadNetlink::UpdateFilter(void)
 {
-    // Error!  Can't broadcast or clone this event type!
-    throw csException(EINVAL, "Broadcast/clone");
-}
+    if (fd_netlink == -1) return;
 
-csThreadNetlink *csThreadNetlink::instance = NULL;
+    // The cache wants every change
+    bool all = (cache != NULL);
+    map<int, vector<csNetlinkFilter> > filter;
 
-csThreadNetlink::csThreadNetlink(csEventClient *parent)
-    : csThread(),
-    name("csThreadNetlink"), parent(parent), fd_netlink(-1),
-    nl_buffer(NULL), nl_buffer_size(0), nl_seq(0)
-{
-    if (instance != NULL)
-        throw csException(EEXIST, name.c_str());
+    vector<csEventNetlink *>::iterator i;
+    for (i = event_watch.begin(); !all && i != event_watch.end(); i++) {
+        const vector<csNetlinkFilter> &watch = (*i)->GetFilters();
 
-    instance = this;
+        map<int, vector<csNetlinkFilter> >::iterator j;
+        j = filter.find((*i)->GetType());
+        if (j == filter.end()) {
+            filter[(*i)->GetType()] = watch;
+            continue;
+        }
+        // A watch without filters wants every change of its type
+        if (j->second.empty()) continue;
+        if (watch.empty()) {
+            j->second.clear();
+            continue;
+        }
 
-    memset(&sa_local, 0, sizeof(sa_local));
-    sa_local.nl_family = AF_NETLINK;
-    sa_local.nl_pid = getpid();
-    sa_local.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+        vector<csNetlinkFilter>::const_iterator k;
+        for (k = watch.begin(); k != watch.end(); k++) {
+            if (find(j->second.begin(), j->second.end(), (*k)) ==
+                j->second.end()) j->second.push_back((*k));
+        }
+    }
 
-    fd_netlink = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
-    if (fd_netlink == -1) {
-        csLog::Log(csLog::Error, "%s: socket: %s",
-            name.c_str(), strerror(errno));
+    vector<struct sock_filter> program;
+    if (!all) {
+        cs_netlink_bpf_compile(filter, sa_local.nl_pid, program);
+        if (program.size() > BPF_MAXINSNS) {
+            csLog::Log(csLog::Warning,
+                "%s: Too many watch filters, not filtering.",
+                name.c_str());
+            all = true;
+        }
+    }
+
+    if (all) {
+        if (!nl_filter_attached) return;
+        // Fails with ENOENT if there is no filter, which is fine
+        setsockopt(fd_netlink, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+        nl_filter.clear();
+        nl_filter_attached = false;
         return;
     }
 
-    if (bind(fd_netlink,
-        (struct sockaddr *)&sa_local, sizeof(sa_local)) == -1) {
-        csLog::Log(csLog::Error, "%s: bind: %s",
+    if (nl_filter_attached && filter == nl_filter) return;
+
+    struct sock_fprog fprog;
+    fprog.len = program.size();
+    fprog.filter = &program[0];
+
+    if (setsockopt(fd_netlink, SOL_SOCKET, SO_ATTACH_FILTER,
+        &fprog, sizeof(fprog)) == -1) {
+        csLog::Log(csLog::Warning, "%s: SO_ATTACH_FILTER: %s",
             name.c_str(), strerror(errno));
         return;
     }
 
-    nl_buffer_size = ::csGetPageSize();
-    nl_buffer = new uint8_t[nl_buffer_size];
+    nl_filter = filter;
+    nl_filter_attached = true;
 
-    csLog::Log(csLog::Debug, "%s: Initialized.", name.c_str());
+    csLog::Log(csLog::Debug, "%s: Socket filter: %lu instructions",
+        name.c_str(), program.size());
 }
 
-csThreadNetlink::~csThreadNetlink()
+void csThreadNetlink::QueueDump(uint16_t type)
 {
-    Join();
+    vector<uint16_t>::iterator i;
+    for (i = nl_dump_queue.begin(); i != nl_dump_queue.end(); i++)
+        if ((*i) == type) return;
 
-    if (instance != this) return;
-    if (fd_netlink != -1) close(fd_netlink);
-    if (nl_buffer != NULL) delete [] nl_buffer;
+    nl_dump_queue.push_back(type);
 }
 
-void *csThreadNetlink::Entry(void)
+void csThreadNetlink::StartDump(void)
 {
-    ssize_t length;
+    if (nl_dump_seq != 0) return;
 
-    struct iovec iov = { nl_buffer, nl_buffer_size };
-    struct msghdr msg = { (void *)&sa_local,
-        sizeof(struct sockaddr_nl), &iov, 1, NULL, 0, 0 };
+    while (nl_dump_queue.size()) {
+        nl_dump_type = nl_dump_queue.front();
+        nl_dump_queue.erase(nl_dump_queue.begin());
 
-    csLog::Log(csLog::Debug, "Netlink thread started.");
+        csEventNetlink::Type watch = cs_netlink_watch_type(nl_dump_type);
+        bool resync = ((nl_resync & (1 << watch)) != 0);
+        if (resync) {
+            nl_resync &= ~(1 << watch);
+            if (!IsWatched(watch)) resync = false;
+        }
+        // Any link dump is also a statistics sample
+        bool sample = (nl_dump_type == RTM_GETLINK && stats_interval > 0);
+        if (cache == NULL && !resync && !sample) continue;
+
+        nl_dump_seq = SendNetlinkRequest(fd_netlink, nl_dump_type);
+        if (nl_dump_seq == 0) continue;
+        if (cache != NULL) cache->BeginDump(nl_dump_type);
+        if (sample) {
+            stats_sample.clear();
+            stats_sample_ms = cs_netlink_clock_ms();
+        }
+        if (!resync) return;
 
-    for ( ;; ) {
-        if ((length = recvmsg(fd_netlink, &msg, MSG_DONTWAIT)) < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                csLog::Log(csLog::Error, "%s: recvmsg: %s",
-                    name.c_str(), strerror(errno));
-                return NULL;
-            }
+        // Watchers are told to forget what they know, a dump follows
+        nl_resync_seq = nl_dump_seq;
 
-            csEvent *event = EventPopWait(_EVENT_TIMEOUT_MS);
-            if (event == NULL) continue;
-
-            switch (event->GetId()) {
-            case csEVENT_QUIT:
-                csLog::Log(csLog::Debug,
-                    "Netlink thread terminated.");
-                EventDestroy(event);
-                return NULL;
-
-            case csEVENT_NETLINK:
-                ProcessEvent(static_cast<csEventNetlink *>(event));
-                break;
-
-            default:
-                csLog::Log(csLog::Debug,
-                    "csThreadNetlink: unhandled event: %u",
-                    event->GetId());
-                EventDestroy(event);
-            }
+        map<csEventNetlink *, nl_hold_t>::iterator i = nl_hold.begin();
+        while (i != nl_hold.end()) {
+            if (i->first->GetType() == watch) nl_hold.erase(i++);
+            else i++;
+        }
 
-            continue;
+        csNetlinkBuffer *buffer = csNetlinkBuffer::Get(nl_buffer_size);
+        struct nlmsghdr *nh = (struct nlmsghdr *)buffer->GetData();
+        memset(nh, 0, sizeof(struct nlmsghdr));
+        nh->nlmsg_len = NLMSG_LENGTH(0);
+        nh->nlmsg_type = NLMSG_OVERRUN;
+        nh->nlmsg_seq = nl_resync_seq;
+
+        SendNetlinkWatch(watch, buffer, nh);
+        buffer->Unref();
+
+        DispatchReplies();
+        return;
+    }
+}
+
+void csThreadNetlink::EndDump(csNetlinkBuffer *buffer, struct nlmsghdr *nh)
+{
+    struct nlmsgerr *error = (struct nlmsgerr *)NLMSG_DATA(nh);
+    if (nh->nlmsg_type == NLMSG_ERROR &&
+        nh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct nlmsgerr)) &&
+        error->error == -EBUSY) {
+        // Someone else's dump was running, try again when it's done
+        nl_dump_queue.insert(nl_dump_queue.begin(), nl_dump_type);
+        if (nh->nlmsg_seq == nl_resync_seq)
+            nl_resync |= (1 << cs_netlink_watch_type(nl_dump_type));
+    }
+    else {
+        if (cache != NULL)
+            cache->EndDump(nl_dump_type, nh->nlmsg_type == NLMSG_DONE);
+        if (nl_dump_type == RTM_GETLINK && stats_interval > 0 &&
+            nh->nlmsg_type == NLMSG_DONE) PublishLinkStats();
+        // Watchers see the end of the dump
+        if (nh->nlmsg_seq == nl_resync_seq) {
+            SendNetlinkWatch(cs_netlink_watch_type(nl_dump_type),
+                buffer, nh);
+        }
+    }
+
+    if (nh->nlmsg_seq == nl_resync_seq) nl_resync_seq = 0;
+    nl_dump_seq = 0;
+}
+
+int csThreadNetlink::SampleLinkStats(void)
+{
+    time_t now = cs_netlink_clock_ms();
+
+    if (stats_next_ms <= now) {
+        QueueDump(RTM_GETLINK);
+        StartDump();
+
+        // A late sample doesn't bring the next one forward
+        stats_next_ms += stats_interval;
+        if (stats_next_ms <= now) stats_next_ms = now + stats_interval;
+    }
+
+    return (int)(stats_next_ms - now);
+}
+
+void csThreadNetlink::UpdateLinkStats(struct nlmsghdr *nh)
+{
+    struct ifinfomsg *ifi = (struct ifinfomsg *)NLMSG_DATA(nh);
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg))) return;
+
+    string ifname;
+    struct rtnl_link_stats64 counters;
+    bool found = false;
+
+    // Newer kernels have grown the structure, older ones may send less
+    memset(&counters, 0, sizeof(counters));
+
+    struct rtattr *rta = IFLA_RTA(ifi);
+    int length = IFLA_PAYLOAD(nh);
+    for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            ifname.assign((const char *)RTA_DATA(rta),
+                strnlen((const char *)RTA_DATA(rta), RTA_PAYLOAD(rta)));
+        }
+        else if (rta->rta_type == IFLA_STATS64) {
+            memcpy(&counters, RTA_DATA(rta),
+                min((size_t)RTA_PAYLOAD(rta), sizeof(counters)));
+            found = true;
         }
+    }
+
+    if (!found) return;
+    if (stats_link.size() && find(stats_link.begin(),
+        stats_link.end(), ifname) == stats_link.end()) return;
+
+    csNetlinkLinkStats &sample = stats_sample[ifi->ifi_index];
+    memset(sample.counter, 0, sizeof(sample.counter));
+    memset(sample.delta, 0, sizeof(sample.delta));
+    memset(sample.rate, 0, sizeof(sample.rate));
+
+    sample.index = ifi->ifi_index;
+    sample.name = ifname;
+    sample.interval = 0;
+    sample.counter[csNetlinkLinkStats::RxPackets] = counters.rx_packets;
+    sample.counter[csNetlinkLinkStats::TxPackets] = counters.tx_packets;
+    sample.counter[csNetlinkLinkStats::RxBytes] = counters.rx_bytes;
+    sample.counter[csNetlinkLinkStats::TxBytes] = counters.tx_bytes;
+    sample.counter[csNetlinkLinkStats::RxErrors] = counters.rx_errors;
+    sample.counter[csNetlinkLinkStats::TxErrors] = counters.tx_errors;
+    sample.counter[csNetlinkLinkStats::RxDropped] = counters.rx_dropped;
+    sample.counter[csNetlinkLinkStats::TxDropped] = counters.tx_dropped;
+    sample.counter[csNetlinkLinkStats::Multicast] = counters.multicast;
+}
 
-        ProcessNetlinkMessage(length);
+void csThreadNetlink::PublishLinkStats(void)
+{
+    time_t interval = stats_sample_ms - stats_last_ms;
+    stats_last_ms = stats_sample_ms;
+
+    pthread_mutex_lock(stats_mutex);
+
+    // Links missing from the sample are gone, or no longer selected
+    map<int, csNetlinkLinkStats>::iterator i, previous;
+    for (i = stats_sample.begin(); i != stats_sample.end(); i++) {
+        previous = stats.find(i->first);
+        if (previous == stats.end() || interval <= 0) continue;
+
+        csNetlinkLinkStats &sample = i->second;
+        sample.interval = interval;
+        for (int j = 0; j < csNetlinkLinkStats::CounterMax; j++) {
+            if (sample.counter[j] < previous->second.counter[j]) continue;
+            sample.delta[j] = sample.counter[j] -
+                previous->second.counter[j];
+            sample.rate[j] = (double)sample.delta[j] * 1000.0 /
+                (double)interval;
+        }
     }
+    stats.swap(stats_sample);
 
-    return NULL;
+    pthread_mutex_unlock(stats_mutex);
+
+    stats_sample.clear();
 }
 
 void csThreadNetlink::ProcessEvent(csEventNetlink *event)
@@ -196,23 +1262,139 @@ void csThreadNetlink::ProcessEvent(csEventNetlink *event)
         name.c_str(), event->GetSource());
 #endif
 
+    csEventClient *src = event->GetTarget();
+    csEventClient *dst = event->GetSource();
+    event->SetSource(src);
+    event->SetTarget(dst);
+
     switch (event->GetType()) {
     case csEventNetlink::NL_Query:
-        SendNetlinkQuery(event);
+        query_pending.push_back(event);
+        StartQueries();
         break;
     case csEventNetlink::NL_RouteWatch:
+    case csEventNetlink::NL_LinkWatch:
+    case csEventNetlink::NL_AddrWatch:
+    case csEventNetlink::NL_NeighWatch:
+        if (fd_netlink == -1 && on_demand) {
+            Open();
+            on_demand = false;
+        }
+        event_watch.push_back(event);
+        UpdateFilter();
+        JoinGroups(event->GetType());
+        break;
+    case csEventNetlink::NL_Unwatch:
+        ProcessUnwatch(event);
         break;
     }
+}
 
-    csEventClient *src = event->GetTarget();
-    csEventClient *dst = event->GetSource();
-    event->SetSource(src);
-    event->SetTarget(dst);
+void csThreadNetlink::ProcessUnwatch(csEventNetlink *event)
+{
+    csEventClient *client = event->GetTarget();
+    nl_unwatch_t *unwatch = (nl_unwatch_t *)event->GetUserData();
+    vector<csEvent *> events;
+
+    if (unwatch == NULL) {
+        delete event;
+        return;
+    }
+
+    vector<csEventNetlink *>::iterator i;
+    for (i = event_watch.begin(); i != event_watch.end(); ) {
+        if ((*i)->GetTarget() != client) {
+            i++;
+            continue;
+        }
+        nl_hold.erase((*i));
+        events.push_back((*i));
+        i = event_watch.erase(i);
+    }
+    for (i = query_pending.begin(); i != query_pending.end(); ) {
+        if ((*i)->GetTarget() != client) {
+            i++;
+            continue;
+        }
+        events.push_back((*i));
+        i = query_pending.erase(i);
+    }
+    for (i = event_reply.begin(); i != event_reply.end(); ) {
+        if ((*i)->GetTarget() == client) i = event_reply.erase(i);
+        else i++;
+    }
+
+    // Queries being answered keep their socket until the end of the dump
+    map<uint32_t, csEventNetlink *>::iterator j;
+    for (j = nl_query.begin(); j != nl_query.end(); j++) {
+        if (j->second == NULL || j->second->GetTarget() != client)
+            continue;
+        events.push_back(j->second);
+        j->second = NULL;
+    }
+
+    UpdateFilter();
+
+    pthread_mutex_lock(unwatch_mutex);
+    unwatch->events->insert(unwatch->events->end(),
+        events.begin(), events.end());
+    unwatch->done = true;
+    pthread_cond_broadcast(unwatch_cond);
+    pthread_mutex_unlock(unwatch_mutex);
+
+    delete event;
+}
+
+int csThreadNetlink::GetRequestSocket(void)
+{
+    for (size_t i = 0; i < nl_socket.size(); i++)
+        if (nl_socket[i].seq == 0) return (int)i;
+
+    if (nl_socket.size() >= _CS_NETLINK_SOCKETS) return -1;
+
+    // The kernel binds a port ID on our first request
+    nl_socket_t request;
+    request.seq = 0;
+    request.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (request.fd == -1) {
+        csLog::Log(csLog::Error, "%s: socket: %s",
+            name.c_str(), strerror(errno));
+        return -1;
+    }
+
+    nl_socket.push_back(request);
+
+    return (int)nl_socket.size() - 1;
+}
+
+void csThreadNetlink::StartQueries(void)
+{
+    while (query_pending.size()) {
+        int index = GetRequestSocket();
+        if (index == -1) return;
+
+        csEventNetlink *event = query_pending.front();
+        query_pending.erase(query_pending.begin());
+
+        if (!SendNetlinkQuery(nl_socket[index].fd, event)) continue;
+
+        nl_socket[index].seq = event->GetSequence();
+        nl_query[event->GetSequence()] = event;
+    }
+}
+
+void csThreadNetlink::EndQuery(uint32_t seq)
+{
+    nl_query.erase(seq);
 
-    event_client.push_back(event);
+    for (size_t i = 0; i < nl_socket.size(); i++) {
+        if (nl_socket[i].seq != seq) continue;
+        nl_socket[i].seq = 0;
+        break;
+    }
 }
 
-void csThreadNetlink::SendNetlinkQuery(csEventNetlink *event)
+bool csThreadNetlink::SendNetlinkQuery(int fd, csEventNetlink *event)
 {
     switch (event->GetQuery()) {
     case RTM_GETLINK:
@@ -228,9 +1410,16 @@ void csThreadNetlink::SendNetlinkQuery(csEventNetlink *event)
         csLog::Log(csLog::Error, "%s: invalid query type: %d",
             name.c_str(), event->GetQuery());
         // TODO: Should probably reply back with an error...
-        return;
+        return false;
     }
 
+    event->SetSequence(SendNetlinkRequest(fd, event->GetQuery()));
+
+    return (event->GetSequence() != 0);
+}
+
+uint32_t csThreadNetlink::SendNetlinkRequest(int fd, uint16_t type)
+{
     struct sockaddr_nl sa_kernel;
     struct msghdr rtnl_msg;
     struct iovec iov;
@@ -243,10 +1432,9 @@ void csThreadNetlink::SendNetlinkQuery(csEventNetlink *event)
     sa_kernel.nl_family = AF_NETLINK;
 
     if (++nl_seq >= time(NULL) - 3600 * 24) nl_seq = 1;
-    event->SetSequence(nl_seq);
 
     request.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
-    request.hdr.nlmsg_type = event->GetQuery();
+    request.hdr.nlmsg_type = type;
     request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP; 
     request.hdr.nlmsg_seq = nl_seq;
     request.hdr.nlmsg_pid = getpid();
@@ -260,69 +1448,395 @@ void csThreadNetlink::SendNetlinkQuery(csEventNetlink *event)
     rtnl_msg.msg_name = &sa_kernel;
     rtnl_msg.msg_namelen = sizeof(sa_kernel);
 
-    if (sendmsg(fd_netlink, (struct msghdr *)&rtnl_msg, 0) < 0) {
+    if (sendmsg(fd, (struct msghdr *)&rtnl_msg, 0) < 0) {
         csLog::Log(csLog::Error, "%s: Unable to send NL message: %s",
             name.c_str(), strerror(errno));
+        return 0;
+    }
+
+    return nl_seq;
+}
+
+void csThreadNetlink::SendNetlinkReply(int fd,
+    csNetlinkBuffer *buffer, struct nlmsghdr *nh)
+{
+    // Dumps, queries and notifications all keep the cache current
+    if (cache != NULL && cache->Update(nh)) QueueDump(RTM_GETROUTE);
+
+    if (nh->nlmsg_type == NLMSG_NOOP) return;
+
+    if (fd == fd_netlink) {
+        // Notifications carry the sequence number of the request that
+        // caused them, so only our own dump can be told apart.
+        bool dump = (nl_dump_seq != 0 && nh->nlmsg_seq == nl_dump_seq &&
+            nh->nlmsg_pid == sa_local.nl_pid);
+
+        if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+            if (dump) EndDump(buffer, nh);
+            return;
+        }
+
+        csEventNetlink::Type watch = cs_netlink_watch_type(nh->nlmsg_type);
+        if (watch == csEventNetlink::NL_Query) return;
+
+        if (dump && nh->nlmsg_type == RTM_NEWLINK && stats_interval > 0)
+            UpdateLinkStats(nh);
+
+        if (!dump) SendNetlinkWatch(watch, buffer, nh, true);
+        else if (nh->nlmsg_seq == nl_resync_seq)
+            SendNetlinkWatch(watch, buffer, nh);
+
+        return;
+    }
+
+    map<uint32_t, csEventNetlink *>::iterator i;
+    i = (nh->nlmsg_seq != 0) ? nl_query.find(nh->nlmsg_seq) : nl_query.end();
+    if (i == nl_query.end()) {
+#ifdef _CS_DEBUG
+        csLog::Log(csLog::Debug, "%s: Un-handled netlink message",
+            name.c_str());
+#endif
+        return;
+    }
+
+    // The query's client is gone, see Unwatch()
+    if (i->second != NULL) QueueReply(i->second, buffer, nh);
+
+    switch (nh->nlmsg_type) {
+    case NLMSG_DONE:
+    case NLMSG_ERROR:
+    case NLMSG_OVERRUN:
+        EndQuery(nh->nlmsg_seq);
+        break;
+
+    default:
+        if (!(nh->nlmsg_flags & NLM_F_MULTI))
+            EndQuery(nh->nlmsg_seq);
     }
 }
 
-void csThreadNetlink::SendNetlinkReply(struct nlmsghdr *nh)
+void csThreadNetlink::SendNetlinkWatch(csEventNetlink::Type type,
+    csNetlinkBuffer *buffer, struct nlmsghdr *nh, bool notification)
 {
     vector<csEventNetlink *>::iterator i;
 
+    // Rather than an overrun, or the end of a dump
+    bool change = (cs_netlink_watch_type(nh->nlmsg_type) == type);
+
+    for (i = event_watch.begin(); i != event_watch.end(); i++) {
+        if ((*i)->GetType() != type) continue;
+        if (change && !(*i)->Match(nh)) continue;
+
+        time_t quiet_period = (*i)->GetQuietPeriod();
+        if (quiet_period < 0) {
+            quiet_period = (type == csEventNetlink::NL_RouteWatch) ?
+                route_quiet_period : 0;
+        }
+        if (change && notification && quiet_period > 0)
+            HoldChange((*i), quiet_period, nh);
+        else
+            QueueReply((*i), buffer, nh);
+    }
+}
+
+// Routes are told apart as the kernel does: by table, destination, TOS
+// and priority (metric); addresses by interface, prefix and (local)
+// address; neighbours by interface and address.
+static bool cs_netlink_change_key(struct nlmsghdr *nh, string &key)
+{
+    bool route = false;
+    uint16_t rta_key = 0;
+    uint32_t rt_table = 0, rt_priority = 0;
+    struct rtattr *rta = NULL;
+    int length = 0;
+
+    key.clear();
+
     switch (nh->nlmsg_type) {
     case RTM_NEWROUTE:
-    case RTM_DELROUTE:
-        for (i = event_client.begin();
-            i != event_client.end(); i++) {
-            if ((*i)->GetType() != csEventNetlink::NL_RouteWatch)
-                continue;
+    case RTM_DELROUTE: {
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) return false;
+        struct rtmsg *rtm = (struct rtmsg *)NLMSG_DATA(nh);
+        key += (char)rtm->rtm_family;
+        key += (char)rtm->rtm_dst_len;
+        key += (char)rtm->rtm_tos;
+        rt_table = rtm->rtm_table;
+        rta = RTM_RTA(rtm);
+        length = RTM_PAYLOAD(nh);
+        rta_key = RTA_DST;
+        route = true;
+        break;
+    }
+    case RTM_NEWLINK:
+    case RTM_DELLINK: {
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+            return false;
+        struct ifinfomsg *ifi = (struct ifinfomsg *)NLMSG_DATA(nh);
+        key.append((const char *)&ifi->ifi_index, sizeof(ifi->ifi_index));
+        return true;
+    }
+    case RTM_NEWADDR:
+    case RTM_DELADDR: {
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg)))
+            return false;
+        struct ifaddrmsg *ifa = (struct ifaddrmsg *)NLMSG_DATA(nh);
+        key += (char)ifa->ifa_family;
+        key += (char)ifa->ifa_prefixlen;
+        key.append((const char *)&ifa->ifa_index, sizeof(ifa->ifa_index));
+        rta = IFA_RTA(ifa);
+        length = IFA_PAYLOAD(nh);
+        rta_key = IFA_ADDRESS;
+        break;
+    }
+    case RTM_NEWNEIGH:
+    case RTM_DELNEIGH: {
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ndmsg)))
+            return false;
+        struct ndmsg *ndm = (struct ndmsg *)NLMSG_DATA(nh);
+        key += (char)ndm->ndm_family;
+        key.append((const char *)&ndm->ndm_ifindex,
+            sizeof(ndm->ndm_ifindex));
+        rta = (struct rtattr *)((uint8_t *)ndm +
+            NLMSG_ALIGN(sizeof(struct ndmsg)));
+        length = nh->nlmsg_len - NLMSG_LENGTH(sizeof(struct ndmsg));
+        rta_key = NDA_DST;
+        break;
+    }
+    default:
+        return false;
+    }
 
-            (*i)->AddReply(nh);
-            EventDispatch((*i), (*i)->GetTarget());
+    string address;
+    for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        bool local = (nh->nlmsg_type == RTM_NEWADDR ||
+            nh->nlmsg_type == RTM_DELADDR) && rta->rta_type == IFA_LOCAL;
+        if (rta->rta_type == rta_key || local) {
+            // A point-to-point address is told apart by its local end
+            if (local || address.empty()) {
+                address.assign(
+                    (const char *)RTA_DATA(rta), RTA_PAYLOAD(rta));
+            }
         }
-        return;
+        else if (!route || RTA_PAYLOAD(rta) < sizeof(uint32_t))
+            continue;
+        else if (rta->rta_type == RTA_TABLE)
+            rt_table = *(uint32_t *)RTA_DATA(rta);
+        else if (rta->rta_type == RTA_PRIORITY)
+            rt_priority = *(uint32_t *)RTA_DATA(rta);
+    }
+
+    if (route) {
+        key.append((const char *)&rt_table, sizeof(rt_table));
+        key.append((const char *)&rt_priority, sizeof(rt_priority));
+    }
+    key.append(address);
+
+    return true;
+}
+
+// Whether an attribute is compared when telling if something was put
+// back as it was: a route's identity and next hops, everything else's
+// settings, but not the counters and timers that change on their own.
+static bool cs_netlink_change_attr(uint16_t type, uint16_t rta_type)
+{
+    switch (type) {
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+        switch (rta_type) {
+        case RTA_DST:
+        case RTA_SRC:
+        case RTA_GATEWAY:
+        case RTA_OIF:
+        case RTA_PREFSRC:
+        case RTA_PRIORITY:
+        case RTA_TABLE:
+        case RTA_MULTIPATH:
+            return true;
+        }
+        return false;
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        // Per-family statistics are in IFLA_AF_SPEC
+        return (rta_type != IFLA_STATS && rta_type != IFLA_STATS64 &&
+            rta_type != IFLA_AF_SPEC);
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        return (rta_type != IFA_CACHEINFO);
+    case RTM_NEWNEIGH:
+    case RTM_DELNEIGH:
+        return (rta_type != NDA_CACHEINFO && rta_type != NDA_PROBES);
+    }
+    return false;
+}
 
-    case NLMSG_NOOP:
+// The family header and compared attributes, in the kernel's order
+static void cs_netlink_change_value(struct nlmsghdr *nh, string &value)
+{
+    size_t header;
+
+    value.clear();
+
+    switch (nh->nlmsg_type) {
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+        header = sizeof(struct rtmsg);
+        break;
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        header = sizeof(struct ifinfomsg);
+        break;
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        header = sizeof(struct ifaddrmsg);
+        break;
+    case RTM_NEWNEIGH:
+    case RTM_DELNEIGH:
+        header = sizeof(struct ndmsg);
+        break;
+    default:
         return;
     }
 
-    for (i = event_client.begin();
-        i != event_client.end(); i++) {
-        if ((*i)->GetType() != csEventNetlink::NL_Query)
+    if (nh->nlmsg_len < NLMSG_LENGTH(header)) return;
+    value.assign((const char *)NLMSG_DATA(nh), header);
+
+    struct rtattr *rta = (struct rtattr *)((uint8_t *)NLMSG_DATA(nh) +
+        NLMSG_ALIGN(header));
+    int length = (int)nh->nlmsg_len - NLMSG_HDRLEN - NLMSG_ALIGN(header);
+    for ( ; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        if (!cs_netlink_change_attr(nh->nlmsg_type, rta->rta_type))
             continue;
-        if ((*i)->GetSequence() != nh->nlmsg_seq)
+        value.append((const char *)rta, RTA_LENGTH(RTA_PAYLOAD(rta)));
+    }
+}
+
+void csThreadNetlink::HoldChange(csEventNetlink *event,
+    time_t quiet_period, struct nlmsghdr *nh)
+{
+    string key;
+    if (!cs_netlink_change_key(nh, key)) return;
+
+    time_t now = cs_netlink_clock_ms();
+
+    map<csEventNetlink *, nl_hold_t>::iterator i = nl_hold.find(event);
+    if (i == nl_hold.end()) {
+        i = nl_hold.insert(make_pair(event, nl_hold_t())).first;
+        i->second.quiet_period = quiet_period;
+        i->second.first_ms = now;
+    }
+    i->second.last_ms = now;
+
+    map<string, nl_change_t>::iterator j = i->second.change.find(key);
+    if (j == i->second.change.end()) {
+        j = i->second.change.insert(make_pair(key, nl_change_t())).first;
+        // Only routes are announced as new (without NLM_F_REPLACE), a
+        // link, address or neighbour may have been there all along
+        bool remove = cs_netlink_is_delete(nh->nlmsg_type);
+        j->second.existed = (remove || nh->nlmsg_type != RTM_NEWROUTE ||
+            (nh->nlmsg_flags & NLM_F_REPLACE));
+        if (remove) {
+            j->second.before.assign(
+                (uint8_t *)nh, (uint8_t *)nh + nh->nlmsg_len);
+        }
+    }
+    j->second.after.assign((uint8_t *)nh, (uint8_t *)nh + nh->nlmsg_len);
+}
+
+int csThreadNetlink::ReleaseChanges(void)
+{
+    if (nl_hold.empty()) return -1;
+
+    time_t now = cs_netlink_clock_ms(), wait_ms = -1;
+
+    map<csEventNetlink *, nl_hold_t>::iterator i = nl_hold.begin();
+    while (i != nl_hold.end()) {
+        nl_hold_t &hold = i->second;
+        time_t due = hold.last_ms + hold.quiet_period;
+        time_t due_max = hold.first_ms +
+            hold.quiet_period * _CS_NETLINK_QUIET_MAX;
+        if (due_max < due) due = due_max;
+
+        if (due > now) {
+            if (wait_ms == -1 || due - now < wait_ms) wait_ms = due - now;
+            i++;
             continue;
+        }
 
-        (*i)->AddReply(nh);
-        EventDispatch((*i), (*i)->GetTarget());
+        SendChanges(i->first, hold);
+        nl_hold.erase(i++);
+    }
 
-        switch (nh->nlmsg_type) {
-        case NLMSG_DONE:
-        case NLMSG_ERROR:
-        case NLMSG_OVERRUN:
-            event_client.erase(i);
-            break;
+    DispatchReplies();
+
+    return (int)wait_ms;
+}
+
+void csThreadNetlink::SendChanges(csEventNetlink *event, nl_hold_t &hold)
+{
+    csNetlinkBuffer *buffer = NULL;
+    size_t offset = 0;
+
+    map<string, nl_change_t>::iterator i;
+    for (i = hold.change.begin(); i != hold.change.end(); i++) {
+        nl_change_t &change = i->second;
+        struct nlmsghdr *nh = (struct nlmsghdr *)&change.after[0];
 
-        default:
-            if (!(nh->nlmsg_flags & NLM_F_MULTI))
-                event_client.erase(i);
+        if (cs_netlink_is_delete(nh->nlmsg_type)) {
+            // Added and deleted again
+            if (!change.existed) continue;
+        }
+        else if (change.before.size()) {
+            string before, after;
+            cs_netlink_change_value(
+                (struct nlmsghdr *)&change.before[0], before);
+            cs_netlink_change_value(nh, after);
+            // Deleted and put back as it was
+            if (before.size() && before == after) continue;
         }
 
-        return;
+        // Received messages always fit, the buffers only grow
+        size_t length = NLMSG_ALIGN(change.after.size());
+        if (buffer == NULL || offset + length > buffer->GetSize()) {
+            if (buffer != NULL) buffer->Unref();
+            buffer = csNetlinkBuffer::Get(nl_buffer_size);
+            offset = 0;
+        }
+
+        memcpy(buffer->GetData() + offset,
+            &change.after[0], change.after.size());
+        QueueReply(event, buffer,
+            (struct nlmsghdr *)(buffer->GetData() + offset));
+        offset += length;
     }
 
-#ifdef _CS_DEBUG
-    csLog::Log(csLog::Debug, "%s: Un-handled netlink message",
-        name.c_str());
-#endif
+    if (buffer != NULL) buffer->Unref();
+}
+
+void csThreadNetlink::QueueReply(csEventNetlink *event,
+    csNetlinkBuffer *buffer, struct nlmsghdr *nh)
+{
+    event->AddReply(buffer, nh);
+
+    vector<csEventNetlink *>::iterator i;
+    for (i = event_reply.begin(); i != event_reply.end(); i++)
+        if ((*i) == event) return;
+    event_reply.push_back(event);
+}
+
+void csThreadNetlink::DispatchReplies(void)
+{
+    vector<csEventNetlink *>::iterator i;
+    for (i = event_reply.begin(); i != event_reply.end(); i++)
+        EventDispatch((*i), (*i)->GetTarget());
+    event_reply.clear();
 }
 
-void csThreadNetlink::ProcessNetlinkMessage(ssize_t length)
+void csThreadNetlink::ProcessNetlinkMessage(int fd,
+    csNetlinkBuffer *buffer, ssize_t length)
 {
     struct nlmsghdr *nh;
 
-    for (nh = (struct nlmsghdr *)nl_buffer;
+    for (nh = (struct nlmsghdr *)buffer->GetData();
         NLMSG_OK(nh, length); nh = NLMSG_NEXT(nh, length)) {
 #ifdef _CS_DEBUG
         csLog::Log(csLog::Debug,
@@ -348,7 +1862,7 @@ void csThreadNetlink::ProcessNetlinkMessage(ssize_t length)
             break;
         }
 
-        SendNetlinkReply(nh);
+        SendNetlinkReply(fd, buffer, nh);
     }
 }
 
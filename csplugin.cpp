@@ -22,280 +22,780 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <sstream>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <regex.h>
+#include <sched.h>
 #include <dlfcn.h>
+#include <link.h>
 
 #include <clearsync/csexception.h>
 #include <clearsync/cslog.h>
 #include <clearsync/csevent.h>
 #include <clearsync/csthread.h>
+#include <clearsync/csutil.h>
+#include <clearsync/csstate.h>
+#include <clearsync/csvalue.h>
 #include <clearsync/csplugin.h>
 
 csPlugin::csPlugin(const string &name,
     csEventClient *parent, size_t stack_size)
-    : csThread(stack_size), name(name), parent(parent), fh_state(NULL)
+    : csThread(stack_size), name(name), parent(parent),
+    stack_size_auto(false), stopped(false), state_log(NULL), state_log_size(0),
+    state_checkpoint(NULL), state_lazy(false)
 {
+    SetThreadName(name);
     csLog::Log(csLog::Debug, "Plugin initialized: %s, stack size: %ld",
         name.c_str(), stack_size);
 }
 
 csPlugin::~csPlugin()
 {
-    SaveState();
-    if (fh_state != NULL) fclose(fh_state);
-    map<string, struct csPluginStateValue *>::iterator i;
-    for (i = state.begin(); i != state.end(); i++) {
-        if (i->second->value) delete [] i->second->value;
-        delete i->second;
-    }
+    Stop();
     csLog::Log(csLog::Debug, "Plugin destroyed: %s", name.c_str());
 }
 
+void csPlugin::Stop(void)
+{
+    if (stopped) return;
+
+    Join();
+
+    if (stack_size_auto) {
+        string filename = string(_CS_TEMP_DIR) + "/" + name + ".stack";
+        FILE *fh = fopen(filename.c_str(), "w");
+        if (fh == NULL) {
+            csLog::Log(csLog::Warning, "%s: Error saving stack size: %s: %s",
+                name.c_str(), filename.c_str(), strerror(errno));
+        }
+        else {
+            fprintf(fh, "%lu\n", GetStackRecommended());
+            fclose(fh);
+        }
+    }
+
+    if (state_log == NULL && state_checkpoint == NULL) SaveState();
+    else {
+        // Wait for everything logged or checkpointed so far to reach the
+        // disk, then write the state file directly; the log is only
+        // discarded once the state file is known to be good.
+        csThreadState *state_thread = csThreadState::GetInstance();
+        if (state_thread != NULL) {
+            if (state_checkpoint != NULL)
+                state_thread->RemoveCheckpoint(state_checkpoint);
+            state_thread->Flush(state_log);
+        }
+        else if (state_log != NULL) state_log->Sync();
+
+        if (csStateSave(state_file, state) && state_log != NULL)
+            state_log->Remove();
+        if (state_log != NULL) delete state_log;
+        if (state_checkpoint != NULL) delete state_checkpoint;
+        state_log = NULL;
+        state_checkpoint = NULL;
+    }
+
+    stopped = true;
+}
+
 void csPlugin::SetStateFile(const string &state_file)
 {
-    if (fh_state != NULL) fclose(fh_state);
-    char mode[3] = { "r+" };
-    struct stat state_stat;
-    if (stat(state_file.c_str(), &state_stat) < 0)
-        mode[0] = 'w';
-    if ((fh_state = fopen(state_file.c_str(), mode)) == NULL) {
-        csLog::Log(csLog::Warning, "Error opening state: %s: %s",
-            state_file.c_str(), strerror(errno));
+    this->state_file = state_file;
+    LoadState();
+}
+
+void csPlugin::SetStateLazy(bool lazy)
+{
+    state_lazy = lazy;
+}
+
+void csPlugin::SetStateLog(time_t sync_interval, size_t sync_records)
+{
+    if (state_file.empty() || state_log != NULL) return;
+    if (csThreadState::GetInstance() == NULL) {
+        csLog::Log(csLog::Warning, "%s: State log unavailable.", name.c_str());
+        return;
     }
-    else LoadState();
+
+    state_log = new csStateLog(state_file + _CS_STATE_LOG_SUFFIX,
+        sync_interval, sync_records);
+    csLog::Log(csLog::Debug,
+        "%s: State log: %s, sync interval: %ldms, sync records: %lu",
+        name.c_str(), state_log->GetFilename().c_str(),
+        sync_interval, sync_records);
+}
+
+void csPlugin::SetStateCheckpoint(time_t interval)
+{
+    if (state_file.empty() || state_checkpoint != NULL) return;
+
+    csThreadState *state_thread = csThreadState::GetInstance();
+    if (state_thread == NULL) {
+        csLog::Log(csLog::Warning,
+            "%s: State checkpoints unavailable.", name.c_str());
+        return;
+    }
+
+    state_checkpoint = new csStateCheckpoint(state_file,
+        &state, state_log, interval);
+    state_thread->AddCheckpoint(state_checkpoint);
+    csLog::Log(csLog::Debug, "%s: State checkpoint interval: %lds",
+        name.c_str(), interval);
+}
+
+void csPlugin::SetStackSizeAuto(void)
+{
+    // Re-use the stack size recommended by the previous run, which was
+    // measured from the thread's actual stack high-water mark.
+    stack_size_auto = true;
+
+    string filename = string(_CS_TEMP_DIR) + "/" + name + ".stack";
+    FILE *fh = fopen(filename.c_str(), "r");
+    if (fh == NULL) return;
+
+    unsigned long stack_size;
+    if (fscanf(fh, "%lu", &stack_size) == 1 && stack_size > 0) {
+        SetStackSize((size_t)stack_size);
+        csLog::Log(csLog::Debug, "%s: Auto stack size: %lu",
+            name.c_str(), GetStackSize());
+    }
+    fclose(fh);
+}
+
+void csPlugin::GetAttributes(csPluginAttributes &attr)
+{
+    attr.stack_size = stack_size;
+    attr.stack_size_auto = stack_size_auto;
+    attr.cpu_affinity_enable = (cpu_affinity != NULL);
+    if (cpu_affinity != NULL)
+        memcpy(&attr.cpu_affinity, cpu_affinity, sizeof(cpu_set_t));
+    else
+        CPU_ZERO(&attr.cpu_affinity);
+    attr.sched_nice_enable = sched_nice_enable;
+    attr.sched_nice = sched_nice;
+    attr.sched_policy = sched_policy;
+    attr.sched_priority = sched_priority;
+
+    attr.state_file = state_file;
+    attr.state_lazy = state_lazy;
+    attr.state_log = (state_log != NULL);
+    attr.state_log_sync_interval = (state_log != NULL) ?
+        state_log->GetSyncInterval() : _CS_STATE_LOG_SYNC_INTERVAL;
+    attr.state_log_sync_records = (state_log != NULL) ?
+        state_log->GetSyncRecords() : _CS_STATE_LOG_SYNC_RECORDS;
+    attr.state_checkpoint_interval = (state_checkpoint != NULL) ?
+        state_checkpoint->GetInterval() : 0;
+}
+
+void csPlugin::SetAttributes(const csPluginAttributes &attr)
+{
+    SetStackSize(attr.stack_size);
+    // Picks up the recommendation saved when the previous instance stopped
+    if (attr.stack_size_auto) SetStackSizeAuto();
+    if (attr.cpu_affinity_enable) SetCpuAffinity(attr.cpu_affinity);
+    if (attr.sched_nice_enable) SetNice(attr.sched_nice);
+    if (attr.sched_policy != -1)
+        SetSchedulingPolicy(attr.sched_policy, attr.sched_priority);
+
+    state_file = attr.state_file;
+    state_lazy = attr.state_lazy;
+    if (attr.state_log) {
+        SetStateLog(attr.state_log_sync_interval,
+            attr.state_log_sync_records);
+    }
+    if (attr.state_checkpoint_interval > 0)
+        SetStateCheckpoint(attr.state_checkpoint_interval);
 }
 
 void csPlugin::LoadState(void)
 {
-    if (fh_state == NULL) return;
-    rewind(fh_state);
+    bool legacy, replayed;
+    if (!LoadStateFile(legacy, replayed)) {
+        // Keep the damaged file for inspection rather than have the next
+        // SaveState() replace it.
+        string corrupt = state_file + ".corrupt";
+        csLog::Log(csLog::Error, "%s: Corrupt state file: %s, moved to: %s",
+            name.c_str(), state_file.c_str(), corrupt.c_str());
+        if (rename(state_file.c_str(), corrupt.c_str()) < 0) {
+            csLog::Log(csLog::Warning, "%s: Error renaming state: %s: %s",
+                name.c_str(), state_file.c_str(), strerror(errno));
+        }
+    }
+    else if (legacy || replayed) {
+        if (legacy) {
+            csLog::Log(csLog::Info, "%s: Migrating legacy state file: %s",
+                name.c_str(), state_file.c_str());
+        }
+        // Fold the replayed log into a fresh state file
+        string log_file = state_file + _CS_STATE_LOG_SUFFIX;
+        if (csStateSave(state_file, state) && replayed &&
+            unlink(log_file.c_str()) < 0) {
+            csLog::Log(csLog::Warning, "%s: Error removing state log: %s: %s",
+                name.c_str(), log_file.c_str(), strerror(errno));
+        }
+    }
+}
+
+bool csPlugin::LoadStateFile(bool &legacy, bool &replayed)
+{
+    legacy = replayed = false;
+    if (state_file.empty()) return true;
+
+    if (!LoadStateFile(state_file, legacy)) return false;
+
+    size_t records = 0;
+    replayed = LoadStateLog(state_file + _CS_STATE_LOG_SUFFIX, records);
+
+    return true;
+}
+
+bool csPlugin::LoadStateFile(const string &state_file, bool &legacy)
+{
+    int fd = open(state_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            csLog::Log(csLog::Warning, "%s: Error opening state: %s: %s",
+                name.c_str(), state_file.c_str(), strerror(errno));
+        }
+        return true;
+    }
+
+    struct stat state_stat;
+    if (fstat(fd, &state_stat) < 0) {
+        csLog::Log(csLog::Warning, "%s: Error opening state: %s: %s",
+            name.c_str(), state_file.c_str(), strerror(errno));
+        close(fd);
+        return true;
+    }
+
+    state.Clear();
+    if (state_stat.st_size == 0) {
+        close(fd);
+        return true;
+    }
 
-    map<string, struct csPluginStateValue *>::iterator i;
-    for (i = state.begin(); i != state.end(); i++) {
-        if (i->second->value != NULL) delete i->second->value;
-        delete i->second;
+    size_t length = (size_t)state_stat.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        csLog::Log(csLog::Warning, "%s: Error mapping state: %s: %s",
+            name.c_str(), state_file.c_str(), strerror(errno));
+        return true;
     }
-    state.clear();
 
-    size_t records;
-    if (fread((void *)&records, sizeof(size_t), 1, fh_state) != 1) {
-        if (!feof(fh_state))
-            csLog::Log(csLog::Error, "%s: Error reading state 0", name.c_str());
+    const uint8_t *p = (const uint8_t *)data;
+    legacy = (length < 4 || csGetLE32(p) != _CS_STATE_MAGIC);
+    bool lazy = (state_lazy && !legacy);
+    bool success = (legacy) ?
+        ParseStateLegacy(p, length) : ParseState(p, length, lazy);
+
+    if (lazy && success) {
+        // The table now points into the mapping and keeps it
+        state.Map(data, length);
+        return true;
+    }
+
+    if (lazy) state.Clear();
+    munmap(data, length);
+    return success;
+}
+
+void csPlugin::SaveState(void)
+{
+    if (state_file.empty()) return;
+
+    csThreadState *state_thread = csThreadState::GetInstance();
+    if ((state_log == NULL && state_checkpoint == NULL) ||
+        state_thread == NULL) {
+        csStateSave(state_file, state);
         return;
     }
 
-    csLog::Log(csLog::Debug, "%s: State records: %lu", name.c_str(), records);
+    // Hand a copy to the state thread, which writes it and empties the
+    // log without holding up this plugin.
+    if (state_checkpoint != NULL) state_checkpoint->Lock();
+
+    csStateTable *snapshot = new csStateTable(state);
+
+    state_log_size = 0;
+    state_thread->Checkpoint(state_log, state_file, snapshot);
+
+    if (state_checkpoint != NULL) state_checkpoint->Unlock();
+}
+
+bool csPlugin::LoadStateLog(const string &log_file, size_t &records)
+{
+    records = 0;
+
+    int fd = open(log_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            csLog::Log(csLog::Warning, "%s: Error opening state log: %s: %s",
+                name.c_str(), log_file.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    struct stat log_stat;
+    if (fstat(fd, &log_stat) < 0 || log_stat.st_size == 0) {
+        close(fd);
+        return false;
+    }
 
-    if (records == 0) return;
+    size_t length = (size_t)log_stat.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        csLog::Log(csLog::Warning, "%s: Error mapping state log: %s: %s",
+            name.c_str(), log_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t unused;
+    if (length < _CS_STATE_HEADER_SIZE ||
+        !csStateCheckHeader(p, _CS_STATE_LOG_MAGIC, unused)) {
+        csLog::Log(csLog::Warning, "%s: Invalid state log header: %s",
+            name.c_str(), log_file.c_str());
+        munmap(data, length);
+        return false;
+    }
+
+    // Replay records in order; a crash can leave a torn record at the
+    // end, which (with anything after it) is discarded.
+    size_t offset = _CS_STATE_HEADER_SIZE;
+    while (length - offset >= _CS_STATE_RECORD_SIZE) {
+        size_t remaining = length - offset;
+        size_t key_length = csGetLE32(p + offset);
+        size_t value_length = csGetLE32(p + offset + 4);
+        if (key_length > remaining || value_length > remaining ||
+            _CS_STATE_RECORD_SIZE + key_length + value_length > remaining)
+            break;
+
+        size_t record_length =
+            _CS_STATE_RECORD_SIZE + key_length + value_length;
+        if (!ParseStateRecord(p + offset, record_length)) break;
+        offset += record_length;
+        records++;
+    }
+
+    if (offset != length) {
+        csLog::Log(csLog::Warning,
+            "%s: Discarded %lu bytes of incomplete state log: %s",
+            name.c_str(), length - offset, log_file.c_str());
+    }
+    csLog::Log(csLog::Debug, "%s: State log records replayed: %lu",
+        name.c_str(), records);
+
+    munmap(data, length);
+    return true;
+}
+
+bool csPlugin::ParseStateRecord(const uint8_t *record, size_t length)
+{
+    size_t key_length = csGetLE32(record);
+    size_t value_length = csGetLE32(record + 4);
+
+    if (key_length == 0 ||
+        length != _CS_STATE_RECORD_SIZE + key_length + value_length ||
+        csGetLE32(record + length - 4) != csCRC32(record, length - 4)) {
+        csLog::Log(csLog::Error, "%s: Corrupt state record", name.c_str());
+        return false;
+    }
+
+    state.Set((const char *)record + 8, key_length,
+        record + 8 + key_length, value_length);
+    return true;
+}
+
+bool csPlugin::ParseState(const uint8_t *data, size_t length, bool lazy)
+{
+    state.Clear();
+
+    uint32_t records;
+    if (length < _CS_STATE_HEADER_SIZE ||
+        !csStateCheckHeader(data, _CS_STATE_MAGIC, records)) {
+        csLog::Log(csLog::Error, "%s: Invalid state header", name.c_str());
+        return false;
+    }
+
+    csLog::Log(csLog::Debug, "%s: State records: %u", name.c_str(), records);
+
+    size_t offset = _CS_STATE_HEADER_SIZE;
+    for (uint32_t v = 0; v < records; v++) {
+        size_t remaining = length - offset;
+        if (remaining < _CS_STATE_RECORD_SIZE) {
+            csLog::Log(csLog::Error, "%s: Truncated state file", name.c_str());
+            return false;
+        }
+
+        size_t key_length = csGetLE32(data + offset);
+        size_t value_length = csGetLE32(data + offset + 4);
+        if (key_length > remaining || value_length > remaining ||
+            _CS_STATE_RECORD_SIZE + key_length + value_length > remaining) {
+            csLog::Log(csLog::Error, "%s: Truncated state file", name.c_str());
+            return false;
+        }
+
+        size_t record_length =
+            _CS_STATE_RECORD_SIZE + key_length + value_length;
+        if (lazy) {
+            // Index only; the record is checked on first access
+            state.SetMapped((const char *)data + offset + 8, key_length,
+                data + offset + 8 + key_length, value_length);
+        }
+        else if (!ParseStateRecord(data + offset, record_length))
+            return false;
+        offset += record_length;
+    }
+
+    return true;
+}
+
+bool csPlugin::ParseStateLegacy(const uint8_t *data, size_t length)
+{
+    // Version 1.0 format: native size_t record count, then for each
+    // record a native size_t length and bytes for the key and value.
+    state.Clear();
+
+    size_t records, offset = 0;
+    if (length < sizeof(size_t)) {
+        csLog::Log(csLog::Error, "%s: Error reading state 0", name.c_str());
+        return false;
+    }
+    memcpy(&records, data, sizeof(size_t));
+    offset += sizeof(size_t);
+
+    csLog::Log(csLog::Debug, "%s: Legacy state records: %lu",
+        name.c_str(), records);
 
     for (size_t v = 0; v < records; v++) {
-        size_t length;
-        if (fread((void *)&length, sizeof(size_t), 1, fh_state) != 1) {
+        size_t key_length, value_length;
+
+        if (length - offset < sizeof(size_t)) {
             csLog::Log(csLog::Error, "%s: Error reading state 1", name.c_str());
-            return;
+            return false;
         }
+        memcpy(&key_length, data + offset, sizeof(size_t));
+        offset += sizeof(size_t);
 
-        if (length == 0) {
+        if (key_length == 0) {
             csLog::Log(csLog::Error, "%s: Corrupt state file 2", name.c_str());
-            return;
+            return false;
         }
-
-        char *buffer = new char[length];
-        if (fread((void *)buffer,
-            sizeof(char), length, fh_state) != length) {
+        if (length - offset < key_length) {
             csLog::Log(csLog::Error, "%s: Error reading state 3", name.c_str());
-            delete [] buffer;
-            return;
+            return false;
         }
 
-        string key;
-        key.assign(buffer, length);
-        delete [] buffer;
+        const char *key = (const char *)data + offset;
+        offset += key_length;
 
-        struct csPluginStateValue *var = new csPluginStateValue;
-        if (fread((void *)&var->length, sizeof(size_t), 1, fh_state) != 1) {
+        if (length - offset < sizeof(size_t)) {
             csLog::Log(csLog::Error, "%s: Error reading state 4", name.c_str());
-            delete var;
-            return;
+            return false;
         }
+        memcpy(&value_length, data + offset, sizeof(size_t));
+        offset += sizeof(size_t);
 
-        if (var->length == 0)
-            var->value = NULL;
-        else {
-            var->value = new uint8_t[var->length];
-            if (fread((void *)var->value,
-                sizeof(uint8_t), var->length, fh_state) != var->length) {
-                csLog::Log(csLog::Error, "%s: Error reading state 5", name.c_str());
-                delete [] var->value;
-                delete var;
-                return;
-            }
+        if (length - offset < value_length) {
+            csLog::Log(csLog::Error, "%s: Error reading state 5", name.c_str());
+            return false;
         }
 
-        state[key] = var;
+        state.Set(key, key_length, data + offset, value_length);
+        offset += value_length;
     }
+
+    return true;
 }
 
-void csPlugin::SaveState(void)
+bool csPlugin::ReadState(FILE *fh)
 {
-    if (fh_state == NULL) return;
-    rewind(fh_state);
-
-    size_t length = state.size();
-    if (fwrite((const void *)&length, sizeof(size_t), 1, fh_state) != 1) {
-        csLog::Log(csLog::Error, "%s: Error writing state", name.c_str());
-        return;
+    state.Clear();
+
+    uint8_t header[_CS_STATE_HEADER_SIZE];
+    uint32_t records;
+    if (fread((void *)header, 1, sizeof(header), fh) != sizeof(header) ||
+        !csStateCheckHeader(header, _CS_STATE_MAGIC, records)) {
+        csLog::Log(csLog::Error, "%s: Invalid state header", name.c_str());
+        return false;
     }
 
-    map<string, struct csPluginStateValue *>::iterator i;
-    for (i = state.begin(); i != state.end(); i++) {
-        length = i->first.size();
-        if (!length) continue;
-        if (fwrite((const void *)&length, sizeof(size_t), 1, fh_state) != 1) {
-            csLog::Log(csLog::Error, "%s: Error writing state", name.c_str());
-            return;
-        }
-        if (fwrite((const void *)i->first.c_str(),
-            sizeof(char), length, fh_state) != length) {
-            csLog::Log(csLog::Error, "%s: Error writing state", name.c_str());
-            return;
+    for (uint32_t v = 0; v < records; v++) {
+        uint8_t lengths[8];
+        if (fread((void *)lengths, 1, sizeof(lengths), fh) != sizeof(lengths)) {
+            csLog::Log(csLog::Error, "%s: Error reading state", name.c_str());
+            return false;
         }
 
-        length = i->second->length;
-        if (fwrite((const void *)&length, sizeof(size_t), 1, fh_state) != 1) {
-            csLog::Log(csLog::Error, "%s: Error writing state", name.c_str());
-            return;
-        }
-        if (fwrite((const void *)i->second->value,
-            sizeof(uint8_t), length, fh_state) != length) {
-            csLog::Log(csLog::Error, "%s: Error writing state", name.c_str());
-            return;
+        size_t length = _CS_STATE_RECORD_SIZE +
+            (size_t)csGetLE32(lengths) + (size_t)csGetLE32(lengths + 4);
+        uint8_t *record = new uint8_t[length];
+        memcpy(record, lengths, sizeof(lengths));
+        if (fread((void *)(record + sizeof(lengths)), 1,
+            length - sizeof(lengths), fh) != length - sizeof(lengths)) {
+            csLog::Log(csLog::Error, "%s: Error reading state", name.c_str());
+            delete [] record;
+            return false;
         }
+
+        bool success = ParseStateRecord(record, length);
+        delete [] record;
+        if (!success) return false;
     }
+
+    return true;
 }
 
-bool csPlugin::GetStateVar(const string &key, unsigned long &value)
+bool csPlugin::WriteState(FILE *fh)
 {
-    map<string, struct csPluginStateValue *>::iterator i;
-    i = state.find(key);
-    if (i == state.end()) return false;
-    if (i->second->length != sizeof(unsigned long)) return false;
-    value = *(reinterpret_cast<unsigned long *>(i->second->value));
+    if (!csStateWrite(fh, state)) {
+        csLog::Log(csLog::Error, "%s: Error writing state", name.c_str());
+        return false;
+    }
     return true;
 }
 
-bool csPlugin::GetStateVar(const string &key, float &value)
+static bool cs_state_get(csPlugin *plugin,
+    const char *key, size_t key_length, unsigned long &value)
 {
-    map<string, struct csPluginStateValue *>::iterator i;
-    i = state.find(key);
-    if (i == state.end()) return false;
-    if (i->second->length != sizeof(float)) return false;
-    value = *(reinterpret_cast<float *>(i->second->value));
+    const uint8_t *data;
+    size_t length;
+    if (!plugin->GetStateVar(key, key_length, data, length)) return false;
+    if (length != sizeof(unsigned long)) return false;
+    memcpy(&value, data, sizeof(unsigned long));
     return true;
 }
 
-bool csPlugin::GetStateVar(const string &key, string &value)
+static bool cs_state_get(csPlugin *plugin,
+    const char *key, size_t key_length, float &value)
 {
-    map<string, struct csPluginStateValue *>::iterator i;
-    i = state.find(key);
-    if (i == state.end()) return false;
-    if (i->second->length == 0) value = "";
-    else {
-        value.assign(
-            reinterpret_cast<char *>(i->second->value), i->second->length);
-    }
+    const uint8_t *data;
+    size_t length;
+    if (!plugin->GetStateVar(key, key_length, data, length)) return false;
+    if (length != sizeof(float)) return false;
+    memcpy(&value, data, sizeof(float));
     return true;
 }
 
-bool csPlugin::GetStateVar(const string &key, size_t &length, uint8_t *value)
+static bool cs_state_get(csPlugin *plugin,
+    const char *key, size_t key_length, string &value)
 {
-    map<string, struct csPluginStateValue *>::iterator i;
-    i = state.find(key);
-    if (i == state.end()) return false;
-    length = (length > i->second->length) ? i->second->length : length;
-    memcpy((void *)value, (const void *)i->second->value, length);
+    const uint8_t *data;
+    size_t length;
+    if (!plugin->GetStateVar(key, key_length, data, length)) return false;
+    value.assign((const char *)data, length);
     return true;
 }
 
-void csPlugin::SetStateVar(const string &key, const unsigned long &value)
+static bool cs_state_get(csPlugin *plugin,
+    const char *key, size_t key_length, size_t &length, uint8_t *value)
 {
-    struct csPluginStateValue *var = new struct csPluginStateValue;
+    const uint8_t *data;
+    size_t data_length;
+    if (!plugin->GetStateVar(key, key_length, data, data_length)) return false;
+    length = (length > data_length) ? data_length : length;
+    memcpy((void *)value, (const void *)data, length);
+    return true;
+}
 
-    var->length = sizeof(unsigned long);
-    var->value = new uint8_t[sizeof(unsigned long)];
-    memcpy((void *)var->value, (const void *)&value, var->length);
+bool csPlugin::GetStateVar(const string &key, unsigned long &value)
+{
+    return cs_state_get(this, key.data(), key.size(), value);
+}
+
+bool csPlugin::GetStateVar(const string &key, float &value)
+{
+    return cs_state_get(this, key.data(), key.size(), value);
+}
 
-    SetStateVar(key, var);
+bool csPlugin::GetStateVar(const string &key, string &value)
+{
+    return cs_state_get(this, key.data(), key.size(), value);
 }
 
-void csPlugin::SetStateVar(const string &key, const float &value)
+bool csPlugin::GetStateVar(const string &key, size_t &length, uint8_t *value)
+{
+    return cs_state_get(this, key.data(), key.size(), length, value);
+}
+
+bool csPlugin::GetStateVar(const char *key, unsigned long &value)
 {
-    struct csPluginStateValue *var = new struct csPluginStateValue;
+    return cs_state_get(this, key, strlen(key), value);
+}
 
-    var->length = sizeof(float);
-    var->value = new uint8_t[sizeof(float)];
-    memcpy((void *)var->value, (const void *)&value, var->length);
+bool csPlugin::GetStateVar(const char *key, float &value)
+{
+    return cs_state_get(this, key, strlen(key), value);
+}
 
-    SetStateVar(key, var);
+bool csPlugin::GetStateVar(const char *key, string &value)
+{
+    return cs_state_get(this, key, strlen(key), value);
 }
 
-void csPlugin::SetStateVar(const string &key, const string &value)
+bool csPlugin::GetStateVar(const char *key, size_t &length, uint8_t *value)
 {
-    struct csPluginStateValue *var = new struct csPluginStateValue;
+    return cs_state_get(this, key, strlen(key), length, value);
+}
 
-    var->length = value.size();
-    if (var->length == 0)
-        var->value = NULL;
-    else {
-        char *buffer = new char[var->length];
-        value.copy(buffer, var->length);
-        var->value = reinterpret_cast<uint8_t *>(buffer);
-    }
+bool csPlugin::GetStateVar(const char *key, size_t key_length,
+    const uint8_t *&value, size_t &length)
+{
+    if (state_checkpoint == NULL)
+        return state.Get(key, key_length, value, length);
+
+    // A lazily loaded value is copied in on first access
+    state_checkpoint->Lock();
+    bool found = state.Get(key, key_length, value, length);
+    state_checkpoint->Unlock();
+    return found;
+}
 
-    SetStateVar(key, var);
+bool csPlugin::GetStateVar(const string &key, csStateValue &value)
+{
+    const uint8_t *data;
+    size_t length;
+    if (!GetStateVar(key.data(), key.size(), data, length)) return false;
+    value = csStateValue(data, length);
+    return value.IsValid();
+}
+
+void csPlugin::SetStateVar(const string &key, const unsigned long &value)
+{
+    SetStateVar(key.data(), key.size(),
+        (const uint8_t *)&value, sizeof(unsigned long));
+}
+
+void csPlugin::SetStateVar(const string &key, const float &value)
+{
+    SetStateVar(key.data(), key.size(),
+        (const uint8_t *)&value, sizeof(float));
+}
+
+void csPlugin::SetStateVar(const string &key, const string &value)
+{
+    SetStateVar(key.data(), key.size(),
+        (const uint8_t *)value.data(), value.size());
 }
 
 void csPlugin::SetStateVar(
     const string &key, size_t length, const uint8_t *value)
 {
-    struct csPluginStateValue *var = new struct csPluginStateValue;
+    SetStateVar(key.data(), key.size(), value, length);
+}
+
+void csPlugin::SetStateVar(
+    const string &key, const csStateValueWriter &value)
+{
+    SetStateVar(key.data(), key.size(), value.GetData(), value.GetLength());
+}
 
-    var->length = length;
-    if (var->length == 0)
-        var->value = NULL;
+void csPlugin::SetStateVar(const char *key, size_t key_length,
+    const uint8_t *value, size_t length)
+{
+    if (state_checkpoint == NULL)
+        SetStateValue(key, key_length, value, length);
     else {
-        uint8_t *buffer = new uint8_t[var->length];
-        memcpy((void *)buffer, (const void *)value, var->length);
-        var->value = buffer;
+        state_checkpoint->Lock();
+        SetStateValue(key, key_length, value, length);
+        state_checkpoint->SetDirty();
+        state_checkpoint->Unlock();
     }
 
-    SetStateVar(key, var);
+    if (state_log_size >= _CS_STATE_LOG_COMPACT_SIZE) SaveState();
 }
 
-void csPlugin::SetStateVar(const string &key, struct csPluginStateValue *var)
+void csPlugin::SetStateValue(const char *key, size_t key_length,
+    const uint8_t *value, size_t length)
 {
-    map<string, struct csPluginStateValue *>::iterator i;
-    i = state.find(key);
-    if (i != state.end()) {
-        if (i->second->value) delete [] i->second->value;
-        delete i->second;
-    }
-    state[key] = var;
+    state.Set(key, key_length, value, length);
+    if (state_log == NULL || key_length == 0) return;
+
+    csThreadState *state_thread = csThreadState::GetInstance();
+    if (state_thread == NULL) return;
+
+    size_t record_length;
+    uint8_t *record = csStateRecord(key, key_length,
+        value, length, record_length);
+    state_thread->Append(state_log, record, record_length);
+
+    state_log_size += record_length;
 }
 
 csPluginLoader::csPluginLoader(const string &so_name,
     const string &name, csEventClient *parent, size_t stack_size)
-    : so_name(so_name), so_handle(NULL)
+    : so_name(so_name), name(name), parent(parent), stack_size(stack_size),
+    so_handle(NULL), plugin(NULL), so_dev(0), so_ino(0), so_mtime(0)
+{
+    Load();
+}
+
+csPluginLoader::csPluginLoader(const string &so_name, csPlugin *plugin)
+    : so_name(so_name), name(plugin->GetName()), parent(NULL),
+    stack_size(plugin->GetStackSize()), so_handle(NULL), plugin(plugin),
+    so_dev(0), so_ino(0), so_mtime(0) { }
+
+csPluginLoader::~csPluginLoader()
+{
+#ifndef _CS_DEBUG
+    if (so_handle != NULL) dlclose(so_handle);
+#endif
+    csLog::Log(csLog::Debug, "Plugin dereferenced: %s", so_name.c_str());
+}
+
+bool csPluginLoader::IsModified(void)
+{
+    // Upgrades that rename a new file into place change the inode; an
+    // in-place rewrite only changes the modification time (and is likely
+    // to have crashed the running plugin already).
+    struct stat so_stat;
+    if (so_handle == NULL) return false;
+    if (stat(so_path.c_str(), &so_stat) < 0) return false;
+
+    return (so_stat.st_dev != so_dev || so_stat.st_ino != so_ino ||
+        so_stat.st_mtime != so_mtime);
+}
+
+void csPluginLoader::Reload(void)
+{
+    plugin = NULL;
+    if (so_handle != NULL) {
+        dlclose(so_handle);
+        so_handle = NULL;
+    }
+
+    // A library that can't be unloaded (ex: one defining unique symbols)
+    // stays resident, and opening it again returns the same code.
+    void *resident = dlopen(so_name.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    if (resident != NULL) {
+        dlclose(resident);
+        csLog::Log(csLog::Warning,
+            "Plugin library still resident, old code retained: %s",
+            so_name.c_str());
+    }
+
+    Load();
+    csLog::Log(csLog::Info, "Plugin reloaded: %s (%s)",
+        name.c_str(), so_path.c_str());
+}
+
+void csPluginLoader::Load(void)
 {
     so_handle = dlopen(so_name.c_str(), RTLD_NOW);
     if (so_handle == NULL) throw csException(dlerror());
@@ -314,6 +814,21 @@ csPluginLoader::csPluginLoader(const string &so_name,
         throw csException(dlerror_string);
     }
 
+    // Remember which file was loaded (the name may have been resolved
+    // through the library search path), to notice it being replaced.
+    struct link_map *so_map = NULL;
+    so_path = so_name;
+    if (dlinfo(so_handle, RTLD_DI_LINKMAP, &so_map) == 0 &&
+        so_map != NULL && so_map->l_name != NULL &&
+        so_map->l_name[0] != '\0') so_path = so_map->l_name;
+
+    struct stat so_stat;
+    if (stat(so_path.c_str(), &so_stat) == 0) {
+        so_dev = so_stat.st_dev;
+        so_ino = so_stat.st_ino;
+        so_mtime = so_stat.st_mtime;
+    }
+
     plugin = (*csPluginInit)(name, parent, stack_size);
     if (plugin == NULL) {
         dlclose(so_handle);
@@ -326,12 +841,4 @@ csPluginLoader::csPluginLoader(const string &so_name,
     csLog::Log(csLog::Debug, "Plugin loaded: %s", so_name.c_str());
 }
 
-csPluginLoader::~csPluginLoader()
-{
-#ifndef _CS_DEBUG
-    if (so_handle != NULL) dlclose(so_handle);
-#endif
-    csLog::Log(csLog::Debug, "Plugin dereferenced: %s", so_name.c_str());
-}
-
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
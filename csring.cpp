@@ -0,0 +1,356 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <sys/types.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+
+#include <clearsync/csexception.h>
+#include <clearsync/cslog.h>
+#include <clearsync/csutil.h>
+#include <clearsync/csevent.h>
+#include <clearsync/csthread.h>
+#include <clearsync/csstate.h>
+#include <clearsync/csvalue.h>
+#include <clearsync/csring.h>
+
+// Records are a 32-bit length (of the type and data) followed by the
+// type byte and data, padded to 32 bits.  A record that doesn't fit
+// before the end of the buffer is preceded by a wrap marker.
+#define _CS_RING_WRAP           0xffffffff
+
+static inline uint32_t cs_ring_align(uint32_t length)
+{
+    return (length + 3) & ~3;
+}
+
+csEventRing::csEventRing(void *base, size_t size, int doorbell, int lifeline)
+    : header((Header *)base), buffer((uint8_t *)base + sizeof(Header)),
+    size((uint32_t)size), doorbell(doorbell), lifeline(lifeline),
+    corrupt(false)
+{
+    if (size < 4096 || (size & (size - 1)) != 0)
+        throw csException(EINVAL, "csEventRing");
+}
+
+csEventRing::~csEventRing() { }
+
+size_t csEventRing::GetMemorySize(size_t size)
+{
+    return sizeof(Header) + size;
+}
+
+void csEventRing::Reset(void)
+{
+    memset((void *)header, 0, sizeof(Header));
+    __sync_synchronize();
+}
+
+bool csEventRing::IsOpen(void)
+{
+    // Nothing is ever written to the lifeline, so any readiness is EOF
+    struct pollfd fds;
+    fds.fd = lifeline;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    return (poll(&fds, 1, 0) == 0);
+}
+
+bool csEventRing::Push(uint8_t type,
+    const uint8_t *data, size_t length, time_t wait_ms)
+{
+    if (length + 1 + 4 > size / 2) {
+        csLog::Log(csLog::Warning,
+            "Ring message too large, dropped: %lu bytes", length);
+        return false;
+    }
+
+    struct timespec start, now;
+    if (wait_ms > 0) clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (useconds_t backoff = 100; !TryPush(type, data, length); ) {
+        if (wait_ms == 0 || !IsOpen()) return false;
+        if (wait_ms > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec) * 1000 +
+                (now.tv_nsec - start.tv_nsec) / 1000000 >= wait_ms)
+                return false;
+        }
+        usleep(backoff);
+        if (backoff < 10000) backoff *= 2;
+    }
+
+    return true;
+}
+
+bool csEventRing::Push(csEventPlugin *event, time_t wait_ms)
+{
+    csStateValueWriter writer;
+    const map<string, string> &values = event->GetValues();
+
+    writer.BeginMap();
+    for (map<string, string>::const_iterator i = values.begin();
+        i != values.end(); i++) {
+        writer.PutKey(i->first);
+        writer.PutString(i->second);
+    }
+    writer.EndMap();
+
+    return Push(_CS_RING_EVENT,
+        writer.GetData(), writer.GetLength(), wait_ms);
+}
+
+bool csEventRing::TryPush(uint8_t type, const uint8_t *data, size_t length)
+{
+    uint32_t tail = header->tail;
+    uint32_t head = header->head;
+    // Don't let our writes overtake the consumer's reads
+    __sync_synchronize();
+
+    uint32_t record = 4 + cs_ring_align(1 + (uint32_t)length);
+    uint32_t offset = tail & (size - 1);
+    uint32_t contiguous = size - offset;
+    uint32_t needed = (record > contiguous) ? contiguous + record : record;
+
+    uint32_t used = tail - head;
+    if (used > size || needed > size - used) return false;
+
+    if (record > contiguous) {
+        csPutLE32(buffer + offset, _CS_RING_WRAP);
+        tail += contiguous;
+        offset = 0;
+    }
+
+    csPutLE32(buffer + offset, 1 + (uint32_t)length);
+    buffer[offset + 4] = type;
+    if (length) memcpy(buffer + offset + 5, data, length);
+
+    __sync_synchronize();
+    header->tail = tail + record;
+    // Pairs with the barrier in Wait(): either the consumer sees the new
+    // tail before sleeping, or we see that it's waiting.
+    __sync_synchronize();
+
+    if (header->waiting) {
+        uint64_t count = 1;
+        if (write(doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            csLog::Log(csLog::Warning, "Error ringing doorbell: %s",
+                strerror(errno));
+        }
+    }
+
+    return true;
+}
+
+bool csEventRing::Pop(uint8_t &type, vector<uint8_t> &data)
+{
+    if (corrupt) return false;
+
+    uint32_t head = header->head;
+    uint32_t tail = header->tail;
+    __sync_synchronize();
+
+    bool found = false;
+    while (!found && head != tail) {
+        uint32_t available = tail - head;
+        uint32_t offset = head & (size - 1);
+        if (available > size || available < 4 || (offset & 3) != 0) {
+            corrupt = true;
+            break;
+        }
+
+        uint32_t length = csGetLE32(buffer + offset);
+        if (length == _CS_RING_WRAP) {
+            if (size - offset > available) {
+                corrupt = true;
+                break;
+            }
+            head += size - offset;
+            continue;
+        }
+
+        uint32_t record = 4 + cs_ring_align(length);
+        if (length == 0 || length > size - offset - 4 ||
+            record > available) {
+            corrupt = true;
+            break;
+        }
+
+        type = buffer[offset + 4];
+        data.assign(buffer + offset + 5, buffer + offset + 4 + length);
+        head += record;
+        found = true;
+    }
+
+    if (corrupt) {
+        csLog::Log(csLog::Error, "Ring corrupt, head: %u, tail: %u",
+            head, tail);
+        return false;
+    }
+
+    __sync_synchronize();
+    header->head = head;
+
+    return found;
+}
+
+bool csEventRing::Wait(time_t wait_ms)
+{
+    header->waiting = 1;
+    __sync_synchronize();
+
+    if (header->head != header->tail) {
+        header->waiting = 0;
+        return true;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = doorbell;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = lifeline;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    int rc = poll(fds, 2, (int)wait_ms);
+    header->waiting = 0;
+
+    if (rc < 0) {
+        if (errno != EINTR)
+            csLog::Log(csLog::Error, "poll: %s", strerror(errno));
+        return true;
+    }
+
+    if (fds[0].revents & POLLIN) {
+        uint64_t count;
+        if (read(doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            csLog::Log(csLog::Warning, "Error reading doorbell: %s",
+                strerror(errno));
+        }
+    }
+
+    return (fds[1].revents == 0);
+}
+
+bool csEventRing::WaitClose(time_t wait_ms)
+{
+    struct pollfd fds;
+    fds.fd = lifeline;
+    fds.events = POLLIN;
+    fds.revents = 0;
+
+    int rc;
+    do {
+        rc = poll(&fds, 1, (int)wait_ms);
+    } while (rc < 0 && errno == EINTR);
+
+    return (rc > 0);
+}
+
+csEventPlugin *csEventRing::Decode(const vector<uint8_t> &data)
+{
+    if (data.empty()) return NULL;
+
+    csStateValue value(&data[0], data.size());
+    if (value.GetType() != csStateValue::TypeMap) return NULL;
+
+    csEventPlugin *event = new csEventPlugin(string());
+
+    const char *key;
+    size_t key_length;
+    csStateValue item;
+    for (size_t i = 0; value.Next(i, key, key_length, item); ) {
+        string text;
+        if (!item.GetString(text)) {
+            delete event;
+            return NULL;
+        }
+        event->SetValue(string(key, key_length), text);
+    }
+
+    return event;
+}
+
+csThreadRing::csThreadRing(csEventRing *ring,
+    csEventClient *dst, csEventClient *src)
+    : csThread(), ring(ring), dst(dst), src(src)
+{
+    SetThreadName("ring");
+}
+
+csThreadRing::~csThreadRing()
+{
+    Join();
+}
+
+void *csThreadRing::Entry(void)
+{
+    uint8_t type;
+    vector<uint8_t> data;
+
+    for (bool run = true; run; ) {
+        bool open = ring->Wait();
+
+        while (run && ring->Pop(type, data)) {
+            if (type == _CS_RING_QUIT) {
+                run = false;
+                break;
+            }
+            if (type != _CS_RING_EVENT) {
+                csLog::Log(csLog::Warning,
+                    "Unknown ring message: 0x%02x", type);
+                continue;
+            }
+
+            csEventPlugin *event = csEventRing::Decode(data);
+            if (event == NULL) {
+                csLog::Log(csLog::Warning, "Invalid ring event, dropped.");
+                continue;
+            }
+            if (src != NULL)
+                dst->EventPush(event, src);
+            else
+                EventDispatch(event, dst);
+        }
+
+        if (!open || ring->IsCorrupt()) run = false;
+    }
+
+    EventDispatch(new csEvent(csEVENT_STOPPED), (src != NULL) ? src : dst);
+
+    return NULL;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
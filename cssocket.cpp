@@ -24,15 +24,20 @@
 #include <sys/ioctl.h>
 
 #include <stdexcept>
+#include <string>
 #include <vector>
+#include <map>
+#include <sstream>
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
 #include <regex.h>
+#include <sched.h>
 
 #include <netinet/in.h>
 #include <netdb.h>
@@ -41,8 +46,12 @@
 
 #include <clearsync/csexception.h>
 #include <clearsync/cslog.h>
+#include <clearsync/csutil.h>
 #include <clearsync/cssocket.h>
 
+bool csSocket::handoff_enable = false;
+map<string, int> csSocket::handoff;
+
 csSocket::csSocket()
     : sd(-1), state(Init), flags(None), timeout(0)
 {
@@ -69,6 +78,15 @@ void csSocket::Create(void)
 
 void csSocket::Close(void)
 {
+    if (sd >= 0 && state == Accepting &&
+        handoff_enable && handoff_key.size()) {
+        // Keep listening sockets open across a re-exec
+        csCriticalSection::Lock();
+        handoff[handoff_key] = sd;
+        csCriticalSection::Unlock();
+        sd = -1;
+    }
+
     if (sd >= 0) {
         if (state == Connected) shutdown(sd, SHUT_RDWR);
         close(sd);
@@ -77,6 +95,30 @@ void csSocket::Close(void)
     state = Init;
 }
 
+void csSocket::SetHandoff(bool enable)
+{
+    csCriticalSection::Lock();
+    handoff_enable = enable;
+    if (enable) handoff.clear();
+    csCriticalSection::Unlock();
+}
+
+void csSocket::ExportHandoff(void)
+{
+    ostringstream os;
+
+    csCriticalSection::Lock();
+    for (map<string, int>::iterator i = handoff.begin();
+        i != handoff.end(); i++) {
+        if (i != handoff.begin()) os << ",";
+        os << i->first << "=" << i->second;
+    }
+    csCriticalSection::Unlock();
+
+    if (os.str().size())
+        setenv(_CS_SOCKET_HANDOFF_ENV, os.str().c_str(), 1);
+}
+
 void csSocket::Read(size_t &length, uint8_t *buffer)
 {
     struct timeval tv;
@@ -153,6 +195,49 @@ csSocketAccept::csSocketAccept(
     struct sockaddr_in *sa_result = &sa_ifaddr;
     struct addrinfo hints, *result;
 
+    ostringstream os;
+    os << addr << ":" << port;
+    handoff_key = os.str();
+
+    csCriticalSection::Lock();
+    const char *inherited = getenv(_CS_SOCKET_HANDOFF_ENV);
+    if (inherited != NULL) {
+        // Parse listening sockets handed off by the previous process
+        // image: addr:port=fd[,addr:port=fd...]
+        string entries(inherited);
+        unsetenv(_CS_SOCKET_HANDOFF_ENV);
+        handoff.clear();
+        for (size_t p = 0; p < entries.size(); ) {
+            size_t next = entries.find(',', p);
+            if (next == string::npos) next = entries.size();
+            string entry = entries.substr(p, next - p);
+            size_t eq = entry.rfind('=');
+            if (eq != string::npos)
+                handoff[entry.substr(0, eq)] = atoi(entry.substr(eq + 1).c_str());
+            p = next + 1;
+        }
+    }
+    map<string, int>::iterator i = handoff.find(handoff_key);
+    if (i != handoff.end() && !handoff_enable) {
+        int sd_handoff = i->second;
+        handoff.erase(i);
+        csCriticalSection::Unlock();
+
+        socklen_t sa_length = sizeof(struct sockaddr_in);
+        if (getsockname(sd_handoff,
+            (struct sockaddr *)&sa, &sa_length) == 0) {
+            close(sd);
+            sd = sd_handoff;
+            state = Accepting;
+            csLog::Log(csLog::Debug, "Adopted listening socket: %s: %d",
+                handoff_key.c_str(), sd);
+            return;
+        }
+        close(sd_handoff);
+    }
+    else
+        csCriticalSection::Unlock();
+
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
 
@@ -0,0 +1,825 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+
+#include <clearsync/csexception.h>
+#include <clearsync/cslog.h>
+#include <clearsync/csutil.h>
+#include <clearsync/csevent.h>
+#include <clearsync/csthread.h>
+#include <clearsync/csstate.h>
+
+csThreadState *csThreadState::instance = NULL;
+
+void csStateSetHeader(uint8_t *header, uint32_t magic, uint32_t records)
+{
+    csPutLE32(header, magic);
+    csPutLE32(header + 4, _CS_STATE_VERSION);
+    csPutLE32(header + 8, records);
+    csPutLE32(header + 12, csCRC32(header, 12));
+}
+
+bool csStateCheckHeader(const uint8_t *header,
+    uint32_t magic, uint32_t &records)
+{
+    if (csGetLE32(header) != magic) return false;
+    if (csGetLE32(header + 4) != _CS_STATE_VERSION) return false;
+    if (csGetLE32(header + 12) != csCRC32(header, 12)) return false;
+    records = csGetLE32(header + 8);
+    return true;
+}
+
+bool csStateCheckRecord(const uint8_t *data, size_t remaining, size_t &length)
+{
+    if (remaining < _CS_STATE_RECORD_SIZE) return false;
+
+    size_t key_length = csGetLE32(data);
+    size_t value_length = csGetLE32(data + 4);
+    if (key_length > remaining || value_length > remaining ||
+        _CS_STATE_RECORD_SIZE + key_length + value_length > remaining)
+        return false;
+
+    length = _CS_STATE_RECORD_SIZE + key_length + value_length;
+    return (csGetLE32(data + length - 4) == csCRC32(data, length - 4));
+}
+
+uint8_t *csStateRecord(const char *key, size_t key_length,
+    const uint8_t *value, size_t value_length, size_t &length)
+{
+    length = _CS_STATE_RECORD_SIZE + key_length + value_length;
+    uint8_t *record = new uint8_t[length];
+
+    csPutLE32(record, (uint32_t)key_length);
+    csPutLE32(record + 4, (uint32_t)value_length);
+    memcpy(record + 8, key, key_length);
+    if (value_length)
+        memcpy(record + 8 + key_length, value, value_length);
+    csPutLE32(record + length - 4, csCRC32(record, length - 4));
+
+    return record;
+}
+
+bool csStateWrite(FILE *fh, const csStateTable &state)
+{
+    const char *key;
+    const uint8_t *value;
+    size_t key_length, value_length;
+    uint8_t header[_CS_STATE_HEADER_SIZE], lengths[8], crc[4];
+
+    // Records that fail their checks are skipped, so the count is only
+    // known once they've all been written.  The state needn't start at
+    // the beginning of the stream (ex: a handoff), so seek relative to it.
+    uint32_t records = 0;
+    long offset = ftell(fh);
+    if (offset < 0) return false;
+
+    csStateSetHeader(header, _CS_STATE_MAGIC, records);
+    if (fwrite((const void *)header, 1, sizeof(header), fh) != sizeof(header))
+        return false;
+
+    for (size_t i = 0;
+        state.Next(i, key, key_length, value, value_length); ) {
+        if (key_length == 0) continue;
+        records++;
+
+        csPutLE32(lengths, (uint32_t)key_length);
+        csPutLE32(lengths + 4, (uint32_t)value_length);
+        uint32_t sum = csCRC32(lengths, sizeof(lengths));
+        sum = csCRC32(key, key_length, sum);
+        csPutLE32(crc, csCRC32(value, value_length, sum));
+
+        if (fwrite((const void *)lengths, 1, sizeof(lengths), fh) != sizeof(lengths) ||
+            fwrite((const void *)key, 1, key_length, fh) != key_length ||
+            (value_length && fwrite((const void *)value,
+                1, value_length, fh) != value_length) ||
+            fwrite((const void *)crc, 1, sizeof(crc), fh) != sizeof(crc))
+            return false;
+    }
+
+    if (records == 0) return true;
+
+    long end = ftell(fh);
+    csStateSetHeader(header, _CS_STATE_MAGIC, records);
+    if (end < 0 || fseek(fh, offset, SEEK_SET) != 0 ||
+        fwrite((const void *)header, 1, sizeof(header), fh) != sizeof(header) ||
+        fseek(fh, end, SEEK_SET) != 0)
+        return false;
+
+    return true;
+}
+
+bool csStateSave(const string &filename, const csStateTable &state)
+{
+    // Write a complete copy beside the state file and rename it into
+    // place, so a crash leaves either the old or the new state intact.
+    string temp = filename + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        csLog::Log(csLog::Error, "Error creating state: %s: %s",
+            temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    FILE *fh = fdopen(fd, "w");
+    if (fh == NULL) {
+        csLog::Log(csLog::Error, "Error creating state: %s: %s",
+            temp.c_str(), strerror(errno));
+        close(fd);
+        unlink(temp.c_str());
+        return false;
+    }
+
+    bool success = csStateWrite(fh, state);
+    if (fflush(fh) != 0 || fsync(fd) != 0) success = false;
+    if (fclose(fh) != 0) success = false;
+
+    if (!success) {
+        csLog::Log(csLog::Error, "Error writing state: %s: %s",
+            temp.c_str(), strerror(errno));
+    }
+    else if (rename(temp.c_str(), filename.c_str()) < 0) {
+        csLog::Log(csLog::Error, "Error renaming state: %s: %s",
+            temp.c_str(), strerror(errno));
+        success = false;
+    }
+    if (!success) {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    // Make the rename itself durable
+    char *path = strdup(filename.c_str());
+    fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(path);
+
+    return true;
+}
+
+csStateTable::csStateTable()
+    : slots(NULL), capacity(0), count(0), arena_used(_CS_STATE_ARENA_SIZE),
+    map(NULL), map_length(0) { }
+
+csStateTable::csStateTable(const csStateTable &table)
+    : slots(NULL), capacity(0), count(0), arena_used(_CS_STATE_ARENA_SIZE),
+    map(NULL), map_length(0)
+{
+    const char *key;
+    const uint8_t *value;
+    size_t key_length, length;
+    for (size_t i = 0; table.Next(i, key, key_length, value, length); )
+        Set(key, key_length, value, length);
+}
+
+csStateTable::~csStateTable()
+{
+    Clear();
+}
+
+uint32_t csStateTable::Hash(const char *key, size_t key_length)
+{
+    // FNV-1a; zero marks an empty slot
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < key_length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619U;
+    }
+    return (hash) ? hash : 1;
+}
+
+bool csStateTable::Verify(const Slot *slot)
+{
+    // A mapped key is preceded by its record's lengths and the value is
+    // followed by the record's CRC-32.
+    const uint8_t *record = (const uint8_t *)slot->key - 8;
+    size_t length = _CS_STATE_RECORD_SIZE + slot->key_length + slot->length;
+    return (csGetLE32(record + length - 4) == csCRC32(record, length - 4));
+}
+
+csStateTable::Slot *csStateTable::Find(
+    const char *key, size_t key_length, uint32_t hash) const
+{
+    size_t mask = capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        Slot *slot = &slots[i];
+        if (slot->hash == 0) return slot;
+        if (slot->hash == hash && slot->key_length == key_length &&
+            memcmp(slot->key, key, key_length) == 0) return slot;
+    }
+}
+
+csStateTable::Slot *csStateTable::Insert(
+    const char *key, size_t key_length, bool &created)
+{
+    // Keep the load factor at or below 3/4
+    if ((count + 1) * 4 > capacity * 3) Grow();
+
+    uint32_t hash = Hash(key, key_length);
+    Slot *slot = Find(key, key_length, hash);
+
+    created = (slot->hash == 0);
+    if (created) {
+        slot->hash = hash;
+        slot->key_length = (uint32_t)key_length;
+        slot->key = key;
+        slot->length = 0;
+        slot->flags = 0;
+        count++;
+    }
+
+    return slot;
+}
+
+const uint8_t *csStateTable::Load(Slot *slot) const
+{
+    if (slot->flags & Mapped) {
+        const uint8_t *data = slot->value;
+        if (!Verify(slot)) {
+            csLog::Log(csLog::Error, "Corrupt state record: %.*s",
+                (int)slot->key_length, slot->key);
+            slot->flags = Corrupt;
+            slot->length = 0;
+            return NULL;
+        }
+
+        slot->flags = 0;
+        if (slot->length > _CS_STATE_INLINE_SIZE) {
+            slot->value = new uint8_t[slot->length];
+            memcpy(slot->value, data, slot->length);
+        }
+        else if (slot->length) memcpy(slot->data, data, slot->length);
+    }
+    else if (slot->flags & Corrupt) return NULL;
+
+    return (slot->length > _CS_STATE_INLINE_SIZE) ? slot->value : slot->data;
+}
+
+bool csStateTable::Get(const char *key, size_t key_length,
+    const uint8_t *&value, size_t &length) const
+{
+    if (count == 0) return false;
+
+    Slot *slot = Find(key, key_length, Hash(key, key_length));
+    if (slot->hash == 0) return false;
+
+    value = Load(slot);
+    if (value == NULL) return false;
+
+    length = slot->length;
+    return true;
+}
+
+void csStateTable::Set(const char *key, size_t key_length,
+    const uint8_t *value, size_t length)
+{
+    bool created;
+    Slot *slot = Insert(key, key_length, created);
+    if (created) slot->key = ArenaCopy(key, key_length);
+
+    // The old buffer is released only after copying, in case the new
+    // value came from it.  Mapped values aren't ours to re-use or free.
+    bool owned = (slot->flags == 0);
+    uint8_t *buffer = (owned && slot->length > _CS_STATE_INLINE_SIZE) ?
+        slot->value : NULL;
+
+    if (length > _CS_STATE_INLINE_SIZE) {
+        // Re-use the existing buffer when the size hasn't changed
+        if (buffer != NULL && slot->length == length)
+            memmove(slot->value, value, length);
+        else {
+            slot->value = new uint8_t[length];
+            memcpy(slot->value, value, length);
+            if (buffer != NULL) delete [] buffer;
+        }
+    }
+    else {
+        if (length) memmove(slot->data, value, length);
+        if (buffer != NULL) delete [] buffer;
+    }
+    slot->length = (uint32_t)length;
+    slot->flags = 0;
+}
+
+void csStateTable::SetMapped(const char *key, size_t key_length,
+    const uint8_t *value, size_t length)
+{
+    bool created;
+    Slot *slot = Insert(key, key_length, created);
+    if (slot->flags == 0 && slot->length > _CS_STATE_INLINE_SIZE)
+        delete [] slot->value;
+
+    slot->value = (uint8_t *)value;
+    slot->length = (uint32_t)length;
+    slot->flags = Mapped;
+}
+
+void csStateTable::Map(void *data, size_t length)
+{
+    if (map != NULL) munmap(map, map_length);
+    map = data;
+    map_length = length;
+}
+
+void csStateTable::Clear(void)
+{
+    for (size_t i = 0; i < capacity; i++) {
+        if (slots[i].hash != 0 && slots[i].flags == 0 &&
+            slots[i].length > _CS_STATE_INLINE_SIZE)
+            delete [] slots[i].value;
+    }
+    if (slots != NULL) delete [] slots;
+    slots = NULL;
+    capacity = count = 0;
+
+    for (vector<char *>::iterator i = arena.begin(); i != arena.end(); i++)
+        delete [] (*i);
+    arena.clear();
+    arena_used = _CS_STATE_ARENA_SIZE;
+
+    if (map != NULL) munmap(map, map_length);
+    map = NULL;
+    map_length = 0;
+}
+
+bool csStateTable::Next(size_t &index, const char *&key, size_t &key_length,
+    const uint8_t *&value, size_t &length) const
+{
+    for ( ; index < capacity; index++) {
+        Slot *slot = &slots[index];
+        if (slot->hash == 0 || (slot->flags & Corrupt)) continue;
+
+        // Mapped values are checked but left in place, so iterating
+        // (and copying a snapshot) never changes the table.
+        if ((slot->flags & Mapped) && !Verify(slot)) {
+            csLog::Log(csLog::Error, "Corrupt state record: %.*s",
+                (int)slot->key_length, slot->key);
+            continue;
+        }
+
+        key = slot->key;
+        key_length = slot->key_length;
+        length = slot->length;
+        if (slot->flags & Mapped) value = slot->value;
+        else {
+            value = (length > _CS_STATE_INLINE_SIZE) ?
+                slot->value : slot->data;
+        }
+        index++;
+        return true;
+    }
+    return false;
+}
+
+void csStateTable::Grow(void)
+{
+    Slot *old_slots = slots;
+    size_t old_capacity = capacity;
+
+    capacity = (capacity) ? capacity * 2 : 64;
+    slots = new Slot[capacity];
+    memset(slots, 0, sizeof(Slot) * capacity);
+
+    // Slots move as-is; keys stay in the arena and values keep their
+    // inline data or heap buffer.
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].hash == 0) continue;
+        *Find(old_slots[i].key,
+            old_slots[i].key_length, old_slots[i].hash) = old_slots[i];
+    }
+
+    if (old_slots != NULL) delete [] old_slots;
+}
+
+const char *csStateTable::ArenaCopy(const char *key, size_t key_length)
+{
+    char *block;
+
+    if (key_length > _CS_STATE_ARENA_SIZE / 4) {
+        // Large keys get a block of their own, the current block stays
+        block = new char[key_length];
+        arena.insert(arena.begin(), block);
+    }
+    else {
+        if (arena_used + key_length > _CS_STATE_ARENA_SIZE) {
+            arena.push_back(new char[_CS_STATE_ARENA_SIZE]);
+            arena_used = 0;
+        }
+        block = arena.back() + arena_used;
+        arena_used += key_length;
+    }
+
+    memcpy(block, key, key_length);
+    return block;
+}
+
+csStateLog::csStateLog(const string &filename,
+    time_t sync_interval, size_t sync_records)
+    : filename(filename), fd(-1), pending(0),
+    sync_interval(sync_interval), sync_records(sync_records)
+{
+    memset(&sync_time, 0, sizeof(struct timespec));
+}
+
+csStateLog::~csStateLog()
+{
+    if (fd != -1) close(fd);
+}
+
+bool csStateLog::Open(void)
+{
+    if (fd != -1) return true;
+
+    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        csLog::Log(csLog::Error, "Error opening state log: %s: %s",
+            filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat log_stat;
+    if (fstat(fd, &log_stat) == 0 && log_stat.st_size >= _CS_STATE_HEADER_SIZE)
+        return true;
+
+    return Reset();
+}
+
+bool csStateLog::Append(const uint8_t *record, size_t length)
+{
+    if (!Open()) return false;
+
+    while (length > 0) {
+        ssize_t bytes = write(fd, record, length);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            csLog::Log(csLog::Error, "Error writing state log: %s: %s",
+                filename.c_str(), strerror(errno));
+            return false;
+        }
+        record += bytes;
+        length -= bytes;
+    }
+
+    if (pending++ == 0)
+        clock_gettime(CLOCK_MONOTONIC, &sync_time);
+
+    return true;
+}
+
+bool csStateLog::Sync(void)
+{
+    if (fd == -1 || pending == 0) return true;
+
+    pending = 0;
+    if (fdatasync(fd) < 0) {
+        csLog::Log(csLog::Error, "Error syncing state log: %s: %s",
+            filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool csStateLog::Reset(void)
+{
+    uint8_t header[_CS_STATE_HEADER_SIZE];
+    csStateSetHeader(header, _CS_STATE_LOG_MAGIC, 0);
+
+    pending = 0;
+    if (ftruncate(fd, 0) < 0 ||
+        write(fd, header, sizeof(header)) != sizeof(header) ||
+        fdatasync(fd) < 0) {
+        csLog::Log(csLog::Error, "Error resetting state log: %s: %s",
+            filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void csStateLog::Remove(void)
+{
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    pending = 0;
+    if (unlink(filename.c_str()) < 0 && errno != ENOENT) {
+        csLog::Log(csLog::Warning, "Error removing state log: %s: %s",
+            filename.c_str(), strerror(errno));
+    }
+}
+
+time_t csStateLog::GetSyncRemaining(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    time_t elapsed = (now.tv_sec - sync_time.tv_sec) * 1000 +
+        (now.tv_nsec - sync_time.tv_nsec) / 1000000;
+    return sync_interval - elapsed;
+}
+
+csStateCheckpoint::csStateCheckpoint(const string &state_file,
+    csStateTable *state, csStateLog *log, time_t interval)
+    : state_file(state_file), state(state), log(log),
+    interval(interval), dirty(false)
+{
+    pthread_mutex_init(&mutex, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    next.tv_sec += interval;
+}
+
+csStateCheckpoint::~csStateCheckpoint()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+csEventState::csEventState(Type type, csStateLog *log)
+    : csEvent(csEVENT_STATE), type(type), log(log),
+    record(NULL), length(0), snapshot(NULL), source(NULL),
+    done(NULL), done_mutex(NULL), done_cond(NULL) { }
+
+csEventState::~csEventState()
+{
+    if (record != NULL) delete [] record;
+    if (snapshot != NULL) delete snapshot;
+    if (source != NULL) delete source;
+}
+
+csThreadState::csThreadState()
+    : csThread()
+{
+    if (instance != NULL)
+        throw csException(EEXIST, "csThreadState");
+
+    SetThreadName("state");
+    pthread_mutex_init(&checkpoint_mutex, NULL);
+    instance = this;
+}
+
+csThreadState::~csThreadState()
+{
+    EventPush(new csEventState(csEventState::Exit), NULL);
+    Join();
+
+    pthread_mutex_destroy(&checkpoint_mutex);
+    if (instance == this) instance = NULL;
+}
+
+void csThreadState::Append(csStateLog *log, uint8_t *record, size_t length)
+{
+    csEventState *event = new csEventState(csEventState::Append, log);
+    event->record = record;
+    event->length = length;
+    EventPush(event, NULL);
+}
+
+void csThreadState::Checkpoint(csStateLog *log,
+    const string &state_file, csStateTable *snapshot)
+{
+    csEventState *event = new csEventState(csEventState::Checkpoint, log);
+    event->state_file = state_file;
+    event->snapshot = snapshot;
+    EventPush(event, NULL);
+}
+
+void csThreadState::Checkpoint(csStateLog *log,
+    const string &state_file, csStateSnapshot *source)
+{
+    csEventState *event = new csEventState(csEventState::Checkpoint, log);
+    event->state_file = state_file;
+    event->source = source;
+    EventPush(event, NULL);
+}
+
+void csThreadState::Flush(csStateLog *log)
+{
+    bool done = false;
+    pthread_mutex_t done_mutex;
+    pthread_cond_t done_cond;
+
+    pthread_mutex_init(&done_mutex, NULL);
+    pthread_cond_init(&done_cond, NULL);
+
+    csEventState *event = new csEventState(csEventState::Flush, log);
+    event->done = &done;
+    event->done_mutex = &done_mutex;
+    event->done_cond = &done_cond;
+    EventPush(event, NULL);
+
+    pthread_mutex_lock(&done_mutex);
+    while (!done) pthread_cond_wait(&done_cond, &done_mutex);
+    pthread_mutex_unlock(&done_mutex);
+
+    pthread_cond_destroy(&done_cond);
+    pthread_mutex_destroy(&done_mutex);
+}
+
+void csThreadState::AddCheckpoint(csStateCheckpoint *checkpoint)
+{
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoints.push_back(checkpoint);
+    pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+void csThreadState::RemoveCheckpoint(csStateCheckpoint *checkpoint)
+{
+    pthread_mutex_lock(&checkpoint_mutex);
+    for (vector<csStateCheckpoint *>::iterator i = checkpoints.begin();
+        i != checkpoints.end(); i++) {
+        if ((*i) != checkpoint) continue;
+        checkpoints.erase(i);
+        break;
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+void *csThreadState::Entry(void)
+{
+    csLog::Log(csLog::Debug, "State thread started.");
+
+    for (bool run = true; run; ) {
+        // Wake for the oldest unsynced log, but never sleep indefinitely
+        // so a missed condition signal can't hold up a sync.
+        time_t wait_ms = Snapshot();
+        for (set<csStateLog *>::iterator i = pending.begin();
+            i != pending.end(); i++) {
+            time_t remaining = (*i)->GetSyncRemaining();
+            if (remaining < wait_ms) wait_ms = remaining;
+        }
+        if (wait_ms <= 0) {
+            Sync(true);
+            continue;
+        }
+
+        csEvent *event = EventPopWait(wait_ms);
+        if (event == _CS_EVENT_NONE) continue;
+
+        vector<csEvent *> events;
+        bool quit = (event->GetId() == csEVENT_QUIT);
+        if (quit) {
+            // The shutdown broadcast is sticky; discard it and carry on
+            // until every plugin has flushed and we're told to exit.
+            EventDrain(events);
+        }
+        else events.push_back(event);
+
+        for (vector<csEvent *>::iterator i = events.begin();
+            i != events.end(); i++) {
+            if ((*i)->GetId() == csEVENT_STATE) {
+                csEventState *state_event = static_cast<csEventState *>((*i));
+                if (state_event->GetType() == csEventState::Exit) run = false;
+                else Process(state_event);
+            }
+            EventDestroy((*i));
+        }
+        if (quit) EventDestroy(event);
+    }
+
+    Sync(false);
+    csLog::Log(csLog::Debug, "State thread terminated.");
+
+    return NULL;
+}
+
+void csThreadState::Process(csEventState *event)
+{
+    csStateLog *log = event->GetLog();
+
+    switch (event->GetType()) {
+    case csEventState::Append:
+        if (!log->Append(event->record, event->length)) break;
+        if (log->pending >= log->sync_records) {
+            log->Sync();
+            pending.erase(log);
+        }
+        else pending.insert(log);
+        break;
+
+    case csEventState::Checkpoint:
+        // Every record logged before the snapshot was taken was queued
+        // ahead of it (a snapshot taken here is of the state as it was
+        // when queued), so once the snapshot is safely on disk the log
+        // can be emptied.
+        if (event->snapshot == NULL && event->source != NULL)
+            event->snapshot = event->source->Take();
+        if (event->snapshot == NULL) break;
+        if (csStateSave(event->state_file, *event->snapshot) && log != NULL) {
+            log->Open();
+            log->Reset();
+            pending.erase(log);
+        }
+        break;
+
+    case csEventState::Flush:
+        if (log != NULL) {
+            log->Sync();
+            pending.erase(log);
+        }
+
+        pthread_mutex_lock(event->done_mutex);
+        *event->done = true;
+        pthread_cond_broadcast(event->done_cond);
+        pthread_mutex_unlock(event->done_mutex);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void csThreadState::Sync(bool expired_only)
+{
+    set<csStateLog *>::iterator i = pending.begin();
+    while (i != pending.end()) {
+        if (expired_only && (*i)->GetSyncRemaining() > 0) {
+            i++;
+            continue;
+        }
+        (*i)->Sync();
+        pending.erase(i++);
+    }
+}
+
+time_t csThreadState::Snapshot(void)
+{
+    struct timespec now;
+    time_t wait_ms = 1000;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&checkpoint_mutex);
+
+    for (vector<csStateCheckpoint *>::iterator i = checkpoints.begin();
+        i != checkpoints.end(); i++) {
+        csStateCheckpoint *checkpoint = (*i);
+
+        time_t remaining = (checkpoint->next.tv_sec - now.tv_sec) * 1000 +
+            (checkpoint->next.tv_nsec - now.tv_nsec) / 1000000;
+        if (remaining > 0) {
+            if (remaining < wait_ms) wait_ms = remaining;
+            continue;
+        }
+
+        checkpoint->next = now;
+        checkpoint->next.tv_sec += checkpoint->interval;
+        if (checkpoint->interval * 1000 < wait_ms)
+            wait_ms = checkpoint->interval * 1000;
+
+        // Copy under the lock (no I/O), then queue the snapshot behind
+        // any log records already waiting so it's written in order.
+        checkpoint->Lock();
+        if (checkpoint->dirty) {
+            csStateTable *snapshot = new csStateTable(*checkpoint->state);
+            checkpoint->dirty = false;
+            Checkpoint(checkpoint->log, checkpoint->state_file, snapshot);
+        }
+        checkpoint->Unlock();
+    }
+
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return wait_ms;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,616 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+
+#include <clearsync/csexception.h>
+#include <clearsync/cslog.h>
+#include <clearsync/csutil.h>
+#include <clearsync/csevent.h>
+#include <clearsync/csthread.h>
+#include <clearsync/csstate.h>
+#include <clearsync/csstore.h>
+
+csStateStore *csStateStore::instance = NULL;
+
+static string cs_store_key(const string &ns, const string &key)
+{
+    string store_key(ns);
+    store_key.push_back('\0');
+    store_key.append(key);
+    return store_key;
+}
+
+static const uint8_t *cs_store_map(const string &filename, size_t &length)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            csLog::Log(csLog::Warning, "Error opening state store: %s: %s",
+                filename.c_str(), strerror(errno));
+        }
+        return NULL;
+    }
+
+    struct stat store_stat;
+    if (fstat(fd, &store_stat) < 0 || store_stat.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    length = (size_t)store_stat.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        csLog::Log(csLog::Warning, "Error mapping state store: %s: %s",
+            filename.c_str(), strerror(errno));
+        return NULL;
+    }
+
+    return (const uint8_t *)data;
+}
+
+csStateTransaction::csStateTransaction(csStateStore *store)
+    : store(store), version(0), active(false)
+{
+    if (this->store == NULL) this->store = csStateStore::GetInstance();
+    if (this->store == NULL)
+        throw csException(ENOENT, "State store unavailable");
+
+    version = this->store->Begin();
+    active = true;
+}
+
+csStateTransaction::~csStateTransaction()
+{
+    Abort();
+}
+
+bool csStateTransaction::Get(
+    const string &ns, const string &key, string &value)
+{
+    string store_key = cs_store_key(ns, key);
+
+    map<string, pair<bool, string> >::iterator i = writes.find(store_key);
+    if (i != writes.end()) {
+        if (i->second.first) return false;
+        value = i->second.second;
+        return true;
+    }
+
+    return store->Read(store_key, version, value);
+}
+
+void csStateTransaction::List(const string &ns, vector<string> &keys)
+{
+    string prefix = cs_store_key(ns, "");
+
+    set<string> found;
+    store->Scan(prefix, version, found);
+
+    map<string, pair<bool, string> >::iterator i;
+    for (i = writes.lower_bound(prefix); i != writes.end(); i++) {
+        if (i->first.compare(0, prefix.size(), prefix) != 0) break;
+        if (i->second.first) found.erase(i->first);
+        else found.insert(i->first);
+    }
+
+    keys.clear();
+    for (set<string>::iterator j = found.begin(); j != found.end(); j++)
+        keys.push_back(j->substr(prefix.size()));
+}
+
+void csStateTransaction::Set(
+    const string &ns, const string &key, const string &value)
+{
+    writes[cs_store_key(ns, key)] = make_pair(false, value);
+}
+
+void csStateTransaction::Delete(const string &ns, const string &key)
+{
+    writes[cs_store_key(ns, key)] = make_pair(true, string());
+}
+
+bool csStateTransaction::Commit(void)
+{
+    if (!active) return false;
+
+    bool success = store->Commit(this);
+    active = false;
+    writes.clear();
+    return success;
+}
+
+void csStateTransaction::Abort(void)
+{
+    if (!active) return;
+
+    store->End(version);
+    active = false;
+    writes.clear();
+}
+
+csStateStore::Key::Key(const string &key, int height)
+    : key(key), versions(NULL), height(height)
+{
+    next = new Key * volatile[height];
+    for (int level = 0; level < height; level++) next[level] = NULL;
+}
+
+csStateStore::csStateStore(const string &filename)
+    : filename(filename), log(NULL), log_size(0), version(0),
+    head(NULL), keys(0), seed((uint32_t)time(NULL)), readers(0)
+{
+    if (instance != NULL)
+        throw csException(EEXIST, "State store already exists");
+
+    pthread_mutex_init(&mutex, NULL);
+    head = new Key(string(), _CS_STORE_HEIGHT);
+
+    if (!Load()) {
+        // Keep the damaged file for inspection and start empty
+        string corrupt = filename + ".corrupt";
+        csLog::Log(csLog::Error, "Corrupt state store: %s, moved to: %s",
+            filename.c_str(), corrupt.c_str());
+        if (rename(filename.c_str(), corrupt.c_str()) < 0) {
+            csLog::Log(csLog::Warning, "Error renaming state store: %s: %s",
+                filename.c_str(), strerror(errno));
+        }
+        Clear();
+    }
+
+    string log_file = filename + _CS_STATE_LOG_SUFFIX;
+    if (LoadLog()) {
+        // Fold the replayed log into a fresh store file
+        csStateTable *snapshot = Snapshot(version);
+        if (csStateSave(filename, *snapshot) &&
+            unlink(log_file.c_str()) < 0) {
+            csLog::Log(csLog::Warning, "Error removing state log: %s: %s",
+                log_file.c_str(), strerror(errno));
+        }
+        delete snapshot;
+    }
+
+    log = new csStateLog(log_file);
+    instance = this;
+
+    csLog::Log(csLog::Debug, "State store: %s, keys: %lu",
+        filename.c_str(), keys);
+}
+
+csStateStore::~csStateStore()
+{
+    if (instance == this) instance = NULL;
+
+    // Wait for every commit to reach the log, then write the store file
+    // directly; the log is only discarded once the file is known good.
+    csThreadState *state_thread = csThreadState::GetInstance();
+    if (state_thread != NULL) state_thread->Flush(log);
+    else log->Sync();
+
+    csStateTable *snapshot = Snapshot(version);
+    if (csStateSave(filename, *snapshot)) log->Remove();
+    delete snapshot;
+    delete log;
+
+    Clear();
+    delete head;
+
+    pthread_mutex_destroy(&mutex);
+}
+
+uint64_t csStateStore::Begin(void)
+{
+    pthread_mutex_lock(&mutex);
+    uint64_t snapshot = version;
+    snapshots.insert(snapshot);
+    pthread_mutex_unlock(&mutex);
+    return snapshot;
+}
+
+void csStateStore::End(uint64_t version)
+{
+    pthread_mutex_lock(&mutex);
+    multiset<uint64_t>::iterator i = snapshots.find(version);
+    if (i != snapshots.end()) snapshots.erase(i);
+    pthread_mutex_unlock(&mutex);
+}
+
+bool csStateStore::Read(const string &key, uint64_t version, string &value)
+{
+    bool found = false;
+    __sync_add_and_fetch(&readers, 1);
+
+    Key *k = Find(key);
+    if (k != NULL && k->key == key) {
+        const Version *v = Find(k, version);
+        if (v != NULL && !v->deleted) {
+            value = v->value;
+            found = true;
+        }
+    }
+
+    __sync_sub_and_fetch(&readers, 1);
+    return found;
+}
+
+void csStateStore::Scan(
+    const string &prefix, uint64_t version, set<string> &keys)
+{
+    __sync_add_and_fetch(&readers, 1);
+
+    for (Key *k = Find(prefix); k != NULL; k = k->next[0]) {
+        if (k->key.compare(0, prefix.size(), prefix) != 0) break;
+
+        const Version *v = Find(k, version);
+        if (v != NULL && !v->deleted) keys.insert(k->key);
+    }
+
+    __sync_sub_and_fetch(&readers, 1);
+}
+
+bool csStateStore::Commit(csStateTransaction *transaction)
+{
+    map<string, pair<bool, string> > &writes = transaction->writes;
+    map<string, pair<bool, string> >::iterator i;
+
+    pthread_mutex_lock(&mutex);
+
+    multiset<uint64_t>::iterator s = snapshots.find(transaction->version);
+    if (s != snapshots.end()) snapshots.erase(s);
+
+    if (writes.empty()) {
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    // First committer wins: fail if any key was changed after this
+    // transaction's snapshot.
+    for (i = writes.begin(); i != writes.end(); i++) {
+        Key *k = Find(i->first);
+        if (k == NULL || k->key != i->first || k->versions == NULL)
+            continue;
+        if (k->versions->version > transaction->version) {
+            pthread_mutex_unlock(&mutex);
+            return false;
+        }
+    }
+
+    // Log the whole transaction as one append, closed by a record with
+    // an empty key, so a torn commit is discarded on replay.
+    vector<uint8_t> buffer;
+    for (i = writes.begin(); i != writes.end(); i++) {
+        string value(1, (i->second.first) ?
+            _CS_STORE_OP_DELETE : _CS_STORE_OP_SET);
+        value.append(i->second.second);
+
+        size_t length;
+        uint8_t *record = csStateRecord(i->first.data(), i->first.size(),
+            (const uint8_t *)value.data(), value.size(), length);
+        buffer.insert(buffer.end(), record, record + length);
+        delete [] record;
+    }
+
+    uint8_t count[4];
+    size_t length;
+    csPutLE32(count, (uint32_t)writes.size());
+    uint8_t *record = csStateRecord("", 0, count, sizeof(count), length);
+    buffer.insert(buffer.end(), record, record + length);
+    delete [] record;
+
+    version++;
+    for (i = writes.begin(); i != writes.end(); i++)
+        Apply(i->first, i->second.first, i->second.second);
+
+    csThreadState *state_thread = csThreadState::GetInstance();
+    if (state_thread != NULL) {
+        record = new uint8_t[buffer.size()];
+        memcpy(record, &buffer[0], buffer.size());
+        state_thread->Append(log, record, buffer.size());
+    }
+    else if (log->Append(&buffer[0], buffer.size())) log->Sync();
+
+    log_size += buffer.size();
+    if (log_size >= _CS_STATE_LOG_COMPACT_SIZE) {
+        log_size = 0;
+        if (state_thread != NULL) {
+            // Queued behind this commit's record, and taken by the state
+            // thread as of this commit; the version is kept until then.
+            snapshots.insert(version);
+            state_thread->Checkpoint(log, filename,
+                new csStateStoreSnapshot(this, version));
+        }
+        else {
+            csStateTable *snapshot = Snapshot(version);
+            if (csStateSave(filename, *snapshot)) log->Reset();
+            delete snapshot;
+        }
+    }
+
+    Reap();
+
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+csStateStore::Key *csStateStore::Find(const string &key, Key **prev)
+{
+    // The first key not less than key, and at each level the last key
+    // before it
+    Key *k = head;
+    for (int level = _CS_STORE_HEIGHT - 1; level >= 0; level--) {
+        for ( ;; ) {
+            Key *next = k->next[level];
+            if (next == NULL || next->key.compare(key) >= 0) break;
+            k = next;
+        }
+        if (prev != NULL) prev[level] = k;
+    }
+
+    return k->next[0];
+}
+
+const csStateStore::Version *csStateStore::Find(
+    const Key *k, uint64_t version)
+{
+    // Newest version no later than the snapshot
+    const Version *v = k->versions;
+    while (v != NULL && v->version > version) v = v->next;
+    return v;
+}
+
+int csStateStore::GetRandomHeight(void)
+{
+    // One key in four goes up another level
+    int height = 1;
+    while (height < _CS_STORE_HEIGHT) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) & 3) break;
+        height++;
+    }
+
+    return height;
+}
+
+void csStateStore::Apply(const string &key, bool deleted, const string &value)
+{
+    Key *prev[_CS_STORE_HEIGHT];
+    Key *k = Find(key, prev);
+
+    if (k == NULL || k->key != key) {
+        k = new Key(key, GetRandomHeight());
+        for (int level = 0; level < k->height; level++)
+            k->next[level] = prev[level]->next[level];
+        // Complete before a reader can reach it
+        __sync_synchronize();
+        for (int level = 0; level < k->height; level++)
+            prev[level]->next[level] = k;
+        keys++;
+    }
+
+    Version *v = new Version;
+    v->version = version;
+    v->deleted = deleted;
+    v->value = value;
+    v->next = k->versions;
+    __sync_synchronize();
+    k->versions = v;
+
+    Prune(k, prev, (snapshots.empty()) ? version : *snapshots.begin());
+}
+
+void csStateStore::Prune(Key *k, Key **prev, uint64_t oldest)
+{
+    // Only the newest version visible to the oldest live snapshot, and
+    // anything after it, can still be read.
+    Version *keep = k->versions;
+    while (keep != NULL && keep->version > oldest) keep = keep->next;
+    if (keep == NULL) return;
+
+    for (Version *v = keep->next; v != NULL; v = v->next)
+        retired_versions.push_back(v);
+    keep->next = NULL;
+
+    if (keep != k->versions || !keep->deleted) return;
+
+    for (int level = 0; level < k->height; level++)
+        prev[level]->next[level] = k->next[level];
+    retired_versions.push_back(keep);
+    retired_keys.push_back(k);
+    keys--;
+}
+
+void csStateStore::Reap(void)
+{
+    // A reader that could still be on something unlinked is counted
+    // until it's done, so with no readers it can all be freed.
+    __sync_synchronize();
+    if (readers != 0) return;
+    __sync_synchronize();
+
+    for (vector<Version *>::iterator i = retired_versions.begin();
+        i != retired_versions.end(); i++) delete (*i);
+    for (vector<Key *>::iterator i = retired_keys.begin();
+        i != retired_keys.end(); i++) delete (*i);
+    retired_versions.clear();
+    retired_keys.clear();
+}
+
+void csStateStore::Clear(void)
+{
+    // Nothing else may be using the store
+    for (Key *k = head->next[0]; k != NULL; ) {
+        Key *next = k->next[0];
+        for (Version *v = k->versions; v != NULL; ) {
+            Version *older = v->next;
+            delete v;
+            v = older;
+        }
+        delete k;
+        k = next;
+    }
+
+    for (int level = 0; level < _CS_STORE_HEIGHT; level++)
+        head->next[level] = NULL;
+    keys = 0;
+
+    Reap();
+}
+
+csStateTable *csStateStore::Snapshot(uint64_t version)
+{
+    csStateTable *snapshot = new csStateTable();
+    __sync_add_and_fetch(&readers, 1);
+
+    for (Key *k = head->next[0]; k != NULL; k = k->next[0]) {
+        const Version *v = Find(k, version);
+        if (v == NULL || v->deleted) continue;
+        snapshot->Set(k->key.data(), k->key.size(),
+            (const uint8_t *)v->value.data(), v->value.size());
+    }
+
+    __sync_sub_and_fetch(&readers, 1);
+    return snapshot;
+}
+
+bool csStateStore::Load(void)
+{
+    size_t length;
+    const uint8_t *p = cs_store_map(filename, length);
+    if (p == NULL) return true;
+
+    uint32_t records;
+    bool success = (length >= _CS_STATE_HEADER_SIZE &&
+        csStateCheckHeader(p, _CS_STATE_MAGIC, records));
+
+    size_t offset = _CS_STATE_HEADER_SIZE;
+    for (uint32_t r = 0; success && r < records; r++) {
+        size_t record_length;
+        if (!csStateCheckRecord(p + offset, length - offset, record_length)) {
+            success = false;
+            break;
+        }
+
+        size_t key_length = csGetLE32(p + offset);
+        size_t value_length = csGetLE32(p + offset + 4);
+        const char *key = (const char *)p + offset + 8;
+        Apply(string(key, key_length), false,
+            string(key + key_length, value_length));
+
+        offset += record_length;
+    }
+
+    munmap((void *)p, length);
+    return success;
+}
+
+bool csStateStore::LoadLog(void)
+{
+    string log_file = filename + _CS_STATE_LOG_SUFFIX;
+
+    size_t length;
+    const uint8_t *p = cs_store_map(log_file, length);
+    if (p == NULL) return false;
+
+    uint32_t unused;
+    if (length < _CS_STATE_HEADER_SIZE ||
+        !csStateCheckHeader(p, _CS_STATE_LOG_MAGIC, unused)) {
+        csLog::Log(csLog::Warning, "Invalid state log header: %s",
+            log_file.c_str());
+        munmap((void *)p, length);
+        return false;
+    }
+
+    // Replay whole transactions only; a crash can leave a torn record
+    // or an uncommitted transaction at the end, which is discarded.
+    size_t offset = _CS_STATE_HEADER_SIZE, committed = offset;
+    size_t transactions = 0;
+    vector<size_t> pending;
+
+    while (offset < length) {
+        size_t record_length;
+        if (!csStateCheckRecord(p + offset, length - offset, record_length))
+            break;
+
+        size_t key_length = csGetLE32(p + offset);
+        size_t value_length = csGetLE32(p + offset + 4);
+
+        if (key_length > 0) {
+            if (value_length == 0) break;
+            pending.push_back(offset);
+            offset += record_length;
+            continue;
+        }
+
+        if (value_length != 4 ||
+            csGetLE32(p + offset + 8) != pending.size()) break;
+
+        version++;
+        for (vector<size_t>::iterator i = pending.begin();
+            i != pending.end(); i++) {
+            const char *key = (const char *)p + (*i) + 8;
+            size_t record_key_length = csGetLE32(p + (*i));
+            size_t record_value_length = csGetLE32(p + (*i) + 4);
+            const char *value = key + record_key_length;
+
+            Apply(string(key, record_key_length),
+                (value[0] == _CS_STORE_OP_DELETE),
+                string(value + 1, record_value_length - 1));
+        }
+
+        pending.clear();
+        offset += record_length;
+        committed = offset;
+        transactions++;
+    }
+
+    if (committed != length) {
+        csLog::Log(csLog::Warning,
+            "Discarded %lu bytes of incomplete state log: %s",
+            length - committed, log_file.c_str());
+    }
+    csLog::Log(csLog::Debug, "State store transactions replayed: %lu",
+        transactions);
+
+    munmap((void *)p, length);
+    return true;
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -22,43 +22,112 @@
 #include <stdexcept>
 #include <vector>
 #include <map>
+#include <sstream>
 
+#include <unistd.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 #include <expat.h>
+#include <regex.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <clearsync/csexception.h>
 #include <clearsync/csconf.h>
 #include <clearsync/cslog.h>
 #include <clearsync/csevent.h>
+#include <clearsync/csutil.h>
 #include <clearsync/csthread.h>
 
-static void *cs_thread_entry(void *param)
-{
-    csThread *thread = reinterpret_cast<csThread *>(param);
-    return thread->Entry();
-}
+static struct {
+    const char *name;
+    int policy;
+} cs_sched_policy[] = {
+    { "other", SCHED_OTHER },
+#ifdef SCHED_BATCH
+    { "batch", SCHED_BATCH },
+#endif
+#ifdef SCHED_IDLE
+    { "idle", SCHED_IDLE },
+#endif
+    { "fifo", SCHED_FIFO },
+    { "rr", SCHED_RR },
+    { NULL, -1 }
+};
 
 csThread::csThread(size_t stack_size)
-    : csEventClient()
+    : csEventClient(), tid(-1),
+    stack(NULL), stack_size(0), stack_guard(0), stack_high_water(0),
+    cpu_affinity(NULL), sched_nice_enable(false), sched_nice(0),
+    sched_policy(-1), sched_priority(0)
 {
     memset(&id, 0xff, sizeof(pthread_t));
 
     int rc;
     if ((rc = pthread_attr_init(&attr)) != 0)
         throw csException(rc, "pthread_attr_init");
-    if ((rc = pthread_attr_setstacksize(&attr, stack_size)) != 0)
-        throw csException(rc, "pthread_attr_setstacksize");
+
+    SetStackSize(stack_size);
+}
+
+csThread::~csThread()
+{
+    int rc;
+    if ((rc = pthread_attr_destroy(&attr)) != 0)
+        csLog::Log(csLog::Error, "pthread_attr_destroy: %s", strerror(rc));
+    if (stack != NULL) munmap(stack, stack_guard + stack_size);
+    if (cpu_affinity != NULL) delete cpu_affinity;
+}
+
+void *csThread::ThreadEntry(void *param)
+{
+    csThread *thread = reinterpret_cast<csThread *>(param);
+    thread->ApplyScheduling();
+    return thread->Entry();
 }
 
 void csThread::Start(void)
 {
+    // Allocate the stack ourselves with an inaccessible guard page
+    // below it; a stack overflow faults rather than silently
+    // corrupting the neighbouring mapping.  Untouched pages are never
+    // committed, and stay zero, which GetStackHighWater() relies on.
+    stack_guard = (size_t)::csGetPageSize();
+    void *base = mmap(NULL, stack_guard + stack_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+        throw csException(errno, "mmap");
+    stack = reinterpret_cast<uint8_t *>(base);
+    stack_high_water = 0;
+
     int rc;
+    if (mprotect(stack, stack_guard, PROT_NONE) != 0) {
+        rc = errno;
+        munmap(stack, stack_guard + stack_size);
+        stack = NULL;
+        throw csException(rc, "mprotect");
+    }
+
+    if ((rc = pthread_attr_setstack(&attr,
+        stack + stack_guard, stack_size)) != 0) {
+        munmap(stack, stack_guard + stack_size);
+        stack = NULL;
+        throw csException(rc, "pthread_attr_setstack");
+    }
+
     if ((rc = pthread_create(&id, &attr,
-        &cs_thread_entry, (void *)this)) != 0) {
+        &csThread::ThreadEntry, (void *)this)) != 0) {
         memset(&id, 0xff, sizeof(pthread_t));
+        munmap(stack, stack_guard + stack_size);
+        stack = NULL;
         throw csException(rc, "pthread_create");
     }
 }
@@ -66,14 +135,218 @@ void csThread::Start(void)
 void csThread::Join(void)
 {
     int rc;
-    if ((rc = pthread_attr_destroy(&attr)) != 0)
-        csLog::Log(csLog::Error, "pthread_attr_destroy: %s", strerror(rc));
-
     pthread_t id_invalid;
     memset(&id_invalid, 0xff, sizeof(pthread_t));
-    if (memcmp(&id, &id_invalid, sizeof(pthread_t)) &&
-        (rc = pthread_join(id, NULL)) != 0)
+
+    // Join may be called more than once (ex: by csMain before the
+    // plugin's own destructor), only the first call does any work.
+    if (!memcmp(&id, &id_invalid, sizeof(pthread_t))) return;
+
+    if ((rc = pthread_join(id, NULL)) != 0)
         csLog::Log(csLog::Error, "pthread_join: %s", strerror(rc));
+
+    memset(&id, 0xff, sizeof(pthread_t));
+
+    if (stack == NULL) return;
+
+    stack_high_water = GetStackHighWater();
+    munmap(stack, stack_guard + stack_size);
+    stack = NULL;
+
+    csLog::Log(
+        (stack_high_water > stack_size - stack_size / 10) ?
+            csLog::Warning : csLog::Debug,
+        "%s: stack size: %lu, high-water: %lu, recommended: %lu",
+        thread_name.c_str(), stack_size, stack_high_water, GetStackRecommended());
+}
+
+void csThread::SetThreadName(const string &name)
+{
+    thread_name = name;
+}
+
+void csThread::GetStats(struct csThreadStats &stats)
+{
+    memset(&stats, 0, sizeof(struct csThreadStats));
+
+    stats.tid = tid;
+    stats.events = event_count;
+    stats.wakeups = event_wakeups;
+
+    pthread_t id_invalid;
+    memset(&id_invalid, 0xff, sizeof(pthread_t));
+    if (!memcmp(&id, &id_invalid, sizeof(pthread_t)) || tid == -1) return;
+
+    clockid_t cid;
+    if (pthread_getcpuclockid(id, &cid) == 0)
+        clock_gettime(cid, &stats.cpu_time);
+
+    // Context switch counters are only exposed by the kernel per task
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+    FILE *fh = fopen(path, "r");
+    if (fh == NULL) return;
+
+    char line[128];
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        if (sscanf(line, "voluntary_ctxt_switches: %lu",
+            &stats.ctxt_voluntary) == 1) continue;
+        sscanf(line, "nonvoluntary_ctxt_switches: %lu",
+            &stats.ctxt_involuntary);
+    }
+    fclose(fh);
+}
+
+void csThread::SetStackSize(size_t stack_size)
+{
+    if (stack != NULL)
+        throw csException(EBUSY, "SetStackSize");
+
+    size_t page_size = (size_t)::csGetPageSize();
+    if (stack_size < (size_t)PTHREAD_STACK_MIN)
+        stack_size = PTHREAD_STACK_MIN;
+    if (stack_size % page_size)
+        stack_size += page_size - (stack_size % page_size);
+
+    this->stack_size = stack_size;
+}
+
+size_t csThread::GetStackHighWater(void)
+{
+    // The deepest non-zero byte from the bottom of the stack marks the
+    // furthest the thread has ever reached.  Reading pages that were
+    // never touched maps the shared zero page, it doesn't commit memory.
+    if (stack == NULL) return stack_high_water;
+
+    const uint8_t *base = stack + stack_guard;
+    const uint8_t *limit = base + stack_size;
+    const uint8_t *p = base;
+
+    while (p < limit && (((uintptr_t)p) % sizeof(unsigned long)) && *p == 0)
+        p++;
+    while (p + sizeof(unsigned long) <= limit &&
+        *reinterpret_cast<const unsigned long *>(p) == 0)
+        p += sizeof(unsigned long);
+    while (p < limit && *p == 0) p++;
+
+    return (size_t)(limit - p);
+}
+
+size_t csThread::GetStackRecommended(void)
+{
+    size_t high_water = GetStackHighWater();
+    if (high_water == 0) return stack_size;
+
+    // Leave 25% head-room above the measured high-water mark
+    size_t page_size = (size_t)::csGetPageSize();
+    size_t recommended = high_water + high_water / 4;
+    if (recommended % page_size)
+        recommended += page_size - (recommended % page_size);
+    if (recommended < (size_t)PTHREAD_STACK_MIN)
+        recommended = PTHREAD_STACK_MIN;
+
+    return recommended;
+}
+
+void csThread::SetCpuAffinity(const cpu_set_t &cpus)
+{
+    if (cpu_affinity == NULL) cpu_affinity = new cpu_set_t;
+    memcpy(cpu_affinity, &cpus, sizeof(cpu_set_t));
+}
+
+void csThread::SetNice(int nice)
+{
+    sched_nice_enable = true;
+    sched_nice = nice;
+}
+
+void csThread::SetSchedulingPolicy(int policy, int priority)
+{
+    sched_policy = policy;
+    sched_priority = priority;
+}
+
+int csThread::GetSchedulingPolicy(const string &name)
+{
+    for (int i = 0; cs_sched_policy[i].name != NULL; i++) {
+        if (strcasecmp(name.c_str(), cs_sched_policy[i].name)) continue;
+        return cs_sched_policy[i].policy;
+    }
+    return -1;
+}
+
+const char *csThread::GetSchedulingPolicyName(int policy)
+{
+    for (int i = 0; cs_sched_policy[i].name != NULL; i++) {
+        if (policy == cs_sched_policy[i].policy)
+            return cs_sched_policy[i].name;
+    }
+    return "unknown";
+}
+
+void csThread::ApplyScheduling(void)
+{
+    // Called from the new thread, before Entry().  Nice values and the
+    // non-real-time policies (batch, idle) can only be applied to the
+    // running thread, so everything is done here rather than via attr.
+    int rc;
+    tid = (pid_t)syscall(SYS_gettid);
+
+    if (thread_name.empty()) {
+        ostringstream os;
+        os << "thread-" << tid;
+        thread_name = os.str();
+    }
+
+    // Kernel thread names are limited to 16 bytes, including the NUL
+    if ((rc = pthread_setname_np(pthread_self(),
+        thread_name.substr(0, 15).c_str())) != 0) {
+        csLog::Log(csLog::Warning, "%s: pthread_setname_np: %s",
+            thread_name.c_str(), strerror(rc));
+    }
+
+    if (cpu_affinity != NULL && (rc = pthread_setaffinity_np(
+        pthread_self(), sizeof(cpu_set_t), cpu_affinity)) != 0) {
+        csLog::Log(csLog::Warning, "%s: pthread_setaffinity_np: %s",
+            thread_name.c_str(), strerror(rc));
+    }
+
+    if (sched_policy != -1) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(struct sched_param));
+        param.sched_priority = sched_priority;
+        if ((rc = pthread_setschedparam(
+            pthread_self(), sched_policy, &param)) != 0) {
+            csLog::Log(csLog::Warning, "%s: pthread_setschedparam: %s",
+                thread_name.c_str(), strerror(rc));
+        }
+    }
+
+    if (sched_nice_enable &&
+        setpriority(PRIO_PROCESS, (id_t)tid, sched_nice) < 0) {
+        csLog::Log(csLog::Warning, "%s: setpriority: %s",
+            thread_name.c_str(), strerror(errno));
+    }
+
+    int policy;
+    struct sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param) != 0) {
+        policy = -1;
+        param.sched_priority = 0;
+    }
+
+    string cpus("all");
+    cpu_set_t cpuset;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0)
+        csCpuListToString(cpuset, cpus);
+
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, (id_t)tid);
+
+    csLog::Log(csLog::Debug,
+        "%s: tid: %d, cpu-affinity: %s, sched-policy: %s (%d), nice: %d",
+        thread_name.c_str(), tid, cpus.c_str(), GetSchedulingPolicyName(policy),
+        param.sched_priority, (errno == 0) ? nice : 0);
 }
 
 // vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -29,6 +29,7 @@
 #include <signal.h>
 #include <time.h>
 #include <regex.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -129,6 +130,8 @@ csThreadTimer::csThreadTimer(csEventClient *parent, const sigset_t &signal_set)
     if (instance != NULL)
         throw csException(EEXIST, "csThreadTimer");
 
+    SetThreadName("timer");
+
     if (vector_mutex == NULL) {
         vector_mutex = new pthread_mutex_t;
         pthread_mutex_init(vector_mutex, NULL);
@@ -21,6 +21,7 @@
 #include <string>
 #include <stdexcept>
 #include <vector>
+#include <sstream>
 
 #include <unistd.h>
 #include <stdio.h>
@@ -30,6 +31,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <regex.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -45,6 +47,9 @@
 
 #define _CS_UTIL_DEFAULT_LOCALE     "en_US"
 
+static pthread_once_t cs_crc32_once = PTHREAD_ONCE_INIT;
+static uint32_t cs_crc32_table[256];
+
 csCriticalSection *csCriticalSection::instance = NULL;
 pthread_mutex_t *csCriticalSection::mutex = NULL;
 
@@ -150,6 +155,56 @@ long csGetPageSize(void)
     return page_size;
 }
 
+void csStringToCpuList(const string &text, cpu_set_t &cpus)
+{
+    // Parse a cpu list as used by taskset(1), ex: "0-3,6"
+    CPU_ZERO(&cpus);
+
+    const char *p = text.c_str();
+    while (*p != '\0') {
+        char *end;
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '\0') break;
+
+        long first = strtol(p, &end, 10), last;
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            throw csException(EINVAL, text.c_str());
+        last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(++p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                throw csException(EINVAL, text.c_str());
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, &cpus);
+
+        while (*p == ' ') p++;
+        if (*p != '\0' && *p != ',')
+            throw csException(EINVAL, text.c_str());
+    }
+
+    if (CPU_COUNT(&cpus) == 0)
+        throw csException(EINVAL, text.c_str());
+}
+
+void csCpuListToString(const cpu_set_t &cpus, string &text)
+{
+    ostringstream os;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cpus)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus)) last++;
+        if (os.tellp() > 0) os << ",";
+        os << cpu;
+        if (last > cpu) os << "-" << last;
+        cpu = last;
+    }
+
+    text = os.str();
+}
+
 int csExecute(const string &command)
 {
     long page_size = ::csGetPageSize();
@@ -175,49 +230,35 @@ int csExecute(const string &command, vector<string> &output)
     return pclose(ph);
 }
 
+static const char *cs_hex_upper = "0123456789ABCDEF";
+static const char *cs_hex_lower = "0123456789abcdef";
+
 void csHexDump(FILE *fh, const void *data, uint32_t length)
 {
-    uint8_t c, *p = (uint8_t *)data;
-    char bytestr[4] = { 0 };
-    char addrstr[10] = { 0 };
-    char hexstr[16 * 3 + 5] = { 0 };
-    char charstr[16 * 1 + 5] = { 0 };
-
-    for (uint32_t n = 1; n <= length; n++) {
-        if (n % 16 == 1) {
-            // Store address for this line
-            snprintf(addrstr, sizeof(addrstr),
-                "%.5x", (uint32_t)(p - (uint8_t *)data));
+    const uint8_t *p = (const uint8_t *)data;
+    // Address, 16 hex bytes split in two groups of 8, the bytes as text
+    char line[16 + 49 + 1 + 16 + 1];
+
+    for (uint32_t offset = 0; offset < length; offset += 16) {
+        uint32_t count = (length - offset < 16) ? length - offset : 16;
+
+        char *hex = line + sprintf(line, "%.5x:  ", offset);
+        memset(hex, ' ', 49);
+        for (uint32_t i = 0; i < count; i++) {
+            char *digits = hex + i * 3 + ((i >= 8) ? 1 : 0);
+            digits[0] = cs_hex_upper[p[offset + i] >> 4];
+            digits[1] = cs_hex_upper[p[offset + i] & 0x0f];
         }
-            
-        c = *p;
-        if (isprint(c) == 0) c = '.';
-
-        // Store hex str (for left side)
-        snprintf(bytestr, sizeof(bytestr), "%02X ", *p);
-        strncat(hexstr, bytestr, sizeof(hexstr) - strlen(hexstr) - 1);
-
-        // Store char str (for right side)
-        snprintf(bytestr, sizeof(bytestr), "%c", c);
-        strncat(charstr, bytestr, sizeof(charstr) - strlen(charstr) - 1);
-
-        if(n % 16 == 0) { 
-            // Line completed
-            fprintf(fh,
-                "%5.5s:  %-49.49s %s\n", addrstr, hexstr, charstr);
-            hexstr[0] = 0;
-            charstr[0] = 0;
-        } else if(n % 8 == 0) {
-            // Half line: add whitespaces
-            strncat(hexstr, " ", sizeof(hexstr) - strlen(hexstr) -1);
+
+        char *text = hex + 49;
+        *text++ = ' ';
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t c = p[offset + i];
+            *text++ = (isprint(c)) ? (char)c : '.';
         }
-        // Next byte...
-        p++;
-    }
+        *text++ = '\n';
 
-    if (strlen(hexstr) > 0) {
-        // Print rest of buffer if not empty
-        fprintf(fh, "%5.5s:  %-49.49s %s\n", addrstr, hexstr, charstr);
+        fwrite(line, 1, text - line, fh);
     }
 }
 
@@ -349,6 +390,29 @@ void csSHA1(uint8_t *buffer, size_t length, uint8_t *digest)
     SHA1_Final(digest, &ctx);
 }
 
+static void cs_crc32_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : (crc >> 1);
+        cs_crc32_table[i] = crc;
+    }
+}
+
+uint32_t csCRC32(const void *data, size_t length, uint32_t crc)
+{
+    // IEEE 802.3 CRC-32 (as used by zlib); pass the previous result as
+    // crc to checksum data in pieces.
+    pthread_once(&cs_crc32_once, cs_crc32_init);
+
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (length--)
+        crc = cs_crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
 void csHexToBinary(const string &hex, uint8_t *bin, size_t length)
 {
     if (hex.size() != length * 2)
@@ -364,19 +428,20 @@ void csHexToBinary(const string &hex, uint8_t *bin, size_t length)
 
 void csBinaryToHex(const uint8_t *bin, string &hex, size_t length)
 {
-    char hexstr[3];
-
-    hex.clear();
+    hex.resize(length * 2);
     for (size_t i = 0; i < length; i++) {
-        sprintf(hexstr, "%02x", bin[i]);
-        hex.append(hexstr);
+        hex[i * 2] = cs_hex_lower[bin[i] >> 4];
+        hex[i * 2 + 1] = cs_hex_lower[bin[i] & 0x0f];
     }
 }
 
 void csBinaryToHex(const uint8_t *bin, char *hex, size_t length)
 {
-    for (size_t i = 0; i < length; i++, hex += 2)
-        sprintf(hex, "%02x", bin[i]);
+    for (size_t i = 0; i < length; i++, hex += 2) {
+        hex[0] = cs_hex_lower[bin[i] >> 4];
+        hex[1] = cs_hex_lower[bin[i] & 0x0f];
+    }
+    *hex = '\0';
 }
 
 void csGetLocale(string &locale)
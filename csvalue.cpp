@@ -0,0 +1,450 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <clearsync/csexception.h>
+#include <clearsync/csvalue.h>
+
+static size_t cs_value_get_varint(
+    const uint8_t *data, size_t length, uint64_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < length && i < 10; i++) {
+        value |= (uint64_t)(data[i] & 0x7f) << (i * 7);
+        if ((data[i] & 0x80) == 0) return i + 1;
+    }
+    return 0;
+}
+
+static void cs_value_put_varint(vector<uint8_t> &data, uint64_t value)
+{
+    while (value >= 0x80) {
+        data.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    data.push_back((uint8_t)value);
+}
+
+// Size of an already checked value; containers carry their length
+static size_t cs_value_size(const uint8_t *data)
+{
+    uint64_t value;
+    size_t bytes;
+
+    switch (data[0]) {
+    case _CS_VALUE_INT64:
+    case _CS_VALUE_UINT64:
+        return 1 + cs_value_get_varint(data + 1, 10, value);
+    case _CS_VALUE_DOUBLE:
+        return 9;
+    case _CS_VALUE_BYTES:
+    case _CS_VALUE_STRING:
+    case _CS_VALUE_LIST:
+    case _CS_VALUE_MAP:
+        bytes = cs_value_get_varint(data + 1, 10, value);
+        return 1 + bytes + (size_t)value;
+    default:
+        return 1;
+    }
+}
+
+csStateValue::csStateValue()
+    : type(TypeInvalid), payload(NULL), length(0), count(0), number(0) { }
+
+csStateValue::csStateValue(const uint8_t *data, size_t length)
+    : type(TypeInvalid), payload(NULL), length(0), count(0), number(0)
+{
+    if (data != NULL && length > 0 && Check(data, length, 0) == length)
+        Decode(data, length);
+}
+
+size_t csStateValue::Check(const uint8_t *data, size_t length, int depth)
+{
+    uint64_t value, items;
+    size_t bytes, offset;
+    bool keyed;
+
+    if (length == 0) return 0;
+
+    switch (data[0]) {
+    case _CS_VALUE_NULL:
+    case _CS_VALUE_FALSE:
+    case _CS_VALUE_TRUE:
+        return 1;
+
+    case _CS_VALUE_INT64:
+    case _CS_VALUE_UINT64:
+        bytes = cs_value_get_varint(data + 1, length - 1, value);
+        return (bytes) ? 1 + bytes : 0;
+
+    case _CS_VALUE_DOUBLE:
+        return (length >= 9) ? 9 : 0;
+
+    case _CS_VALUE_BYTES:
+    case _CS_VALUE_STRING:
+        bytes = cs_value_get_varint(data + 1, length - 1, value);
+        if (bytes == 0 || value > length - 1 - bytes) return 0;
+        return 1 + bytes + (size_t)value;
+
+    case _CS_VALUE_LIST:
+    case _CS_VALUE_MAP:
+        if (depth >= _CS_VALUE_MAX_DEPTH) return 0;
+        bytes = cs_value_get_varint(data + 1, length - 1, value);
+        if (bytes == 0 || value > length - 1 - bytes) return 0;
+
+        // The elements must fill the payload exactly
+        keyed = (data[0] == _CS_VALUE_MAP);
+        length = (size_t)value;
+        data += 1 + bytes;
+        offset = cs_value_get_varint(data, length, items);
+        if (offset == 0) return 0;
+
+        for (uint64_t i = 0; i < items; i++) {
+            if (keyed) {
+                uint64_t key_length;
+                size_t key_bytes = cs_value_get_varint(
+                    data + offset, length - offset, key_length);
+                if (key_bytes == 0 ||
+                    key_length > length - offset - key_bytes) return 0;
+                offset += key_bytes + (size_t)key_length;
+            }
+            size_t item = Check(data + offset, length - offset, depth + 1);
+            if (item == 0) return 0;
+            offset += item;
+        }
+
+        return (offset == length) ? 1 + bytes + length : 0;
+
+    default:
+        return 0;
+    }
+}
+
+void csStateValue::Decode(const uint8_t *data, size_t length)
+{
+    uint64_t value;
+    size_t bytes;
+
+    payload = NULL;
+    this->length = count = 0;
+    number = 0;
+
+    switch (data[0]) {
+    case _CS_VALUE_NULL:
+        type = TypeNull;
+        break;
+    case _CS_VALUE_FALSE:
+    case _CS_VALUE_TRUE:
+        type = TypeBool;
+        number = (data[0] == _CS_VALUE_TRUE);
+        break;
+    case _CS_VALUE_INT64:
+        type = TypeInt64;
+        cs_value_get_varint(data + 1, length - 1, value);
+        number = (value >> 1) ^ (~(value & 1) + 1);
+        break;
+    case _CS_VALUE_UINT64:
+        type = TypeUInt64;
+        cs_value_get_varint(data + 1, length - 1, number);
+        break;
+    case _CS_VALUE_DOUBLE:
+        type = TypeDouble;
+        for (int i = 7; i >= 0; i--) number = (number << 8) | data[1 + i];
+        break;
+    case _CS_VALUE_BYTES:
+    case _CS_VALUE_STRING:
+        type = (data[0] == _CS_VALUE_BYTES) ? TypeBytes : TypeString;
+        bytes = cs_value_get_varint(data + 1, length - 1, value);
+        payload = data + 1 + bytes;
+        this->length = (size_t)value;
+        break;
+    case _CS_VALUE_LIST:
+    case _CS_VALUE_MAP:
+        type = (data[0] == _CS_VALUE_LIST) ? TypeList : TypeMap;
+        bytes = cs_value_get_varint(data + 1, length - 1, value);
+        payload = data + 1 + bytes;
+        this->length = (size_t)value;
+        bytes = cs_value_get_varint(payload, this->length, value);
+        count = (size_t)value;
+        payload += bytes;
+        this->length -= bytes;
+        break;
+    default:
+        type = TypeInvalid;
+        break;
+    }
+}
+
+bool csStateValue::GetBool(bool &value) const
+{
+    if (type != TypeBool) return false;
+    value = (number != 0);
+    return true;
+}
+
+bool csStateValue::GetInt64(int64_t &value) const
+{
+    if (type == TypeInt64 ||
+        (type == TypeUInt64 && (number >> 63) == 0)) {
+        value = (int64_t)number;
+        return true;
+    }
+    return false;
+}
+
+bool csStateValue::GetUInt64(uint64_t &value) const
+{
+    if (type == TypeUInt64 ||
+        (type == TypeInt64 && (number >> 63) == 0)) {
+        value = number;
+        return true;
+    }
+    return false;
+}
+
+bool csStateValue::GetDouble(double &value) const
+{
+    switch (type) {
+    case TypeDouble:
+        memcpy(&value, &number, sizeof(double));
+        return true;
+    case TypeInt64:
+        value = (double)(int64_t)number;
+        return true;
+    case TypeUInt64:
+        value = (double)number;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool csStateValue::GetBytes(const uint8_t *&value, size_t &length) const
+{
+    if (type != TypeBytes && type != TypeString) return false;
+    value = payload;
+    length = this->length;
+    return true;
+}
+
+bool csStateValue::GetString(const char *&value, size_t &length) const
+{
+    if (type != TypeString) return false;
+    value = (const char *)payload;
+    length = this->length;
+    return true;
+}
+
+bool csStateValue::GetString(string &value) const
+{
+    if (type != TypeString) return false;
+    value.assign((const char *)payload, length);
+    return true;
+}
+
+bool csStateValue::Next(size_t &offset, csStateValue &item) const
+{
+    if (type != TypeList || offset >= length) return false;
+
+    size_t size = cs_value_size(payload + offset);
+    item.Decode(payload + offset, size);
+    offset += size;
+    return true;
+}
+
+bool csStateValue::Next(size_t &offset, const char *&key, size_t &key_length,
+    csStateValue &item) const
+{
+    if (type != TypeMap || offset >= length) return false;
+
+    uint64_t value;
+    offset += cs_value_get_varint(payload + offset, length - offset, value);
+    key = (const char *)payload + offset;
+    key_length = (size_t)value;
+    offset += key_length;
+
+    size_t size = cs_value_size(payload + offset);
+    item.Decode(payload + offset, size);
+    offset += size;
+    return true;
+}
+
+bool csStateValue::Find(const string &key, csStateValue &item) const
+{
+    const char *item_key;
+    size_t key_length;
+    for (size_t i = 0; Next(i, item_key, key_length, item); ) {
+        if (key_length == key.size() &&
+            memcmp(item_key, key.data(), key_length) == 0) return true;
+    }
+    return false;
+}
+
+csStateValueWriter::csStateValueWriter() { }
+
+csStateValueWriter::~csStateValueWriter() { }
+
+void csStateValueWriter::Put(uint8_t tag)
+{
+    if (!open.empty()) {
+        Container &container = open.back();
+        if (container.tag == _CS_VALUE_MAP) {
+            if (!container.key)
+                throw csException(EINVAL, "Map value without a key");
+            container.key = false;
+        }
+        container.count++;
+    }
+    data.push_back(tag);
+}
+
+void csStateValueWriter::PutVarint(uint64_t value)
+{
+    cs_value_put_varint(data, value);
+}
+
+void csStateValueWriter::PutNull(void)
+{
+    Put(_CS_VALUE_NULL);
+}
+
+void csStateValueWriter::PutBool(bool value)
+{
+    Put((value) ? _CS_VALUE_TRUE : _CS_VALUE_FALSE);
+}
+
+void csStateValueWriter::PutInt64(int64_t value)
+{
+    Put(_CS_VALUE_INT64);
+    PutVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void csStateValueWriter::PutUInt64(uint64_t value)
+{
+    Put(_CS_VALUE_UINT64);
+    PutVarint(value);
+}
+
+void csStateValueWriter::PutDouble(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(double));
+
+    Put(_CS_VALUE_DOUBLE);
+    for (int i = 0; i < 8; i++, bits >>= 8)
+        data.push_back((uint8_t)bits);
+}
+
+void csStateValueWriter::PutBytes(const uint8_t *value, size_t length)
+{
+    Put(_CS_VALUE_BYTES);
+    PutVarint(length);
+    data.insert(data.end(), value, value + length);
+}
+
+void csStateValueWriter::PutString(const char *value, size_t length)
+{
+    Put(_CS_VALUE_STRING);
+    PutVarint(length);
+    data.insert(data.end(), value, value + length);
+}
+
+void csStateValueWriter::PutString(const string &value)
+{
+    PutString(value.data(), value.size());
+}
+
+void csStateValueWriter::BeginList(void)
+{
+    Put(_CS_VALUE_LIST);
+
+    Container container;
+    container.tag = _CS_VALUE_LIST;
+    container.offset = data.size();
+    container.count = 0;
+    container.key = false;
+    open.push_back(container);
+}
+
+void csStateValueWriter::EndList(void)
+{
+    End(_CS_VALUE_LIST);
+}
+
+void csStateValueWriter::BeginMap(void)
+{
+    Put(_CS_VALUE_MAP);
+
+    Container container;
+    container.tag = _CS_VALUE_MAP;
+    container.offset = data.size();
+    container.count = 0;
+    container.key = false;
+    open.push_back(container);
+}
+
+void csStateValueWriter::PutKey(const string &key)
+{
+    if (open.empty() || open.back().tag != _CS_VALUE_MAP || open.back().key)
+        throw csException(EINVAL, "Unexpected map key");
+
+    open.back().key = true;
+    PutVarint(key.size());
+    data.insert(data.end(), key.begin(), key.end());
+}
+
+void csStateValueWriter::EndMap(void)
+{
+    End(_CS_VALUE_MAP);
+}
+
+void csStateValueWriter::End(uint8_t tag)
+{
+    if (open.empty() || open.back().tag != tag || open.back().key)
+        throw csException(EINVAL, "Unexpected end of list or map");
+
+    Container container = open.back();
+    open.pop_back();
+
+    // The lengths are only known now; insert them ahead of the elements
+    vector<uint8_t> header, count;
+    cs_value_put_varint(count, container.count);
+    cs_value_put_varint(header,
+        count.size() + data.size() - container.offset);
+    header.insert(header.end(), count.begin(), count.end());
+
+    data.insert(data.begin() + container.offset,
+        header.begin(), header.end());
+}
+
+void csStateValueWriter::Clear(void)
+{
+    data.clear();
+    open.clear();
+}
+
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
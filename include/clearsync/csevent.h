@@ -25,6 +25,10 @@ using namespace std;
 #define csEVENT_TIMER           0x0002
 #define csEVENT_PLUGIN          0x0003
 #define csEVENT_NETLINK         0x0004
+#define csEVENT_REEXEC          0x0005
+#define csEVENT_STATS           0x0006
+#define csEVENT_STOPPED         0x0007
+#define csEVENT_STATE           0x0008
 #define csEVENT_USER            0x1000
 
 // Broadcast event client type
@@ -90,12 +94,16 @@ public:
     void *GetUserData(void) { return user_data; };
     void SetUserData(void *user_data) { this->user_data = user_data; };
 
+    inline time_t GetTimestamp(void) const { return timestamp; };
+    inline void SetTimestamp(time_t timestamp) { this->timestamp = timestamp; };
+
 protected:
     csevent_id_t id;
     csevent_flag_t flags;
     csEventClient *src;
     csEventClient *dst;
     void *user_data;
+    time_t timestamp;
 };
 
 class csEventPlugin : public csEvent
@@ -109,6 +117,9 @@ public:
     void SetValue(const string &key, const string &value) {
         key_value[key] = value;
     };
+    inline const map<string, string> &GetValues(void) const {
+        return key_value;
+    };
 
 protected:
     map<string, string> key_value;
@@ -133,15 +144,28 @@ public:
     bool IsEventsEnabled(void) { return event_enable; };
     inline void EventsEnable(bool enable = true) { event_enable = enable; };
 
+    void EventDrain(vector<csEvent *> &events);
+    void EventQueueStatus(size_t &length,
+        time_t &oldest_age, time_t &pop_age);
+
 protected:
     csEvent *EventPop(void);
     csEvent *EventPopWait(time_t wait_ms = 0);
 
+    // For threads that also wait on other descriptors: an eventfd that
+    // becomes readable when an event is queued.  Read it, then pop until
+    // the queue is empty, as it is only signalled when the queue was.
+    int EventGetDescriptor(void);
+
     pthread_mutex_t event_queue_mutex;
     pthread_cond_t event_condition;
     pthread_mutex_t event_condition_mutex;
 
     bool event_enable;
+    unsigned long event_count;
+    unsigned long event_wakeups;
+    time_t event_pop_time;
+    int event_fd;
 
     vector<csEvent *> event_queue;
 
@@ -0,0 +1,217 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CSNETCACHE_H
+#define _CSNETCACHE_H
+
+using namespace std;
+
+// Addresses are stored in network byte order, in the first 4 (AF_INET)
+// or 16 (AF_INET6) bytes, the rest is zero.  The generation members are
+// the cache's own bookkeeping.
+struct csNetlinkLink
+{
+    int index;
+    string name;
+    unsigned short type;
+    unsigned int flags;
+    uint32_t mtu;
+    int master;
+    vector<uint8_t> address;
+    uint32_t generation;
+};
+
+struct csNetlinkAddress
+{
+    int index;
+    uint8_t family;
+    uint8_t prefix_length;
+    uint8_t scope;
+    uint8_t flags;
+    uint8_t address[16];
+    string label;
+    uint32_t generation;
+};
+
+// Multipath routes are reduced to their first next hop
+struct csNetlinkRoute
+{
+    uint8_t family;
+    uint8_t dst_length;
+    uint8_t tos;
+    uint8_t protocol;
+    uint8_t scope;
+    uint8_t type;
+    uint32_t table;
+    uint32_t priority;
+    int oif;
+    bool has_gateway;
+    uint8_t dst[16];
+    uint8_t gateway[16];
+    uint8_t prefsrc[16];
+    uint32_t generation;
+};
+
+struct csNetlinkNeighbour
+{
+    int index;
+    uint8_t family;
+    uint8_t flags;
+    uint16_t state;
+    uint8_t address[16];
+    vector<uint8_t> lladdr;
+    uint32_t generation;
+};
+
+// Immutable copy of the cache.  Pointers returned by the lookups are
+// valid until the snapshot is released with Unref().
+class csNetlinkSnapshot
+{
+public:
+    void Ref(void);
+    void Unref(void);
+
+    // False until every table has been dumped once
+    inline bool IsComplete(void) const { return complete; };
+
+    // Sorted by index; routes by family, then longest prefix first
+    inline const vector<csNetlinkLink> &GetLinks(void) const {
+        return links->entries;
+    };
+    inline const vector<csNetlinkAddress> &GetAddresses(void) const {
+        return addresses->entries;
+    };
+    inline const vector<csNetlinkRoute> &GetRoutes(void) const {
+        return routes->entries;
+    };
+    inline const vector<csNetlinkNeighbour> &GetNeighbours(void) const {
+        return neighbours->entries;
+    };
+
+    const csNetlinkLink *FindLink(int index) const;
+    const csNetlinkLink *FindLink(const string &name) const;
+    void FindAddresses(int index,
+        vector<const csNetlinkAddress *> &result) const;
+    const csNetlinkNeighbour *FindNeighbour(int index,
+        uint8_t family, const uint8_t *address) const;
+
+    // Of the routes to a prefix in the table, the one with the lowest
+    // priority (metric): exactly dst/dst_length, or the longest match.
+    const csNetlinkRoute *FindRoute(uint8_t family, const uint8_t *dst,
+        uint8_t dst_length, uint32_t table = RT_TABLE_MAIN) const;
+    const csNetlinkRoute *LookupRoute(uint8_t family,
+        const uint8_t *address, uint32_t table = RT_TABLE_MAIN) const;
+
+protected:
+    friend class csNetlinkCache;
+
+    struct RouteRange
+    {
+        uint8_t family;
+        uint8_t dst_length;
+        size_t begin;
+        size_t end;
+    };
+
+    // Shared with later snapshots until the table changes.  Only the
+    // netlink thread creates and frees snapshots, so plain counts do.
+    template <class T> struct Table
+    {
+        int refs;
+        vector<T> entries;
+
+        Table() : refs(1) { };
+        inline Table *Ref(void) { refs++; return this; };
+        inline void Unref(void) { if (--refs == 0) delete this; };
+    };
+
+    volatile int refs;
+    bool complete;
+    Table<csNetlinkLink> *links;
+    Table<csNetlinkAddress> *addresses;
+    Table<csNetlinkRoute> *routes;
+    Table<RouteRange> *route_range;
+    Table<csNetlinkNeighbour> *neighbours;
+
+    csNetlinkSnapshot();
+    virtual ~csNetlinkSnapshot();
+
+    const csNetlinkRoute *FindRoute(const RouteRange &range,
+        const uint8_t *dst, uint32_t table) const;
+};
+
+#ifdef _CS_INTERNAL
+
+// Kept by the netlink thread from dumps and notifications.  Only the
+// netlink thread may update the cache; any thread may take a snapshot,
+// without locking.
+class csNetlinkCache
+{
+public:
+    csNetlinkCache();
+    virtual ~csNetlinkCache();
+
+    csNetlinkSnapshot *GetSnapshot(void);
+
+    // Returns true if routes may have gone without notification (a link
+    // went down), and the route table should be dumped again.
+    bool Update(struct nlmsghdr *nh);
+
+    // Entries not seen again in a dump are dropped at its end
+    void BeginDump(uint16_t type);
+    void EndDump(uint16_t type, bool complete);
+
+    // Makes any changes visible in a new snapshot
+    void Publish(void);
+
+protected:
+    enum Table
+    {
+        TableLink,
+        TableAddress,
+        TableRoute,
+        TableNeighbour,
+        TableMax
+    };
+
+    map<int, csNetlinkLink> links;
+    map<string, csNetlinkAddress> addresses;
+    map<string, csNetlinkRoute> routes;
+    map<string, csNetlinkNeighbour> neighbours;
+
+    uint32_t generation[TableMax];
+    unsigned dumped;
+    unsigned dirty;
+
+    csNetlinkSnapshot * volatile snapshot;
+    volatile int readers;
+    vector<csNetlinkSnapshot *> retired;
+
+    bool UpdateLink(struct nlmsghdr *nh);
+    void UpdateAddress(struct nlmsghdr *nh);
+    void UpdateRoute(struct nlmsghdr *nh);
+    void UpdateNeighbour(struct nlmsghdr *nh);
+
+    void Purge(int index);
+    void Reap(void);
+
+    static int GetTable(uint16_t type);
+};
+
+#endif // _CS_INTERNAL
+
+#endif // _CSNETCACHE_H
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -19,12 +19,120 @@
 
 using namespace std;
 
+#ifndef _CS_NETLINK_HANDOFF_ENV
+#define _CS_NETLINK_HANDOFF_ENV "CLEARSYNC_NETLINK_FD"
+#endif
+
+// Socket receive buffer, can be set with a "receive-buffer" thread param
+#ifndef _CS_NETLINK_RCVBUF
+#define _CS_NETLINK_RCVBUF      (1024 * 1024)
+#endif
+
+// Messages read per recvmmsg(2), and the initial size of each buffer
+#ifndef _CS_NETLINK_BATCH
+#define _CS_NETLINK_BATCH       16
+#endif
+#ifndef _CS_NETLINK_BUFFER_SIZE
+#define _CS_NETLINK_BUFFER_SIZE (32 * 1024)
+#endif
+
+// Sockets for plugins' queries, each running one dump at a time
+#ifndef _CS_NETLINK_SOCKETS
+#define _CS_NETLINK_SOCKETS     4
+#endif
+
+// Route changes held for watches, in milliseconds without further
+// changes ("route-quiet-period" thread param), but at most this many
+// quiet periods from the first
+#ifndef _CS_NETLINK_QUIET_PERIOD
+#define _CS_NETLINK_QUIET_PERIOD    0
+#endif
+#ifndef _CS_NETLINK_QUIET_MAX
+#define _CS_NETLINK_QUIET_MAX       10
+#endif
+
+// Released receive buffers kept for reuse
+#ifndef _CS_NETLINK_POOL
+#define _CS_NETLINK_POOL        32
+#endif
+
+// Reference counted receive buffer.  Replies point into the buffer they
+// were received in, which goes back to the pool on the last Unref().
+class csNetlinkBuffer
+{
+public:
+    static csNetlinkBuffer *Get(size_t size);
+    static void Purge(void);
+
+    inline uint8_t *GetData(void) { return data; };
+    inline size_t GetSize(void) { return size; };
+    inline bool IsShared(void) { return (refs > 1); };
+
+    void Ref(void);
+    void Unref(void);
+
+protected:
+    csNetlinkBuffer(size_t size);
+    virtual ~csNetlinkBuffer();
+
+    uint8_t *data;
+    size_t size;
+    volatile int refs;
+};
+
+// View of consecutive messages in a receive buffer, read in place:
+//   while ((nh = reply.Next()) != NULL) ...
+class csNetlinkReply
+{
+public:
+    csNetlinkReply();
+    csNetlinkReply(csNetlinkBuffer *buffer, struct nlmsghdr *nh);
+    csNetlinkReply(const csNetlinkReply &reply);
+    virtual ~csNetlinkReply();
+
+    csNetlinkReply &operator=(const csNetlinkReply &reply);
+
+    struct nlmsghdr *Next(void);
+
+    // Takes in nh if it directly follows the view's last message
+    bool Extend(csNetlinkBuffer *buffer, struct nlmsghdr *nh);
+
+protected:
+    csNetlinkBuffer *buffer;
+    uint8_t *next;
+    uint8_t *end;
+};
+
+// Narrows a watch; zero members match anything.  A watch with several
+// filters is sent the changes that match any of them.  Protocol and
+// table only apply to routes, and links have no family.
+struct csNetlinkFilter
+{
+    csNetlinkFilter();
+
+    uint16_t type;          // RTM_NEWROUTE, RTM_DELLINK, ...
+    uint8_t family;
+    uint8_t protocol;       // RTPROT_*
+    uint32_t table;
+    int ifindex;            // Routes: output interface, RTA_OIF
+
+    bool Match(struct nlmsghdr *nh) const;
+
+    bool operator==(const csNetlinkFilter &filter) const;
+};
+
 class csEventNetlink : public csEvent
 {
 public:
+    // Watches are sent notifications of changes, the rest are dumps
     enum Type {
         NL_Query,
         NL_RouteWatch,
+        NL_LinkWatch,
+        NL_AddrWatch,
+        NL_NeighWatch,
+        // Internal, see csThreadNetlink::Unwatch()
+        NL_Unwatch,
     };
 
     csEventNetlink(enum Type type, uint16_t query = 0);
@@ -38,7 +146,26 @@ public:
     uint32_t GetSequence(void) { return query_seq; };
     void SetSequence(uint32_t seq) { query_seq = seq; };
 
-    void AddReply(struct nlmsghdr *nh);
+    // Filters must be added before the watch is sent to the thread
+    void AddFilter(const csNetlinkFilter &filter) {
+        this->filter.push_back(filter);
+    };
+    const vector<csNetlinkFilter> &GetFilters(void) { return filter; };
+    bool Match(struct nlmsghdr *nh);
+
+    // Changes are held until none have arrived for ms, then sent as
+    // their net effect: the last change to each route (link, address or
+    // neighbour), leaving out routes that were added and deleted again,
+    // and anything deleted and put back as it was.  Zero sends every
+    // change as it arrives.  The default (-1) is the netlink thread's
+    // "route-quiet-period" for route watches, and zero for the rest.
+    void SetQuietPeriod(time_t ms) { quiet_period = ms; };
+    time_t GetQuietPeriod(void) { return quiet_period; };
+
+    void AddReply(csNetlinkBuffer *buffer, struct nlmsghdr *nh);
+    // The next run of messages, without copying them
+    bool GetReply(csNetlinkReply &reply);
+    // A copy of the next message, to be freed with delete []
     struct nlmsghdr *GetReply(void);
 
     virtual csEvent *Clone(void);
@@ -47,31 +174,148 @@ protected:
     Type type;
     uint16_t query;
     uint32_t query_seq;
+    vector<csNetlinkFilter> filter;
+    time_t quiet_period;
     pthread_mutex_t *reply_mutex;
-    vector<struct nlmsghdr *> reply;
+    vector<csNetlinkReply> reply;
+    size_t reply_index;
 };
 
+// Interface counters from IFLA_STATS64, sampled by the netlink thread
+// with one link dump every "link-stats-interval" ms: the kernel's
+// counters, their change since the previous sample, and that change per
+// second.  A counter that went backwards (a driver reset) has no change.
+struct csNetlinkLinkStats
+{
+    enum Counter {
+        RxPackets,
+        TxPackets,
+        RxBytes,
+        TxBytes,
+        RxErrors,
+        TxErrors,
+        RxDropped,
+        TxDropped,
+        Multicast,
+        CounterMax
+    };
+
+    int index;
+    string name;
+    // Milliseconds since the previous sample, zero for a link's first
+    time_t interval;
+    uint64_t counter[CounterMax];
+    uint64_t delta[CounterMax];
+    double rate[CounterMax];
+};
+
+class csNetlinkCache;
+class csNetlinkSnapshot;
+
 class csThreadNetlink : public csThread
 {
 public:
-    csThreadNetlink(csEventClient *parent);
+    // On demand, the notification socket is only opened for a watch
+    csThreadNetlink(csEventClient *parent, bool on_demand = false);
     virtual ~csThreadNetlink();
 
     virtual void *Entry(void);
 
+    void Handoff(void);
+
+    void SetReceiveBufferSize(int size);
+
+    // The link, address, route and neighbour cache (off by default) is
+    // read once, when the thread starts.  Snapshots (see csnetcache.h)
+    // are NULL without it.
+    inline void SetCacheEnabled(bool enable) { cache_enable = enable; };
+
+    // For watches that don't set their own, in milliseconds
+    inline void SetRouteQuietPeriod(time_t ms) { route_quiet_period = ms; };
+    csNetlinkSnapshot *GetSnapshot(void);
+
+    // Link statistics are sampled every ms (zero, the default, never),
+    // for the named interfaces or, if none are added, all of them.  Both
+    // are read once, when the thread starts.
+    inline void SetLinkStatsInterval(time_t ms) { stats_interval = ms; };
+    inline void AddLinkStatsInterface(const string &name) {
+        stats_link.push_back(name);
+    };
+
+    // Copies of the latest sample, by index; false for a link that isn't
+    // sampled (yet)
+    bool GetLinkStats(int index, csNetlinkLinkStats &stats);
+    bool GetLinkStats(const string &name, csNetlinkLinkStats &stats);
+    void GetLinkStats(vector<csNetlinkLinkStats> &stats);
+
+    // Drops a client's watches and queries, and anything held for them:
+    // once this returns, nothing more is sent to the client.  The events
+    // let go of, some of which may still be in the client's queue, are
+    // appended to events for the caller to destroy.
+    void Unwatch(csEventClient *client, vector<csEvent *> &events);
+
     static csThreadNetlink *GetInstance(void) { return instance; };
 
 protected:
     string name;
     csEventClient *parent;
-    vector<csEventNetlink *> event_client;
+    vector<csEventNetlink *> event_watch;
+    // Queries waiting for a free request socket
+    vector<csEventNetlink *> query_pending;
+    // Events with new replies, dispatched once per batch
+    vector<csEventNetlink *> event_reply;
 
     static csThreadNetlink *instance;
 
+    void Open(void);
+    void *EventLoop(void);
     void ProcessEvent(csEventNetlink *event);
-    void SendNetlinkQuery(csEventNetlink *event);
-    void SendNetlinkReply(struct nlmsghdr *nh);
-    void ProcessNetlinkMessage(ssize_t length);
+    void ProcessUnwatch(csEventNetlink *event);
+    int GetRequestSocket(void);
+    void StartQueries(void);
+    void EndQuery(uint32_t seq);
+    bool SendNetlinkQuery(int fd, csEventNetlink *event);
+    uint32_t SendNetlinkRequest(int fd, uint16_t type);
+    void SendNetlinkReply(int fd,
+        csNetlinkBuffer *buffer, struct nlmsghdr *nh);
+    void SendNetlinkWatch(csEventNetlink::Type type,
+        csNetlinkBuffer *buffer, struct nlmsghdr *nh,
+        bool notification = false);
+    bool IsWatched(csEventNetlink::Type type);
+    void JoinGroups(csEventNetlink::Type type);
+    void HoldChange(csEventNetlink *event,
+        time_t quiet_period, struct nlmsghdr *nh);
+    int ReleaseChanges(void);
+    void QueueReply(csEventNetlink *event,
+        csNetlinkBuffer *buffer, struct nlmsghdr *nh);
+    void DispatchReplies(void);
+    bool ReceiveNetlinkMessages(int fd);
+    void ProcessNetlinkMessage(int fd,
+        csNetlinkBuffer *buffer, ssize_t length);
+    void AllocateBuffers(size_t size);
+    void Overrun(int fd);
+    void UpdateFilter(void);
+    void QueueDump(uint16_t type);
+    void StartDump(void);
+    void EndDump(csNetlinkBuffer *buffer, struct nlmsghdr *nh);
+    int SampleLinkStats(void);
+    void UpdateLinkStats(struct nlmsghdr *nh);
+    void PublishLinkStats(void);
+
+    csNetlinkCache *cache;
+    bool cache_enable;
+    time_t route_quiet_period;
+
+    time_t stats_interval;
+    vector<string> stats_link;
+    // Published under stats_mutex; the sample being dumped, and when
+    // its dump and the one before started
+    pthread_mutex_t *stats_mutex;
+    map<int, csNetlinkLinkStats> stats;
+    map<int, csNetlinkLinkStats> stats_sample;
+    time_t stats_sample_ms;
+    time_t stats_last_ms;
+    time_t stats_next_ms;
 
 private:
     struct nl_req_t {
@@ -79,11 +323,68 @@ private:
         struct rtgenmsg gen;
     };
 
+    struct nl_socket_t {
+        int fd;
+        // Sequence number of the query being answered, zero when idle
+        uint32_t seq;
+    };
+
+    // Notifications, and our own dumps
     int fd_netlink;
-    uint8_t *nl_buffer;
+    vector<nl_socket_t> nl_socket;
+    // Queries being answered, by sequence number
+    map<uint32_t, csEventNetlink *> nl_query;
+    csNetlinkBuffer **nl_buffer;
     size_t nl_buffer_size;
+    struct mmsghdr *nl_msgs;
+    struct iovec *nl_iov;
     uint32_t nl_seq;
+    // The kernel runs one dump at a time: ours are queued
+    vector<uint16_t> nl_dump_queue;
+    uint16_t nl_dump_type;
+    uint32_t nl_dump_seq;
+    // Multicast groups joined, as well as those bound
+    uint32_t nl_groups;
+    // Multicast messages were dropped: the tables of these watch types
+    // (bits by csEventNetlink::Type) are dumped again
+    unsigned nl_resync;
+    uint32_t nl_resync_seq;
+    unsigned long nl_overruns;
+    // A watch's change to one route (link, ...): whether it was there
+    // before the first change, that change if it was a delete, and the
+    // latest
+    struct nl_change_t {
+        bool existed;
+        vector<uint8_t> before;
+        vector<uint8_t> after;
+    };
+    struct nl_hold_t {
+        time_t quiet_period;
+        time_t first_ms;
+        time_t last_ms;
+        map<string, nl_change_t> change;
+    };
+    map<csEventNetlink *, nl_hold_t> nl_hold;
+
+    void SendChanges(csEventNetlink *event, nl_hold_t &hold);
+
+    // Filters compiled into the socket filter, by watch type: an empty
+    // union is every change of the type
+    map<int, vector<csNetlinkFilter> > nl_filter;
+    bool nl_filter_attached;
     struct sockaddr_nl sa_local;
+
+    // Unwatch() waits for the thread, while it's running
+    struct nl_unwatch_t {
+        bool done;
+        vector<csEvent *> *events;
+    };
+    pthread_mutex_t *unwatch_mutex;
+    pthread_cond_t *unwatch_cond;
+    bool nl_running;
+
+    int nl_rcvbuf;
+    bool on_demand;
 };
 
 #endif // _CSNETLINK_H
@@ -35,6 +35,7 @@ using namespace std;
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 
 #include <stdio.h>
 #include <stdint.h>
@@ -45,6 +46,7 @@ using namespace std;
 #include <signal.h>
 #include <expat.h>
 #include <regex.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -58,6 +60,9 @@ using namespace std;
 #include <clearsync/csconf.h>
 #include <clearsync/csevent.h>
 #include <clearsync/csthread.h>
+#include <clearsync/csstate.h>
+#include <clearsync/csstore.h>
+#include <clearsync/csvalue.h>
 #include <clearsync/cstimer.h>
 #include <clearsync/csutil.h>
 #include <clearsync/csthread.h>
@@ -74,10 +79,23 @@ using namespace std;
         return dynamic_cast<csPlugin *>(p); \
     } }
 
-struct csPluginStateValue
+// Settings a plugin's replacement inherits when its library is reloaded
+struct csPluginAttributes
 {
-    size_t length;
-    uint8_t *value;
+    size_t stack_size;
+    bool stack_size_auto;
+    bool cpu_affinity_enable;
+    cpu_set_t cpu_affinity;
+    bool sched_nice_enable;
+    int sched_nice;
+    int sched_policy;
+    int sched_priority;
+    string state_file;
+    bool state_lazy;
+    bool state_log;
+    time_t state_log_sync_interval;
+    size_t state_log_sync_records;
+    time_t state_checkpoint_interval;
 };
 
 class csPlugin : public csThread
@@ -90,28 +108,68 @@ public:
     inline string GetName(void) { return name; };
 
     void SetStateFile(const string &state_file);
+    void SetStateLazy(bool lazy = true);
+    void SetStateLog(time_t sync_interval = _CS_STATE_LOG_SYNC_INTERVAL,
+        size_t sync_records = _CS_STATE_LOG_SYNC_RECORDS);
+    void SetStateCheckpoint(time_t interval);
+    void SetStackSizeAuto(void);
     virtual void SetConfigurationFile(const string &conf_filename) { };
 
+    void GetAttributes(csPluginAttributes &attr);
+    // Applies everything but loading the state, which the caller restores
+    void SetAttributes(const csPluginAttributes &attr);
+
     virtual void LoadState(void);
     virtual void SaveState(void);
 
+    void Stop(void);
+
+    bool ReadState(FILE *fh);
+    bool WriteState(FILE *fh);
+    bool ParseState(const uint8_t *data, size_t length, bool lazy = false);
+    bool ParseStateLegacy(const uint8_t *data, size_t length);
+
     bool GetStateVar(const string &key, unsigned long &value);
     bool GetStateVar(const string &key, float &value);
     bool GetStateVar(const string &key, string &value);
     bool GetStateVar(const string &key, size_t &length, uint8_t *value);
 
+    bool GetStateVar(const char *key, unsigned long &value);
+    bool GetStateVar(const char *key, float &value);
+    bool GetStateVar(const char *key, string &value);
+    bool GetStateVar(const char *key, size_t &length, uint8_t *value);
+
+    // Zero-copy: value remains valid until the key is next set
+    bool GetStateVar(const char *key, size_t key_length,
+        const uint8_t *&value, size_t &length);
+    bool GetStateVar(const string &key, csStateValue &value);
+
     void SetStateVar(const string &key, const unsigned long &value);
     void SetStateVar(const string &key, const float &value);
     void SetStateVar(const string &key, const string &value);
     void SetStateVar(const string &key, size_t length, const uint8_t *value);
+    void SetStateVar(const string &key, const csStateValueWriter &value);
 
 protected:
-    void SetStateVar(const string &key, struct csPluginStateValue *var);
+    void SetStateVar(const char *key, size_t key_length,
+        const uint8_t *value, size_t length);
+    void SetStateValue(const char *key, size_t key_length,
+        const uint8_t *value, size_t length);
+    bool LoadStateFile(bool &legacy, bool &replayed);
+    bool LoadStateFile(const string &state_file, bool &legacy);
+    bool LoadStateLog(const string &log_file, size_t &records);
+    bool ParseStateRecord(const uint8_t *record, size_t length);
 
     string name;
     csEventClient *parent;
-    FILE *fh_state;
-    map<string, struct csPluginStateValue *> state;
+    string state_file;
+    bool stack_size_auto;
+    bool stopped;
+    csStateLog *state_log;
+    size_t state_log_size;
+    csStateCheckpoint *state_checkpoint;
+    bool state_lazy;
+    csStateTable state;
 };
 
 #ifdef _CS_INTERNAL
@@ -121,14 +179,32 @@ class csPluginLoader
 public:
     csPluginLoader(const string &so_name,
         const string &name, csEventClient *parent, size_t stack_size);
+    // Wraps a plugin whose library is loaded elsewhere (ex: in a helper
+    // process); such a plugin is never reloaded here.
+    csPluginLoader(const string &so_name, csPlugin *plugin);
     virtual ~csPluginLoader();
 
     inline csPlugin *GetPlugin(void) { return plugin; };
 
+    // True once the library has been replaced on disk
+    bool IsModified(void);
+    // Unloads the library and loads it again, creating a new plugin
+    // instance; the previous instance must already have been deleted.
+    void Reload(void);
+
 protected:
     string so_name;
+    string so_path;
+    string name;
+    csEventClient *parent;
+    size_t stack_size;
     void *so_handle;
     csPlugin *plugin;
+    dev_t so_dev;
+    ino_t so_ino;
+    time_t so_mtime;
+
+    void Load(void);
 };
 
 #endif // _CS_INTERNAL
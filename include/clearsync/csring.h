@@ -0,0 +1,106 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CSRING_H
+#define _CSRING_H
+
+using namespace std;
+
+#ifndef _CS_RING_SIZE
+#define _CS_RING_SIZE           (256 * 1024)
+#endif
+
+// Message types
+#define _CS_RING_EVENT          'E'
+#define _CS_RING_QUIT           'Q'
+
+// Single-producer, single-consumer message ring in memory shared by two
+// processes.  The consumer sleeps on an eventfd doorbell, which is only
+// rung when the consumer has announced that it is about to sleep.  The
+// peer process holds the other end of a "lifeline" socket, which hangs
+// up when it exits.  Nothing read from the ring is trusted: a corrupt
+// ring is reported, never followed out of bounds.
+class csEventRing
+{
+public:
+    // The ring occupies GetMemorySize(size) bytes at base; size must be
+    // a power of two.  Exactly one of the two processes calls Reset().
+    csEventRing(void *base, size_t size, int doorbell, int lifeline);
+    virtual ~csEventRing();
+
+    static size_t GetMemorySize(size_t size);
+
+    void Reset(void);
+
+    inline bool IsCorrupt(void) { return corrupt; };
+    bool IsOpen(void);
+
+    // Producer: waits for room while the peer is alive, for up to
+    // wait_ms (-1: no limit, 0: don't wait); false if it's dropped
+    bool Push(uint8_t type, const uint8_t *data = NULL, size_t length = 0,
+        time_t wait_ms = -1);
+    bool Push(csEventPlugin *event, time_t wait_ms = -1);
+
+    // Consumer: false if the ring is empty (or corrupt)
+    bool Pop(uint8_t &type, vector<uint8_t> &data);
+    // Waits for a message, false if the peer has hung up
+    bool Wait(time_t wait_ms = -1);
+    // Waits for the peer to hang up, false on timeout
+    bool WaitClose(time_t wait_ms = -1);
+
+    static csEventPlugin *Decode(const vector<uint8_t> &data);
+
+protected:
+    struct Header
+    {
+        volatile uint32_t head;
+        uint8_t pad0[60];
+        volatile uint32_t tail;
+        uint8_t pad1[60];
+        volatile uint32_t waiting;
+        uint8_t pad2[60];
+    };
+
+    Header *header;
+    uint8_t *buffer;
+    uint32_t size;
+    int doorbell;
+    int lifeline;
+    bool corrupt;
+
+    bool TryPush(uint8_t type, const uint8_t *data, size_t length);
+};
+
+// Delivers events from a ring to dst, as if sent by src, until the peer
+// sends a quit or hangs up; src is then sent a csEVENT_STOPPED.  With no
+// src, events are dispatched from this thread (so they're dropped if dst
+// has gone away) and dst is sent the csEVENT_STOPPED.
+class csThreadRing : public csThread
+{
+public:
+    csThreadRing(csEventRing *ring, csEventClient *dst, csEventClient *src);
+    virtual ~csThreadRing();
+
+    virtual void *Entry(void);
+
+protected:
+    csEventRing *ring;
+    csEventClient *dst;
+    csEventClient *src;
+};
+
+#endif // _CSRING_H
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -21,6 +21,10 @@ using namespace std;
 
 #define csSocketRetry   80000
 
+#ifndef _CS_SOCKET_HANDOFF_ENV
+#define _CS_SOCKET_HANDOFF_ENV  "CLEARSYNC_LISTEN_FDS"
+#endif
+
 class csSocketTimeout : public csException
 {
 public:
@@ -81,6 +85,9 @@ public:
     void Read(size_t &length, uint8_t *buffer);
     void Write(size_t &length, uint8_t *buffer);
 
+    static void SetHandoff(bool enable = true);
+    static void ExportHandoff(void);
+
 protected:
     int sd;
     struct sockaddr_in sa;
@@ -90,6 +97,10 @@ protected:
     struct timeval tv_active;
     size_t bytes_read;
     size_t bytes_wrote;
+    string handoff_key;
+
+    static bool handoff_enable;
+    static map<string, int> handoff;
 };
 
 class csSocketAccept : public csSocket
@@ -0,0 +1,288 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CSSTATE_H
+#define _CSSTATE_H
+
+using namespace std;
+
+// State file format: a header of magic, version, record count and the
+// header's CRC-32, followed by records of key length, value length, key,
+// value and the record's CRC-32.  All integers are 32-bit little-endian.
+#define _CS_STATE_MAGIC         0x54535343
+#define _CS_STATE_VERSION       1
+#define _CS_STATE_HEADER_SIZE   16
+#define _CS_STATE_RECORD_SIZE   12
+
+// Write-ahead log: the same header (with a different magic and a record
+// count of zero) followed by state records appended as they're set.
+#define _CS_STATE_LOG_MAGIC     0x4c575343
+#define _CS_STATE_LOG_SUFFIX    ".wal"
+
+#ifndef _CS_STATE_LOG_SYNC_INTERVAL
+#define _CS_STATE_LOG_SYNC_INTERVAL 100
+#endif
+#ifndef _CS_STATE_LOG_SYNC_RECORDS
+#define _CS_STATE_LOG_SYNC_RECORDS  64
+#endif
+#ifndef _CS_STATE_LOG_COMPACT_SIZE
+#define _CS_STATE_LOG_COMPACT_SIZE  (1024 * 1024)
+#endif
+
+#ifndef _CS_STATE_INLINE_SIZE
+#define _CS_STATE_INLINE_SIZE   16
+#endif
+#ifndef _CS_STATE_ARENA_SIZE
+#define _CS_STATE_ARENA_SIZE    65536
+#endif
+
+// Open-addressing (linear probing) hash table of state values.  Keys are
+// copied into an append-only arena and values of up to
+// _CS_STATE_INLINE_SIZE bytes are stored in the slot itself, so setting
+// a small value never allocates.  Keys are never removed.
+//
+// A table can also index a mapped state file in place: SetMapped() keys
+// and values point into the mapping and a value's record is only checked
+// and copied out on its first Get().
+class csStateTable
+{
+public:
+    csStateTable();
+    csStateTable(const csStateTable &table);
+    virtual ~csStateTable();
+
+    inline size_t GetCount(void) const { return count; };
+
+    bool Get(const char *key, size_t key_length,
+        const uint8_t *&value, size_t &length) const;
+    void Set(const char *key, size_t key_length,
+        const uint8_t *value, size_t length);
+    void Clear(void);
+
+    // Takes ownership of a mapped state file, released by Clear()
+    void Map(void *data, size_t length);
+    // Key and value point into the mapping, at a record's key and value
+    void SetMapped(const char *key, size_t key_length,
+        const uint8_t *value, size_t length);
+
+    // Iterate with: for (size_t i = 0; table.Next(i, ...); ) { }
+    bool Next(size_t &index, const char *&key, size_t &key_length,
+        const uint8_t *&value, size_t &length) const;
+
+protected:
+    enum SlotFlags
+    {
+        Mapped = 0x01,
+        Corrupt = 0x02
+    };
+
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t key_length;
+        const char *key;
+        uint32_t length;
+        uint32_t flags;
+        union
+        {
+            uint8_t *value;
+            uint8_t data[_CS_STATE_INLINE_SIZE];
+        };
+    };
+
+    Slot *slots;
+    size_t capacity;
+    size_t count;
+
+    vector<char *> arena;
+    size_t arena_used;
+
+    void *map;
+    size_t map_length;
+
+    static uint32_t Hash(const char *key, size_t key_length);
+    static bool Verify(const Slot *slot);
+    Slot *Find(const char *key, size_t key_length, uint32_t hash) const;
+    Slot *Insert(const char *key, size_t key_length, bool &created);
+    const uint8_t *Load(Slot *slot) const;
+    void Grow(void);
+    const char *ArenaCopy(const char *key, size_t key_length);
+
+private:
+    csStateTable &operator=(const csStateTable &table);
+};
+
+inline uint32_t csGetLE32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void csPutLE32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+void csStateSetHeader(uint8_t *header, uint32_t magic, uint32_t records);
+bool csStateCheckHeader(const uint8_t *header,
+    uint32_t magic, uint32_t &records);
+// Checks a record's lengths fit and its CRC-32 matches
+bool csStateCheckRecord(const uint8_t *data, size_t remaining, size_t &length);
+uint8_t *csStateRecord(const char *key, size_t key_length,
+    const uint8_t *value, size_t value_length, size_t &length);
+bool csStateWrite(FILE *fh, const csStateTable &state);
+bool csStateSave(const string &filename, const csStateTable &state);
+
+class csStateLog
+{
+public:
+    csStateLog(const string &filename,
+        time_t sync_interval = _CS_STATE_LOG_SYNC_INTERVAL,
+        size_t sync_records = _CS_STATE_LOG_SYNC_RECORDS);
+    virtual ~csStateLog();
+
+    inline const string &GetFilename(void) { return filename; };
+    inline time_t GetSyncInterval(void) { return sync_interval; };
+    inline size_t GetSyncRecords(void) { return sync_records; };
+
+    bool Append(const uint8_t *record, size_t length);
+    bool Sync(void);
+    bool Reset(void);
+    void Remove(void);
+
+    inline bool IsPending(void) { return (pending > 0); };
+    time_t GetSyncRemaining(void);
+
+protected:
+    friend class csThreadState;
+
+    string filename;
+    int fd;
+    size_t pending;
+    time_t sync_interval;
+    size_t sync_records;
+    struct timespec sync_time;
+
+    bool Open(void);
+};
+
+// Takes a checkpoint's snapshot on the state thread, when the checkpoint
+// is reached, of state that can be read while it's being changed.
+class csStateSnapshot
+{
+public:
+    virtual ~csStateSnapshot() { };
+
+    virtual csStateTable *Take(void) = 0;
+};
+
+class csStateCheckpoint
+{
+public:
+    csStateCheckpoint(const string &state_file, csStateTable *state,
+        csStateLog *log, time_t interval);
+    virtual ~csStateCheckpoint();
+
+    // Held while the state is changed, so that a snapshot is never torn
+    // and is queued in order with the change's log record.
+    inline void Lock(void) { pthread_mutex_lock(&mutex); };
+    inline void Unlock(void) { pthread_mutex_unlock(&mutex); };
+
+    inline void SetDirty(void) { dirty = true; };
+    inline time_t GetInterval(void) { return interval; };
+
+protected:
+    friend class csThreadState;
+
+    string state_file;
+    csStateTable *state;
+    csStateLog *log;
+    time_t interval;
+    struct timespec next;
+    bool dirty;
+    pthread_mutex_t mutex;
+};
+
+class csEventState : public csEvent
+{
+public:
+    enum Type
+    {
+        Append,
+        Checkpoint,
+        Flush,
+        Exit
+    };
+
+    csEventState(Type type, csStateLog *log = NULL);
+    virtual ~csEventState();
+
+    inline Type GetType(void) { return type; };
+    inline csStateLog *GetLog(void) { return log; };
+
+protected:
+    friend class csThreadState;
+
+    Type type;
+    csStateLog *log;
+    uint8_t *record;
+    size_t length;
+    string state_file;
+    csStateTable *snapshot;
+    csStateSnapshot *source;
+    bool *done;
+    pthread_mutex_t *done_mutex;
+    pthread_cond_t *done_cond;
+};
+
+class csThreadState : public csThread
+{
+public:
+    csThreadState();
+    virtual ~csThreadState();
+
+    virtual void *Entry(void);
+
+    void Append(csStateLog *log, uint8_t *record, size_t length);
+    void Checkpoint(csStateLog *log,
+        const string &state_file, csStateTable *snapshot);
+    void Checkpoint(csStateLog *log,
+        const string &state_file, csStateSnapshot *source);
+    void Flush(csStateLog *log = NULL);
+
+    void AddCheckpoint(csStateCheckpoint *checkpoint);
+    void RemoveCheckpoint(csStateCheckpoint *checkpoint);
+
+    static csThreadState *GetInstance(void) { return instance; };
+
+protected:
+    static csThreadState *instance;
+
+    set<csStateLog *> pending;
+
+    pthread_mutex_t checkpoint_mutex;
+    vector<csStateCheckpoint *> checkpoints;
+
+    void Process(csEventState *event);
+    void Sync(bool expired_only);
+    time_t Snapshot(void);
+};
+
+#endif // _CSSTATE_H
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
@@ -0,0 +1,156 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CSSTORE_H
+#define _CSSTORE_H
+
+using namespace std;
+
+// Store log records carry an operation byte ahead of the value; each
+// transaction ends with a record with an empty key whose value is the
+// transaction's record count.
+#define _CS_STORE_OP_SET        'S'
+#define _CS_STORE_OP_DELETE     'D'
+
+class csStateStore;
+
+// Reads see the store as it was when the transaction began, plus the
+// transaction's own writes.  Writes are buffered until Commit().
+class csStateTransaction
+{
+public:
+    csStateTransaction(csStateStore *store = NULL);
+    virtual ~csStateTransaction();
+
+    bool Get(const string &ns, const string &key, string &value);
+    void List(const string &ns, vector<string> &keys);
+    void Set(const string &ns, const string &key, const string &value);
+    void Delete(const string &ns, const string &key);
+
+    // Fails if another transaction changed one of the same keys since
+    // this one began; nothing is written and the caller should retry.
+    bool Commit(void);
+    void Abort(void);
+
+protected:
+    friend class csStateStore;
+
+    csStateStore *store;
+    uint64_t version;
+    bool active;
+    // Key to (deleted, value)
+    map<string, pair<bool, string> > writes;
+};
+
+#ifndef _CS_STORE_HEIGHT
+#define _CS_STORE_HEIGHT        16
+#endif
+
+// Daemon-wide key-value store shared by plugins, kept in memory with
+// every committed version a live transaction may still read.  The file
+// uses the state file format with keys of "namespace\0key", and commits
+// are appended to a write-ahead log by the state thread.
+//
+// Keys are held in a skip list, each with its versions newest first.
+// Readers walk both without locking; only a commit changes them, under
+// the store's mutex, and what it unlinks is freed once no reader can
+// still be on it.
+class csStateStore
+{
+public:
+    csStateStore(const string &filename);
+    virtual ~csStateStore();
+
+    static csStateStore *GetInstance(void) { return instance; };
+
+protected:
+    friend class csStateTransaction;
+    friend class csStateStoreSnapshot;
+
+    struct Version
+    {
+        uint64_t version;
+        bool deleted;
+        string value;
+        Version * volatile next;
+    };
+
+    struct Key
+    {
+        string key;
+        Version * volatile versions;
+        int height;
+        Key * volatile *next;
+
+        Key(const string &key, int height);
+        ~Key() { delete [] next; };
+    };
+
+    static csStateStore *instance;
+
+    string filename;
+    csStateLog *log;
+    size_t log_size;
+
+    pthread_mutex_t mutex;
+    uint64_t version;
+    multiset<uint64_t> snapshots;
+
+    Key *head;
+    size_t keys;
+    uint32_t seed;
+
+    volatile int readers;
+    vector<Key *> retired_keys;
+    vector<Version *> retired_versions;
+
+    uint64_t Begin(void);
+    void End(uint64_t version);
+    bool Read(const string &key, uint64_t version, string &value);
+    void Scan(const string &prefix, uint64_t version, set<string> &keys);
+    bool Commit(csStateTransaction *transaction);
+
+    Key *Find(const string &key, Key **prev = NULL);
+    const Version *Find(const Key *k, uint64_t version);
+    int GetRandomHeight(void);
+    void Apply(const string &key, bool deleted, const string &value);
+    void Prune(Key *k, Key **prev, uint64_t oldest);
+    void Reap(void);
+    void Clear(void);
+    csStateTable *Snapshot(uint64_t version);
+
+    bool Load(void);
+    bool LoadLog(void);
+};
+
+// The store as of a version, kept from being pruned until the state
+// thread has taken it for a checkpoint.
+class csStateStoreSnapshot : public csStateSnapshot
+{
+public:
+    csStateStoreSnapshot(csStateStore *store, uint64_t version)
+        : store(store), version(version) { };
+    virtual ~csStateStoreSnapshot() { store->End(version); };
+
+    virtual csStateTable *Take(void) { return store->Snapshot(version); };
+
+protected:
+    csStateStore *store;
+    uint64_t version;
+};
+
+#endif // _CSSTORE_H
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4
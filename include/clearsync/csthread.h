@@ -23,20 +23,62 @@ using namespace std;
 #define _CS_THREAD_STACK_SIZE   32768
 #endif
 
+struct csThreadStats
+{
+    pid_t tid;
+    struct timespec cpu_time;
+    unsigned long ctxt_voluntary;
+    unsigned long ctxt_involuntary;
+    unsigned long events;
+    unsigned long wakeups;
+};
+
 class csThread : public csEventClient
 {
 public:
     csThread(size_t stack_size = _CS_THREAD_STACK_SIZE);
-    virtual ~csThread() { };
+    virtual ~csThread();
 
     virtual void Start(void);
     virtual void *Entry(void) = 0;
 
+    void Join(void);
+
+    inline const string &GetThreadName(void) { return thread_name; };
+    void SetThreadName(const string &name);
+    void GetStats(struct csThreadStats &stats);
+
+    inline size_t GetStackSize(void) { return stack_size; };
+    void SetStackSize(size_t stack_size);
+    size_t GetStackHighWater(void);
+    size_t GetStackRecommended(void);
+
+    void SetCpuAffinity(const cpu_set_t &cpus);
+    void SetNice(int nice);
+    void SetSchedulingPolicy(int policy, int priority = 0);
+
+    static int GetSchedulingPolicy(const string &name);
+    static const char *GetSchedulingPolicyName(int policy);
+
 protected:
     pthread_t id;
     pthread_attr_t attr;
+    pid_t tid;
+    string thread_name;
 
-    void Join(void);
+    uint8_t *stack;
+    size_t stack_size;
+    size_t stack_guard;
+    size_t stack_high_water;
+
+    cpu_set_t *cpu_affinity;
+    bool sched_nice_enable;
+    int sched_nice;
+    int sched_policy;
+    int sched_priority;
+
+    static void *ThreadEntry(void *param);
+    void ApplyScheduling(void);
 };
 
 #endif // _CSTHREAD_H
@@ -49,6 +49,9 @@ protected:
 
 long csGetPageSize(void);
 
+void csStringToCpuList(const string &text, cpu_set_t &cpus);
+void csCpuListToString(const cpu_set_t &cpus, string &text);
+
 int csExecute(const string &command);
 int csExecute(const string &command, vector<string> &output);
 
@@ -63,6 +66,8 @@ void csGetGroupName(gid_t gid, string &name);
 void csSHA1(const string &filename, uint8_t *digest);
 void csSHA1(uint8_t *buffer, size_t length, uint8_t *digest);
 
+uint32_t csCRC32(const void *data, size_t length, uint32_t crc = 0);
+
 void csHexToBinary(const string &hex, uint8_t *bin, size_t length);
 void csBinaryToHex(const uint8_t *bin, string &hex, size_t length);
 void csBinaryToHex(const uint8_t *bin, char *hex, size_t length);
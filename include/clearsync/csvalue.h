@@ -0,0 +1,146 @@
+// ClearSync: system synchronization daemon.
+// Copyright (C) 2011-2012 ClearFoundation <http://www.clearfoundation.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CSVALUE_H
+#define _CSVALUE_H
+
+using namespace std;
+
+// Typed value encoding: a tag byte followed by the payload.  Integers and
+// lengths are LEB128 varints (signed integers zigzag encoded), doubles are
+// 8 bytes little-endian.  Lists and maps carry their payload length, then
+// their element count; map keys are a length and bytes, without a tag.
+#define _CS_VALUE_NULL          0x00
+#define _CS_VALUE_FALSE         0x01
+#define _CS_VALUE_TRUE          0x02
+#define _CS_VALUE_INT64         0x03
+#define _CS_VALUE_UINT64        0x04
+#define _CS_VALUE_DOUBLE        0x05
+#define _CS_VALUE_BYTES         0x06
+#define _CS_VALUE_STRING        0x07
+#define _CS_VALUE_LIST          0x08
+#define _CS_VALUE_MAP           0x09
+
+#ifndef _CS_VALUE_MAX_DEPTH
+#define _CS_VALUE_MAX_DEPTH     32
+#endif
+
+// Read-only view of an encoded value; nothing is copied, so the view is
+// only valid as long as the data it was made from.
+class csStateValue
+{
+public:
+    enum Type
+    {
+        TypeInvalid,
+        TypeNull,
+        TypeBool,
+        TypeInt64,
+        TypeUInt64,
+        TypeDouble,
+        TypeBytes,
+        TypeString,
+        TypeList,
+        TypeMap
+    };
+
+    csStateValue();
+    // Checks the whole encoding; an invalid value has TypeInvalid
+    csStateValue(const uint8_t *data, size_t length);
+
+    inline bool IsValid(void) const { return (type != TypeInvalid); };
+    inline Type GetType(void) const { return type; };
+
+    // Integers convert to one another (and to double) when they fit
+    bool GetBool(bool &value) const;
+    bool GetInt64(int64_t &value) const;
+    bool GetUInt64(uint64_t &value) const;
+    bool GetDouble(double &value) const;
+    bool GetBytes(const uint8_t *&value, size_t &length) const;
+    bool GetString(const char *&value, size_t &length) const;
+    bool GetString(string &value) const;
+
+    // Lists and maps: iterate with: for (size_t i = 0; v.Next(i, ...); )
+    inline size_t GetCount(void) const { return count; };
+    bool Next(size_t &offset, csStateValue &item) const;
+    bool Next(size_t &offset, const char *&key, size_t &key_length,
+        csStateValue &item) const;
+    bool Find(const string &key, csStateValue &item) const;
+
+protected:
+    Type type;
+    const uint8_t *payload;
+    size_t length;
+    size_t count;
+    uint64_t number;
+
+    void Decode(const uint8_t *data, size_t length);
+    static size_t Check(const uint8_t *data, size_t length, int depth);
+};
+
+// Builds an encoded value, e.g. a map of a string and a list:
+//   writer.BeginMap();
+//   writer.PutKey("path"); writer.PutString("/etc/hosts");
+//   writer.PutKey("sizes"); writer.BeginList(); ... writer.EndList();
+//   writer.EndMap();
+class csStateValueWriter
+{
+public:
+    csStateValueWriter();
+    virtual ~csStateValueWriter();
+
+    void PutNull(void);
+    void PutBool(bool value);
+    void PutInt64(int64_t value);
+    void PutUInt64(uint64_t value);
+    void PutDouble(double value);
+    void PutBytes(const uint8_t *value, size_t length);
+    void PutString(const char *value, size_t length);
+    void PutString(const string &value);
+
+    void BeginList(void);
+    void EndList(void);
+    void BeginMap(void);
+    void PutKey(const string &key);
+    void EndMap(void);
+
+    void Clear(void);
+
+    // Only complete once every list and map has been ended
+    inline const uint8_t *GetData(void) const {
+        return (data.empty()) ? NULL : &data[0];
+    };
+    inline size_t GetLength(void) const { return data.size(); };
+
+protected:
+    struct Container
+    {
+        uint8_t tag;
+        size_t offset;
+        size_t count;
+        bool key;
+    };
+
+    vector<uint8_t> data;
+    vector<Container> open;
+
+    void Put(uint8_t tag);
+    void PutVarint(uint64_t value);
+    void End(uint8_t tag);
+};
+
+#endif // _CSVALUE_H
+// vi: expandtab shiftwidth=4 softtabstop=4 tabstop=4